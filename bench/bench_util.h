@@ -0,0 +1,64 @@
+#ifndef SLACK_GTK_BENCH_UTIL_H
+#define SLACK_GTK_BENCH_UTIL_H
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Helpers shared by the benchmarks under bench/. They are built with
+// `make bench` and aren't part of the default build.
+
+// Resident set size of the process in KiB, or 0 if /proc isn't available
+inline long resident_kib() {
+  std::ifstream ifs("/proc/self/status");
+  std::string line;
+  while (std::getline(ifs, line)) {
+    if (line.compare(0, 6, "VmRSS:") == 0) {
+      return std::strtol(line.c_str() + 6, nullptr, 10);
+    }
+  }
+  return 0;
+}
+
+inline double milliseconds_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+// Returns argv[index] as a count, or fallback if it's missing or invalid.
+inline std::size_t count_argument(int argc, char* argv[], int index,
+                                  std::size_t fallback) {
+  if (index >= argc) {
+    return fallback;
+  }
+  const long count = std::strtol(argv[index], nullptr, 10);
+  return count > 0 ? count : fallback;
+}
+
+// Message texts as Slack sends them, mixing plain text with mrkdwn, entities,
+// links, mentions, emoji and code, to be cycled through.
+inline const std::vector<std::string>& sample_texts() {
+  static const std::vector<std::string> texts = {
+      "Good morning, the build is green again.",
+      "*Deploy* of _api_ to ~staging~ production is done :tada:",
+      "<@U1|bench> can you take a look at "
+      "<https://example.com/pull/123|the pull request>?",
+      "The error is `TypeError: undefined is not a function` &amp; it "
+      "happens on every reload &lt;3",
+      "&gt; quoted from the incident report\nand the answer below it",
+      "Steps:\n- open the settings\n- turn *off* the cache\n- reload",
+      "```\nint main() {\n  return 0;\n}\n```",
+      "<!here> the office is closed tomorrow :palm_tree: :sunny:",
+      "Long message: Lorem ipsum dolor sit amet, consectetur adipiscing "
+      "elit, sed do eiusmod tempor incididunt ut labore et dolore magna "
+      "aliqua. Ut enim ad minim veniam, quis nostrud exercitation ullamco "
+      "laboris nisi ut aliquip ex ea commodo consequat.",
+      "see <#C1|general> and <https://example.com/docs>",
+  };
+  return texts;
+}
+
+#endif
@@ -0,0 +1,113 @@
+// Compares highlight_matcher with looking for each pattern in turn with
+// std::string::find, for growing numbers of highlight words.
+//   ./bench-highlight [messages]
+#include <glib.h>
+#include <cstdio>
+#include <iostream>
+#include "bench_util.h"
+#include "highlight_matcher.h"
+
+static const std::size_t default_count = 200000;
+static const std::size_t keyword_counts[] = {1, 10, 100, 1000};
+static const char self_id[] = "U0";
+
+static std::string casefold(const std::string& s) {
+  gchar* folded = g_utf8_casefold(s.c_str(), s.size());
+  const std::string result(folded);
+  g_free(folded);
+  return result;
+}
+
+// The same patterns as highlight_matcher, tried one after another
+class naive_matcher {
+ public:
+  naive_matcher(const std::vector<std::string>& keywords)
+      : patterns_({"<!channel", "<!here", "<!everyone",
+                   std::string("<@") + self_id + ">",
+                   std::string("<@") + self_id + "|"}) {
+    for (const std::string& keyword : keywords) {
+      patterns_.push_back(casefold(keyword));
+    }
+  }
+
+  bool matches(const Json::Value& message) const {
+    if (message["user"].asString() == self_id) {
+      return false;
+    }
+    if (scan(casefold(message["text"].asString()))) {
+      return true;
+    }
+    for (const Json::Value& attachment : message["attachments"]) {
+      if (scan(casefold(attachment["fallback"].asString()))) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+ private:
+  bool scan(const std::string& text) const {
+    for (const std::string& pattern : patterns_) {
+      if (text.find(pattern) != std::string::npos) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  std::vector<std::string> patterns_;
+};
+
+template <class Matcher>
+static double nanoseconds_per_message(const Matcher& matcher,
+                                      const std::vector<Json::Value>& messages,
+                                      std::size_t count,
+                                      std::size_t& matched) {
+  matched = 0;
+  const auto start = std::chrono::steady_clock::now();
+  for (std::size_t i = 0; i < count; ++i) {
+    if (matcher.matches(messages[i % messages.size()])) {
+      ++matched;
+    }
+  }
+  return milliseconds_since(start) * 1000000 / count;
+}
+
+int main(int argc, char* argv[]) {
+  const std::size_t count = count_argument(argc, argv, 1, default_count);
+
+  std::vector<Json::Value> messages;
+  for (const std::string& text : sample_texts()) {
+    Json::Value message(Json::objectValue);
+    message["type"] = "message";
+    message["user"] = "U1";
+    message["text"] = text;
+    messages.push_back(message);
+  }
+
+  for (std::size_t keyword_count : keyword_counts) {
+    // Words that don't occur in the messages, as most highlight words
+    // don't, so that every pattern is tried
+    std::vector<std::string> keywords;
+    for (std::size_t i = 0; i < keyword_count; ++i) {
+      char keyword[32];
+      std::snprintf(keyword, sizeof(keyword), "Keyword%zu", i);
+      keywords.push_back(keyword);
+    }
+    highlight_matcher automaton(self_id);
+    automaton.set_keywords(keywords);
+    const naive_matcher naive(keywords);
+
+    std::size_t automaton_matched = 0;
+    std::size_t naive_matched = 0;
+    const double automaton_ns =
+        nanoseconds_per_message(automaton, messages, count, automaton_matched);
+    const double naive_ns =
+        nanoseconds_per_message(naive, messages, count, naive_matched);
+    std::cout << keyword_count << " keywords: Aho-Corasick " << automaton_ns
+              << " ns/message, find " << naive_ns << " ns/message ("
+              << automaton_matched << " and " << naive_matched
+              << " matched)" << std::endl;
+  }
+  return 0;
+}
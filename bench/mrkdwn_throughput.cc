@@ -0,0 +1,43 @@
+// Measures how many messages per second mrkdwn_formatter turns into
+// rich_text, with handlers that append links and emoji as plain text.
+//   ./bench-mrkdwn [messages]
+#include <iostream>
+#include "bench_util.h"
+#include "mrkdwn_formatter.h"
+#include "rich_text.h"
+
+static const std::size_t default_count = 1000000;
+
+int main(int argc, char* argv[]) {
+  const std::size_t count = count_argument(argc, argv, 1, default_count);
+  const std::vector<std::string>& texts = sample_texts();
+
+  rich_text out;
+  mrkdwn_formatter formatter(
+      out,
+      [&out](const std::string& link) {
+        out.append_link(link, rich_text::LINK_URL, link);
+      },
+      [&out](const std::string& name) { out.append(":" + name + ":"); },
+      [](std::size_t, std::size_t, std::size_t) {});
+  formatter.set_max_code_block_lines(30);
+
+  std::size_t bytes = 0;
+  std::size_t output_bytes = 0;
+  const auto start = std::chrono::steady_clock::now();
+  for (std::size_t i = 0; i < count; ++i) {
+    const std::string& text = texts[i % texts.size()];
+    out.clear();
+    formatter.format(text);
+    bytes += text.size();
+    output_bytes += out.text.size();
+  }
+  const double elapsed_ms = milliseconds_since(start);
+
+  // output_bytes keeps the work from being optimized away.
+  std::cout << count << " messages (" << bytes << " bytes, " << output_bytes
+            << " bytes out) in " << elapsed_ms << " ms: "
+            << count / elapsed_ms * 1000 << " messages/s, "
+            << bytes / elapsed_ms / 1000 << " MB/s" << std::endl;
+  return 0;
+}
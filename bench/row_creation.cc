@@ -0,0 +1,139 @@
+// Measures the time to create and lay out message rows, and the memory they
+// take, in one of three modes:
+//   rows       MessageRows, as ChannelWindow builds them
+//   bodies     MessageTextViews alone, which draw with a MessageBody
+//   textviews  Gtk::TextViews holding the same texts, for comparison
+//
+// Each mode runs in its own process so that memory freed by another mode
+// doesn't hide what this one takes. It needs a display and the compiled
+// schema, e.g. from the build directory:
+//   GSETTINGS_SCHEMA_DIR=schemas ./bench-rows rows 2000
+#define G_SETTINGS_ENABLE_BACKEND
+#include <gio/gsettingsbackend.h>
+#include <glibmm/miscutils.h>
+#include <gtkmm/box.h>
+#include <gtkmm/listbox.h>
+#include <gtkmm/main.h>
+#include <gtkmm/offscreenwindow.h>
+#include <gtkmm/textview.h>
+#include <cstdio>
+#include <iostream>
+#include "api_client.h"
+#include "bench_util.h"
+#include "message_row.h"
+#include "message_text_view.h"
+#include "settings_snapshot.h"
+#include "team.h"
+
+static const std::size_t default_count = 1000;
+static const int window_width = 600;
+
+// Settings in memory, so that the user's aren't read or changed. Link
+// previews are off to keep the network out of the measurement.
+static std::shared_ptr<settings_snapshot> create_settings() {
+  GSettingsBackend* backend = g_memory_settings_backend_new();
+  GSettings* settings =
+      g_settings_new_with_backend("cc.wanko.slack-gtk", backend);
+  g_object_unref(backend);
+  g_settings_set_boolean(settings, "link-previews", FALSE);
+  return std::make_shared<settings_snapshot>(Glib::wrap(settings));
+}
+
+// rtm.start with just what rows look up
+static Json::Value rtm_start() {
+  Json::Value json(Json::objectValue);
+  json["self"]["id"] = "U0";
+  Json::Value user(Json::objectValue);
+  user["id"] = "U1";
+  user["name"] = "bench";
+  json["users"].append(user);
+  Json::Value channel(Json::objectValue);
+  channel["id"] = "C1";
+  channel["name"] = "general";
+  json["channels"].append(channel);
+  return json;
+}
+
+static Json::Value message(std::size_t i) {
+  const std::vector<std::string>& texts = sample_texts();
+  char ts[32];
+  std::snprintf(ts, sizeof(ts), "1466000000.%06zu", i);
+  Json::Value payload(Json::objectValue);
+  payload["type"] = "message";
+  payload["user"] = "U1";
+  payload["text"] = texts[i % texts.size()];
+  payload["ts"] = ts;
+  return payload;
+}
+
+static void run_main_loop() {
+  while (Gtk::Main::events_pending()) {
+    Gtk::Main::iteration(false);
+  }
+}
+
+int main(int argc, char* argv[]) {
+  Gtk::Main kit(argc, argv);
+  const std::string mode = argc > 1 ? argv[1] : "rows";
+  const std::size_t count = count_argument(argc, argv, 2, default_count);
+  if (mode != "rows" && mode != "bodies" && mode != "textviews") {
+    std::cerr << "Usage: " << argv[0] << " [rows|bodies|textviews] [count]"
+              << std::endl;
+    return 1;
+  }
+
+  std::string emoji_directory = Glib::getenv("SLACK_GTK_EMOJI_DIRECTORY");
+  if (emoji_directory.empty()) {
+    emoji_directory = "emoji-data";
+  }
+  team bench_team(std::make_shared<api_client>("https://slack.com/api", ""),
+                  emoji_directory, rtm_start());
+  std::shared_ptr<settings_snapshot> settings = create_settings();
+
+  Gtk::OffscreenWindow window;
+  window.set_size_request(window_width, -1);
+  Gtk::ListBox list_box;
+  Gtk::Box box(Gtk::ORIENTATION_VERTICAL);
+  if (mode == "rows") {
+    window.add(list_box);
+  } else {
+    window.add(box);
+  }
+  window.show_all();
+  run_main_loop();
+
+  const long rss_before = resident_kib();
+  const auto start = std::chrono::steady_clock::now();
+  for (std::size_t i = 0; i < count; ++i) {
+    if (mode == "rows") {
+      // Groups of five messages, as from a chatty user
+      auto row = Gtk::manage(
+          new MessageRow(bench_team, settings, "C1", message(i), i % 5 != 0));
+      list_box.append(*row);
+      row->show();
+    } else if (mode == "bodies") {
+      auto view = Gtk::manage(new MessageTextView(bench_team, settings));
+      view->set_text(message(i)["text"].asString(), true);
+      box.pack_start(*view, Gtk::PACK_SHRINK);
+      view->show();
+    } else {
+      auto view = Gtk::manage(new Gtk::TextView());
+      view->set_wrap_mode(Gtk::WRAP_WORD_CHAR);
+      view->set_editable(false);
+      view->get_buffer()->set_text(message(i)["text"].asString());
+      box.pack_start(*view, Gtk::PACK_SHRINK);
+      view->show();
+    }
+  }
+  const double created_ms = milliseconds_since(start);
+  run_main_loop();
+  const double laid_out_ms = milliseconds_since(start);
+  const long rss_after = resident_kib();
+
+  std::cout << mode << ": " << count << " created in " << created_ms
+            << " ms (" << created_ms * 1000 / count << " us each), laid out "
+            << "after " << laid_out_ms << " ms, "
+            << double(rss_after - rss_before) / count << " KiB each"
+            << std::endl;
+  return 0;
+}
@@ -23,6 +23,9 @@ class api_client {
   void queue_post(const std::string& method_name,
                   const std::map<std::string, std::string>& params,
                   const post_callback_type& callback);
+  // Number of queued requests whose response hasn't arrived yet
+  std::size_t pending_requests() const;
+  const std::string& token() const;
 
  private:
   void setup();
@@ -1,16 +1,58 @@
 #ifndef SLACK_GTK_ATTACHMENTS_VIEW_H
 #define SLACK_GTK_ATTACHMENTS_VIEW_H
 
-#include <giomm/settings.h>
+#include <gdkmm/rgba.h>
 #include <gtkmm/box.h>
+#include <gtkmm/image.h>
 #include <json/json.h>
+#include <vector>
+#include "icon_loader.h"
+#include "settings_snapshot.h"
 #include "team.h"
 
+class MessageTextView;
+
+// Shows message attachments with their color bar, title, text, fields and
+// image previews. Previews are loaded once the row is on screen, and
+// dropped again when it is far off screen.
 class AttachmentsView : public Gtk::Box {
  public:
-  AttachmentsView(team& team, Glib::RefPtr<Gio::Settings> settings,
+  AttachmentsView(team& team, std::shared_ptr<settings_snapshot> settings,
                   const Json::Value& attachments);
   ~AttachmentsView() override;
+
+  // Adds an attachment (e.g. a link preview loaded later) at position
+  // among the others, without rebuilding them.
+  void insert_attachment(int position, const Json::Value& attachment);
+  // Formats the texts again, e.g. after emojis or user names have arrived.
+  void redraw_texts();
+  void rescale_emojis();
+  void set_on_screen();
+  void set_off_screen();
+
+ private:
+  struct preview {
+    std::string url;
+    int size;
+    Gtk::Image* image;
+    icon_loader::request_id request;
+    bool loaded;
+  };
+
+  // Returns the box holding the attachment.
+  Gtk::Box* add_attachment(const Json::Value& attachment);
+  void add_text(Gtk::Box& box, const std::string& text);
+  void add_fields(Gtk::Box& box, const Json::Value& fields);
+  void add_preview(Gtk::Box& box, const std::string& url, int size,
+                   const Json::Value& width, const Json::Value& height);
+  void load_preview(std::size_t index);
+  void on_preview_loaded(std::size_t index, Glib::RefPtr<Gdk::Pixbuf> pixbuf);
+
+  team& team_;
+  std::shared_ptr<settings_snapshot> settings_;
+  std::vector<MessageTextView*> text_views_;
+  std::vector<preview> previews_;
+  bool on_screen_;
 };
 
 #endif
@@ -7,9 +7,16 @@ class BottomAdjustment : public Gtk::Adjustment {
  public:
   virtual ~BottomAdjustment() override;
 
-  static Glib::RefPtr<Gtk::Adjustment> create(
+  static Glib::RefPtr<BottomAdjustment> create(
       Glib::RefPtr<Gtk::Adjustment> adj);
 
+  // When content is next inserted or removed above the viewport, keep the
+  // distance from the bottom so that the visible content doesn't move. Call
+  // keep_value() to cancel it before content is changed below the viewport
+  // instead.
+  void keep_distance_from_bottom();
+  void keep_value();
+
  protected:
   BottomAdjustment(double value, double lower, double upper,
                    double step_increment, double page_increment,
@@ -20,6 +27,10 @@ class BottomAdjustment : public Gtk::Adjustment {
 
  private:
   bool is_bottom;
+  bool keep_distance_from_bottom_;
+  double distance_from_bottom_;
+  // upper when keep_distance_from_bottom() was called
+  double kept_upper_;
 };
 
 #endif
@@ -8,12 +8,14 @@ struct channel {
   std::string name;
   bool is_member;
   int unread_count;
+  std::string last_read;
 
   channel(const Json::Value& c)
       : id(c["id"].asString()),
         name(c["name"].asString()),
         is_member(c["is_member"].asBool()),
-        unread_count(c["unread_count"].asInt()) {
+        unread_count(c["unread_count"].asInt()),
+        last_read(c["last_read"].asString()) {
   }
 };
 
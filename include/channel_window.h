@@ -1,56 +1,141 @@
 #ifndef SLACK_GTK_CHANNEL_WINDOW_H
 #define SLACK_GTK_CHANNEL_WINDOW_H
 
-#include <giomm/settings.h>
 #include <glibmm/property.h>
 #include <gtkmm/box.h>
 #include <gtkmm/listbox.h>
 #include <json/json.h>
 #include <boost/optional.hpp>
+#include <chrono>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
 #include "channel.h"
+#include "settings_snapshot.h"
 #include "team.h"
 
+class BottomAdjustment;
 class MessageRow;
 
 class ChannelWindow : public Gtk::Box {
  public:
-  ChannelWindow(team& team, Glib::RefPtr<Gio::Settings> settings,
+  ChannelWindow(team& team, std::shared_ptr<settings_snapshot> settings,
                 const channel& chan);
+  ~ChannelWindow() override;
 
   const std::string& id() const;
   const std::string& name() const;
   sigc::signal<void, const std::string&> channel_link_signal();
+  // Emitted with the summary of each new message mentioning the user or
+  // containing a highlight word
+  sigc::signal<void, const std::string&> notification_signal();
 
   Glib::PropertyProxy<int> property_unread_count();
   int unread_count() const;
 
-  void mark_as_read(const std::string& ts);
+  // Loads the page of history just before the oldest loaded message.
   void load_history();
+  // Fetches the first page of history without building rows. The rows are
+  // built when the channel becomes visible.
+  void prefetch_history();
+  bool needs_prefetch() const;
+  std::size_t prefetched_bytes() const;
 
   void on_message_signal(const Json::Value& payload);
   void on_channel_marked(const Json::Value& payload);
+  void on_reaction_added(const Json::Value& payload);
+  void on_reaction_removed(const Json::Value& payload);
   MessageRow* append_message(const Json::Value& payload);
-  MessageRow* prepend_message(const Json::Value& payload);
+  // continuation tells whether payload continues the message just before
+  // it, if that is known.
+  MessageRow* prepend_message(const Json::Value& payload, bool continuation);
   void on_channels_history(const boost::optional<Json::Value>& result);
+  void on_prefetched_history(const boost::optional<Json::Value>& result);
   void on_channel_link_clicked(const std::string& channel_id);
   void on_channel_visible();
 
   void redraw_messages();
+  // Redraws the rows now if the channel is shown, or else the next time it
+  // is shown.
+  void invalidate_messages();
+  // Like invalidate_messages, but only reloads images at the current sizes.
+  void invalidate_images();
 
  private:
-  void send_notification(const MessageRow* row) const;
+  void send_notification(const Json::Value& payload);
+  // Gives the row at index a header unless it continues the row above.
+  void update_continuation(int index);
+  void rescale_images();
+  // Events change messages of the prefetched page, which would be shown
+  // stale; it's fetched again when the channel is shown instead.
+  void drop_prefetched_history();
+  void on_thread_reply(const Json::Value& payload);
+  // Updates the reply count of the parent of a thread.
+  void on_message_replied(const Json::Value& message);
+  void on_message_changed(const Json::Value& message);
+  void on_message_deleted(const std::string& ts);
+  // Applies a reaction event to the message that isn't rendered as a row.
+  void update_stored_reactions(const Json::Value& payload, bool added);
+  // Returns the rendered row of the message at ts, or nullptr.
+  MessageRow* find_row(const std::string& ts) const;
+  void add_row(MessageRow* row);
+  void schedule_scroll_update();
+  bool on_scroll_update_idle();
+  void update_on_screen_rows();
+  void update_history_window();
+  void restore_newer_rows();
+  void unload_newer_rows();
+  void unload_older_rows();
+  void start_building_history();
+  bool build_history_slice();
+  void finish_building_history();
+  bool on_stall_probe();
 
-  Glib::RefPtr<Gio::Settings> settings_;
+  std::shared_ptr<settings_snapshot> settings_;
   Gtk::ListBox messages_list_box_;
+  Glib::RefPtr<BottomAdjustment> vadjustment_;
+  sigc::connection scroll_update_;
 
   Glib::Property<int> unread_count_;
+  // true once the first page of history has arrived
   bool history_loaded_;
+  bool history_loading_;
+  bool has_more_history_;
+  // Messages newer than the last row, unloaded while the user reads older
+  // history. Front is the oldest.
+  std::deque<Json::Value> unloaded_newer_messages_;
+  // Every message held by this window in some form, keyed by ts, so that
+  // messages arriving from both channels.history and RTM show up once.
+  // Rendered ones point to their row; pending or unloaded ones to nullptr.
+  std::unordered_map<std::string, MessageRow*> rows_by_ts_;
+  // First page of history fetched in the background
+  boost::optional<Json::Value> prefetched_history_;
+  std::size_t prefetched_bytes_;
+  // Set when an event arrives while the prefetch is in flight
+  bool prefetch_stale_;
+
+  // Messages of channels.history waiting to be built into rows, newest
+  // (nearest to the viewport) first. They are built in idle time slices.
+  std::deque<Json::Value> pending_history_;
+  sigc::connection history_build_;
+  // Measures how long the main loop is blocked while rows are built, when
+  // SLACK_GTK_HISTORY_DEBUG is set.
+  sigc::connection stall_probe_;
+  std::chrono::steady_clock::time_point build_started_at_, last_probe_;
+  std::chrono::steady_clock::duration longest_stall_;
+  int rows_built_;
+  // ts of the rows set on screen and not yet set off screen
+  std::unordered_set<std::string> shown_rows_;
+  // Rows are out of date and redrawn when the channel becomes visible.
+  bool messages_stale_;
+  bool images_stale_;
 
   std::string id_;
   std::string name_;
   team& team_;
 
   sigc::signal<void, const std::string&> channel_link_signal_;
+  sigc::signal<void, const std::string&> notification_signal_;
 };
 
 #endif
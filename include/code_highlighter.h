@@ -0,0 +1,39 @@
+#ifndef SLACK_GTK_CODE_HIGHLIGHTER_H
+#define SLACK_GTK_CODE_HIGHLIGHTER_H
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+#include "rich_text.h"
+
+// Highlights code of fenced blocks with a few built-in lexers, picked by
+// looking at the code. Results are cached by content so that redraws and
+// rebuilt rows don't lex again.
+class code_highlighter {
+ public:
+  struct token {
+    // Relative to the start of the code
+    std::size_t start, end;
+    rich_text::style_type style;
+  };
+
+  code_highlighter();
+  code_highlighter(const code_highlighter& other) = delete;
+
+  // The result is valid until the next call.
+  const std::vector<token>& highlight(const std::string& code);
+
+ private:
+  struct cache_entry {
+    std::vector<token> tokens;
+    std::list<const std::string*>::iterator lru_position;
+  };
+
+  // By code
+  std::map<std::string, cache_entry> cache_;
+  // Keys of cache_, front is the most recently used.
+  std::list<const std::string*> lru_;
+};
+
+#endif
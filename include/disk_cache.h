@@ -0,0 +1,111 @@
+#ifndef SLACK_GTK_DISK_CACHE_H
+#define SLACK_GTK_DISK_CACHE_H
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+// Content store for downloaded images and files, shared by icon_loader,
+// emoji_loader, file_downloader and link_preview_loader. Entries are keyed
+// by URL and stored as <directory>/<first two hex digits of SHA-1>/<SHA-1>,
+// with the HTTP validators in <SHA-1>.meta next to it. The total size is
+// capped and the least recently used entries are evicted first.
+//
+// All methods are thread-safe, so they can be called from worker threads.
+class disk_cache {
+ public:
+  disk_cache(const std::string& directory, std::uint64_t max_bytes);
+  disk_cache(const disk_cache& other) = delete;
+  ~disk_cache();
+
+  struct stats_type {
+    std::size_t entries;
+    std::uint64_t bytes;
+    std::uint64_t max_bytes;
+  };
+
+  struct metadata_type {
+    std::string etag;
+    std::string last_modified;
+    // Unix time after which the entry has to be revalidated
+    std::int64_t expires;
+
+    metadata_type();
+    bool is_stale() const;
+  };
+
+  // Returns the path of the cached file, or an empty string when key isn't
+  // cached. metadata is filled if given.
+  std::string lookup(const std::string& key,
+                     metadata_type* metadata = nullptr);
+  // Atomically writes data as key and evicts old entries if needed.
+  bool store(const std::string& key, const char* data, std::size_t size,
+             const metadata_type& metadata);
+  // Refreshes the validators of an existing entry (e.g. after 304 Not
+  // Modified) without touching its content.
+  bool update_metadata(const std::string& key, const metadata_type& metadata);
+  void remove(const std::string& key);
+
+  // Returns where a download of key is written until it completes, creating
+  // its directory. Partial files survive restarts for a while so that
+  // downloads can be resumed.
+  std::string partial_path_of(const std::string& key) const;
+  // Moves the completed partial file of key into the cache and evicts old
+  // entries if needed.
+  bool commit_partial(const std::string& key, const metadata_type& metadata);
+  // Validators of the response being written to the partial file of key, so
+  // that resuming it can check that the file hasn't changed since.
+  bool store_partial_metadata(const std::string& key,
+                              const metadata_type& metadata);
+  // Returns false if the partial file of key has no validators.
+  bool lookup_partial_metadata(const std::string& key,
+                               metadata_type& metadata) const;
+
+  stats_type stats() const;
+  void set_max_bytes(std::uint64_t max_bytes);
+  // Evicts least recently used entries until the total size fits into
+  // target_bytes.
+  void prune(std::uint64_t target_bytes);
+  void prune();
+
+  static std::string default_directory();
+
+ private:
+  struct entry {
+    std::string hash;
+    std::uint64_t size;
+    std::int64_t last_access;
+    metadata_type metadata;
+  };
+  typedef std::list<entry> lru_type;
+
+  std::string hash_of(const std::string& key) const;
+  std::string path_of(const std::string& hash) const;
+  std::string metadata_path_of(const std::string& hash) const;
+  static std::uint64_t read_metadata(const std::string& path,
+                                     metadata_type& metadata);
+  static std::string serialize_metadata(const metadata_type& metadata);
+  void scan();
+  void insert_locked(const entry& e, bool most_recent);
+  void remove_locked(lru_type::iterator it);
+  void prune_locked(std::uint64_t target_bytes);
+
+  const std::string directory_;
+
+  mutable std::mutex mutex_;
+  // Front is the most recently used entry
+  lru_type lru_;
+  std::unordered_map<std::string, lru_type::iterator> index_;
+  std::uint64_t total_bytes_;
+  std::uint64_t max_bytes_;
+
+  std::atomic<bool> scanned_;
+  std::atomic<bool> stopping_;
+  std::thread scan_thread_;
+};
+
+#endif
@@ -2,32 +2,105 @@
 #define SLACK_GTK_EMOJI_LOADER_H
 
 #include <gdkmm/pixbuf.h>
+#include <gio/gio.h>
 #include <glibmm/refptr.h>
 #include <libsoup/soup-session.h>
+#include <sigc++/sigc++.h>
+#include <deque>
+#include <map>
+#include <memory>
+#include <set>
+#include <vector>
+#include "disk_cache.h"
 #include "emoji_data.h"
 
+// Loads the built-in emojis from a directory and the team's custom emojis
+// into the disk cache. The disk cache is only accessed on worker threads.
 class emoji_loader {
  public:
-  emoji_loader(const std::string& directory);
+  emoji_loader(const std::string& directory,
+               std::shared_ptr<disk_cache> cache);
+  ~emoji_loader();
 
-  Glib::RefPtr<Gdk::Pixbuf> find(const std::string& name) const;
+  // Returns the emoji scaled to size x size. The pixbuf is shared by all
+  // callers and must not be modified. Custom emojis are decoded from the
+  // disk cache in the background; null is returned until
+  // signal_custom_emoji_loaded is emitted for them.
+  Glib::RefPtr<Gdk::Pixbuf> find(const std::string& name, int size);
   void add_custom_emoji(const std::string& name, const std::string& url);
+  // Adds the emojis of emoji.list, looking them up in the disk cache in one
+  // go.
+  void add_custom_emojis(const std::map<std::string, std::string>& emojis);
   void remove_custom_emoji(const std::string& name);
+  // Drops the scaled pixbufs, e.g. when the emoji size has changed.
+  void clear_scaled();
+  // Moves a custom emoji that is still waiting for download to the front of
+  // the queue, e.g. because it's shown on screen.
+  void prioritize(const std::string& name);
+  // Emitted when a custom emoji is found in the disk cache or decoded, or
+  // when a prioritized one is downloaded.
+  sigc::signal<void, const std::string&> signal_custom_emoji_loaded();
 
  private:
+  struct load_request {
+    emoji_loader* loader;
+    std::string name;
+    std::string url;
+    // true when a cached entry is being revalidated
+    bool revalidation;
+    bool prioritized;
+    disk_cache::metadata_type metadata;
+  };
+
+  struct cache_job;
+
   std::string resolve_alias(const std::string& name) const;
-  void cache_emoji(const std::string& name, const std::string& url);
+  Glib::RefPtr<Gdk::Pixbuf> load_builtin(const std::string& name) const;
+  void forget_scaled(const std::string& name);
+  // Downloads the emoji unless it's cached and fresh.
+  void cache_emoji(const std::string& name, const std::string& url,
+                   bool cached, const disk_cache::metadata_type& metadata);
   static void load_callback(SoupSession* session, SoupMessage* message,
                             gpointer user_data);
-  void on_load(const std::string& name, SoupMessage* message);
+  void on_load(const load_request& request, SoupMessage* message);
+  void start_queued_loads();
+
+  void start_job(cache_job* job);
+  static void job_thread(GTask* task, gpointer source_object,
+                         gpointer task_data, GCancellable* cancellable);
+  static void job_callback(GObject* source_object, GAsyncResult* result,
+                           gpointer user_data);
+  void on_job_done(cache_job* job);
+  void on_looked_up(cache_job* job);
+  void on_decoded(cache_job* job);
+  void on_stored(cache_job* job);
 
   SoupSession* session_;
 
   std::string directory_;
-  std::string custom_directory_;
+  std::shared_ptr<disk_cache> cache_;
   std::map<std::string, emoji_data> dict_;
   std::map<std::string, std::string> aliases_;
   std::map<std::string, std::string> custom_emojis_;
+  // URLs of the custom emojis being looked up in the disk cache, by name
+  std::map<std::string, std::string> lookups_;
+  // Names of lookups_ prioritized before they're queued
+  std::set<std::string> prioritized_lookups_;
+  // Scaled pixbufs by (resolved name, size)
+  std::map<std::pair<std::string, int>, Glib::RefPtr<Gdk::Pixbuf>> scaled_;
+  // (name, size) of the custom emojis being decoded
+  std::set<std::pair<std::string, int>> decoding_;
+
+  // Downloads waiting to be started, by emoji name. Names are queued in
+  // visible_queue_ when prioritized and in default_queue_ otherwise; stale
+  // names are skipped when popped.
+  std::map<std::string, load_request*> queued_;
+  std::deque<std::string> visible_queue_, default_queue_;
+  std::size_t loads_in_flight_;
+
+  sigc::signal<void, const std::string&> signal_custom_emoji_loaded_;
+  // Shared with jobs, whose callbacks may run after the loader is destroyed
+  std::shared_ptr<bool> alive_;
 };
 
 #endif
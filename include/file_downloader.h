@@ -0,0 +1,109 @@
+#ifndef SLACK_GTK_FILE_DOWNLOADER_H
+#define SLACK_GTK_FILE_DOWNLOADER_H
+
+#include <gdkmm/pixbuf.h>
+#include <gio/gio.h>
+#include <glibmm/refptr.h>
+#include <libsoup/soup.h>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "disk_cache.h"
+
+// Downloads files shared in Slack (which need the team's token) into the
+// disk cache, and decodes them for previews on a worker thread.
+//
+// Bodies are streamed to a partial file in the cache instead of being held
+// in memory. If a download fails or is cancelled, the partial file is kept
+// and the next request for the URL resumes it with a Range request, unless
+// the file has changed since (If-Range). Text previews only download the
+// start of the file, which stays in the partial file.
+class file_downloader {
+ public:
+  file_downloader(std::shared_ptr<disk_cache> cache, const std::string& token);
+  file_downloader(const file_downloader& other) = delete;
+  ~file_downloader();
+
+  typedef std::uint64_t request_id;
+  // total is 0 if the server didn't send the length.
+  typedef std::function<void(std::uint64_t received, std::uint64_t total)>
+      progress_callback_type;
+  // The pixbuf is null if the file can't be loaded.
+  typedef std::function<void(Glib::RefPtr<Gdk::Pixbuf>)>
+      thumbnail_callback_type;
+  // The text is empty if the file can't be loaded.
+  typedef std::function<void(const std::string&)> text_callback_type;
+
+  // Calls callback with the image at url decoded to fit in size x size.
+  // Callbacks are called from the main loop unless the request is
+  // cancelled.
+  request_id load_thumbnail(const std::string& url, int size,
+                            const progress_callback_type& progress,
+                            const thumbnail_callback_type& callback);
+  // Calls callback with at most max_bytes from the start of the file at
+  // url, cut to whole UTF-8 characters.
+  request_id load_text(const std::string& url, std::size_t max_bytes,
+                       const progress_callback_type& progress,
+                       const text_callback_type& callback);
+  void cancel(request_id id);
+
+ private:
+  struct request {
+    std::string url;
+    // 0 for text
+    int size;
+    std::size_t max_bytes;
+    progress_callback_type progress;
+    thumbnail_callback_type thumbnail_callback;
+    text_callback_type text_callback;
+  };
+  struct transfer;
+  struct decode_job;
+
+  request_id add_request(const request& request);
+  void start_decode(request_id id);
+  static void decode_thread(GTask* task, gpointer source_object,
+                            gpointer task_data, GCancellable* cancellable);
+  static void decode_callback(GObject* source_object, GAsyncResult* result,
+                              gpointer user_data);
+  void on_decoded(decode_job* job);
+  void finish_request(request_id id, Glib::RefPtr<Gdk::Pixbuf> pixbuf,
+                      const std::string& text);
+
+  // Starts downloading the rest of the partial file of url, whose size is
+  // offset, up to limit bytes from the start of the file unless limit is 0.
+  // The partial file is only resumed if validators can tell whether the
+  // file has changed since.
+  void start_transfer(const std::string& url, SoupMessage* message,
+                      std::uint64_t offset,
+                      const disk_cache::metadata_type& validators,
+                      std::uint64_t limit);
+  static void send_callback(GObject* source_object, GAsyncResult* result,
+                            gpointer user_data);
+  void on_sent(transfer* t, GInputStream* input, GError* error);
+  void read_next(transfer* t);
+  static void read_callback(GObject* source_object, GAsyncResult* result,
+                            gpointer user_data);
+  void on_read(transfer* t, GBytes* bytes, GError* error);
+  static void write_callback(GObject* source_object, GAsyncResult* result,
+                             gpointer user_data);
+  void on_written(transfer* t, gsize written, GError* error);
+  // Ends the transfer; ok is true when the whole body has been written.
+  void finish_transfer(transfer* t, bool ok);
+
+  std::shared_ptr<disk_cache> cache_;
+  std::string token_;
+  SoupSession* session_;
+  std::map<request_id, request> requests_;
+  request_id next_request_id_;
+  // Transfers in progress by URL
+  std::map<std::string, transfer*> transfers_;
+  // Shared with transfers and decode jobs, whose callbacks may run after
+  // the downloader is destroyed
+  std::shared_ptr<bool> alive_;
+};
+
+#endif
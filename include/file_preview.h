@@ -0,0 +1,42 @@
+#ifndef SLACK_GTK_FILE_PREVIEW_H
+#define SLACK_GTK_FILE_PREVIEW_H
+
+#include <gtkmm/box.h>
+#include <gtkmm/image.h>
+#include <gtkmm/label.h>
+#include <gtkmm/progressbar.h>
+#include <json/json.h>
+#include "file_downloader.h"
+#include "team.h"
+
+// Shows a file shared in a message: its name, and a thumbnail of images or
+// the first lines of text files. Like attachment previews, downloads start
+// once the row is on screen, and thumbnails are dropped when it's far off
+// screen.
+class FilePreview : public Gtk::Box {
+ public:
+  FilePreview(team& team, const Json::Value& file);
+  ~FilePreview() override;
+
+  void set_on_screen();
+  void set_off_screen();
+
+ private:
+  void cancel_request();
+  void on_progress(std::uint64_t received, std::uint64_t total);
+  void on_thumbnail_loaded(Glib::RefPtr<Gdk::Pixbuf> pixbuf);
+  void on_text_loaded(const std::string& text);
+  void set_snippet(const std::string& text);
+
+  team& team_;
+  std::string url_;
+  // Either is set, depending on the type of the file
+  Gtk::Image* image_;
+  Gtk::Label* snippet_label_;
+  Gtk::ProgressBar progress_bar_;
+  file_downloader::request_id request_;
+  bool loaded_;
+  bool on_screen_;
+};
+
+#endif
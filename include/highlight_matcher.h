@@ -0,0 +1,38 @@
+#ifndef SLACK_GTK_HIGHLIGHT_MATCHER_H
+#define SLACK_GTK_HIGHLIGHT_MATCHER_H
+
+#include <json/json.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Picks out the messages worth a notification: those mentioning the user,
+// directly or with @channel, @here or @everyone, and those containing one
+// of the user's highlight words.
+//
+// The patterns are compiled into an Aho-Corasick automaton, which scans a
+// message once for all of them.
+class highlight_matcher {
+ public:
+  highlight_matcher(const std::string& self_id);
+
+  // Replaces the highlight words and rebuilds the automaton. Words are
+  // matched anywhere in the text, ignoring case.
+  void set_keywords(const std::vector<std::string>& keywords);
+  // Returns true if message, a message event, is from someone else and
+  // mentions the user or contains a highlight word.
+  bool matches(const Json::Value& message) const;
+
+ private:
+  void build(const std::vector<std::string>& patterns);
+  bool scan(const std::string& text) const;
+
+  std::string self_id_;
+  // Transitions of the automaton, indexed by state * 256 + byte, with the
+  // failure links already folded in. State 0 is the root.
+  std::vector<std::uint32_t> transitions_;
+  // Whether a pattern ends at each state, directly or as a suffix
+  std::vector<bool> accepting_;
+};
+
+#endif
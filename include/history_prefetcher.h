@@ -0,0 +1,37 @@
+#ifndef SLACK_GTK_HISTORY_PREFETCHER_H
+#define SLACK_GTK_HISTORY_PREFETCHER_H
+
+#include <sigc++/sigc++.h>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <set>
+
+class api_client;
+class ChannelWindow;
+
+// Fetches history of unread channels in the background so that switching to
+// them doesn't wait for channels.history. It only works while the main loop
+// and the API connection are idle, and within a request and memory budget.
+class history_prefetcher {
+ public:
+  history_prefetcher(std::shared_ptr<api_client> api_client);
+  history_prefetcher(const history_prefetcher& other) = delete;
+  ~history_prefetcher();
+
+  void add(ChannelWindow* window);
+  void remove(ChannelWindow* window);
+
+ private:
+  bool on_tick();
+  bool within_request_budget();
+  std::size_t prefetched_bytes() const;
+  ChannelWindow* next_candidate() const;
+
+  std::shared_ptr<api_client> api_client_;
+  std::set<ChannelWindow*> windows_;
+  std::deque<std::chrono::steady_clock::time_point> recent_requests_;
+  sigc::connection tick_;
+};
+
+#endif
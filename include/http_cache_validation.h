@@ -0,0 +1,23 @@
+#ifndef SLACK_GTK_HTTP_CACHE_VALIDATION_H
+#define SLACK_GTK_HTTP_CACHE_VALIDATION_H
+
+#include <libsoup/soup-message.h>
+#include "disk_cache.h"
+
+// Adds If-None-Match/If-Modified-Since so that the server can answer 304 Not
+// Modified for an unchanged entry.
+void add_conditional_headers(SoupMessage* message,
+                             const disk_cache::metadata_type& metadata);
+
+// Adds If-Range so that the server sends the whole file instead of the
+// requested range if it has changed since metadata was received. Returns
+// false if metadata has no validator usable for If-Range.
+bool add_if_range_header(SoupMessage* message,
+                         const disk_cache::metadata_type& metadata);
+
+// Builds the validators and expiry of a 200 or 304 response. Validators
+// missing from the response (304 may omit them) are taken from previous.
+disk_cache::metadata_type metadata_from_response(
+    SoupMessage* message, const disk_cache::metadata_type& previous);
+
+#endif
@@ -2,30 +2,117 @@
 #define SLACK_GTK_ICON_LOADER_H
 
 #include <gdkmm/pixbuf.h>
+#include <gio/gio.h>
 #include <glibmm/refptr.h>
 #include <libsoup/soup-session.h>
 #include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <set>
 #include <string>
+#include <vector>
+#include "disk_cache.h"
 
 class icon_loader {
  public:
-  icon_loader(const std::string& cache_directory);
+  // With keep_aspect_ratio, images are scaled to fit in size x size instead
+  // of being stretched to it (e.g. for previews of attached images).
+  icon_loader(std::shared_ptr<disk_cache> cache, bool keep_aspect_ratio);
   ~icon_loader();
 
   typedef std::function<void(Glib::RefPtr<Gdk::Pixbuf>)> load_callback_type;
-  void load(const std::string& url, const load_callback_type& callback);
+  typedef std::uint64_t request_id;
+  // Loads are started in priority order, then in the order of requests.
+  enum priority_type {
+    PRIORITY_VISIBLE = 0,
+    PRIORITY_DEFAULT = 1,
+  };
+
+  // Calls callback with a pixbuf scaled to size x size (or to fit in it).
+  // The pixbuf is shared with other callers and must not be modified. If the
+  // pixbuf is already in memory, callback is called immediately and 0 is
+  // returned. Otherwise callback is called later from the main loop unless
+  // the returned request is cancelled.
+  request_id load(const std::string& url, int size,
+                  const load_callback_type& callback,
+                  priority_type priority = PRIORITY_DEFAULT);
+  void set_priority(request_id id, priority_type priority);
+  void cancel(request_id id);
+
+  // Drops every scaled pixbuf held in memory (e.g. when the icon size
+  // changes).
+  void clear_memory_cache();
+  void set_memory_cache_budget(std::size_t bytes);
 
  private:
+  typedef std::pair<std::string, int> memory_cache_key;
+  struct memory_cache_entry {
+    memory_cache_key key;
+    Glib::RefPtr<Gdk::Pixbuf> pixbuf;
+    std::size_t bytes;
+  };
+  struct pending_load {
+    std::string url;
+    int size;
+    priority_type priority;
+    load_callback_type callback;
+  };
+  // Requests sharing the same URL are loaded together.
+  struct url_load {
+    std::vector<request_id> requests;
+    bool started;
+    int size;
+  };
+  typedef std::pair<int, request_id> queue_key;
+  struct decode_job;
+
   static void load_callback(SoupSession* session, SoupMessage* message,
                             gpointer user_data);
   void on_load(SoupMessage* message);
-  Glib::RefPtr<Gdk::Pixbuf> load_from_cache(const std::string& url) const;
-  void store_cache(const std::string& url, const char* data,
-                   std::size_t size) const;
 
-  std::string cache_directory_;
-  std::multimap<std::string, load_callback_type> load_callback_registry_;
+  void start_job(decode_job* job);
+  void start_read(const std::string& url, int size);
+  void start_store(const std::string& url, int size, GBytes* data,
+                   const disk_cache::metadata_type& metadata);
+  void start_refresh(const std::string& url,
+                     const disk_cache::metadata_type& metadata);
+  static void decode_thread(GTask* task, gpointer source_object,
+                            gpointer task_data, GCancellable* cancellable);
+  static void decode_callback(GObject* source_object, GAsyncResult* result,
+                              gpointer user_data);
+  void on_decoded(decode_job* job);
+  void fetch(const std::string& url);
+  void queue_message(SoupMessage* message, const std::string& url);
+  void revalidate(const std::string& url,
+                  const disk_cache::metadata_type& metadata);
+  void finish_load(const std::string& url, Glib::RefPtr<Gdk::Pixbuf> pixbuf);
+  void start_queued_loads();
+
+  Glib::RefPtr<Gdk::Pixbuf> find_in_memory(const std::string& url, int size);
+  Glib::RefPtr<Gdk::Pixbuf> store_in_memory(const std::string& url, int size,
+                                            Glib::RefPtr<Gdk::Pixbuf> pixbuf);
+  void evict_memory_cache();
+  void forget_in_memory(const std::string& url);
+
+  std::shared_ptr<disk_cache> cache_;
+  bool keep_aspect_ratio_;
+  std::map<request_id, pending_load> requests_;
+  std::map<std::string, url_load> url_loads_;
+  // Requests of URLs not started yet
+  std::set<queue_key> queue_;
+  request_id next_request_id_;
+  std::size_t loads_in_flight_;
   SoupSession* session_;
+  // URL of stale entries being revalidated in the background, with their
+  // cached validators
+  std::map<std::string, disk_cache::metadata_type> revalidations_;
+
+  std::list<memory_cache_entry> memory_cache_lru_;
+  std::map<memory_cache_key, std::list<memory_cache_entry>::iterator>
+      memory_cache_index_;
+  std::size_t memory_cache_bytes_;
+  std::size_t memory_cache_budget_;
 };
 
 #endif
@@ -0,0 +1,83 @@
+#ifndef SLACK_GTK_LINK_PREVIEW_LOADER_H
+#define SLACK_GTK_LINK_PREVIEW_LOADER_H
+
+#include <gio/gio.h>
+#include <json/json.h>
+#include <libsoup/soup.h>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "disk_cache.h"
+
+// Fetches the OpenGraph metadata of links that Slack didn't unfurl, and
+// turns it into an attachment like Slack's own unfurls.
+//
+// Previews are shared by every channel of the team: a link is fetched once
+// however many messages contain it, and the result is kept in memory and in
+// the disk cache for a day. Pages are parsed on a worker thread.
+class link_preview_loader {
+ public:
+  link_preview_loader(std::shared_ptr<disk_cache> cache);
+  link_preview_loader(const link_preview_loader& other) = delete;
+  ~link_preview_loader();
+
+  typedef std::uint64_t request_id;
+  typedef std::function<void(const Json::Value& attachment)>
+      load_callback_type;
+
+  // Calls callback with the preview of url. If the preview is already in
+  // memory, callback is called immediately and 0 is returned. Otherwise
+  // callback is called later from the main loop unless the request is
+  // cancelled. callback isn't called for pages without metadata.
+  request_id load(const std::string& url, const load_callback_type& callback);
+  void cancel(request_id id);
+
+ private:
+  struct pending_load {
+    std::string url;
+    load_callback_type callback;
+  };
+  struct parse_job;
+  struct cached_preview {
+    // null for pages without metadata
+    Json::Value attachment;
+    // Unix time, as in the disk cache
+    std::int64_t expires;
+  };
+
+  void start_job(parse_job* job);
+  static void parse_thread(GTask* task, gpointer source_object,
+                           gpointer task_data, GCancellable* cancellable);
+  static void parse_callback(GObject* source_object, GAsyncResult* result,
+                             gpointer user_data);
+  void on_parsed(parse_job* job);
+  void fetch(const std::string& url);
+  static void got_headers_callback(SoupMessage* message, gpointer user_data);
+  static void got_chunk_callback(SoupMessage* message, SoupBuffer* chunk,
+                                 gpointer user_data);
+  static void load_callback(SoupSession* session, SoupMessage* message,
+                            gpointer user_data);
+  void on_load(SoupMessage* message);
+  // Calls the callbacks of url. The result is remembered until expires,
+  // unless expires is 0 (e.g. after a network error).
+  void finish_load(const std::string& url, const Json::Value& attachment,
+                   std::int64_t expires);
+
+  std::shared_ptr<disk_cache> cache_;
+  SoupSession* session_;
+  std::map<request_id, pending_load> requests_;
+  // Requests waiting for each URL being loaded. Entries stay until the load
+  // ends, even if all their requests are cancelled, so that a load isn't
+  // started twice.
+  std::map<std::string, std::vector<request_id>> url_loads_;
+  request_id next_request_id_;
+  std::map<std::string, cached_preview> memory_cache_;
+  // Shared with queued messages and parse jobs, whose callbacks may run
+  // after the loader is destroyed
+  std::shared_ptr<bool> alive_;
+};
+
+#endif
@@ -1,10 +1,12 @@
 #ifndef SLACK_GTK_MAIN_WINDOW_H
 #define SLACK_GTK_MAIN_WINDOW_H
 
-#include <giomm/settings.h>
 #include <gtkmm/applicationwindow.h>
 #include <gtkmm/stack.h>
 #include "channel_window.h"
+#include "history_prefetcher.h"
+#include "notification_manager.h"
+#include "settings_snapshot.h"
 #include "team.h"
 
 class MainWindow : public Gtk::ApplicationWindow {
@@ -24,11 +26,22 @@ class MainWindow : public Gtk::ApplicationWindow {
   void on_channel_left_signal(const Json::Value& payload);
   void on_user_typing_signal(const Json::Value& payload);
   void on_emoji_changed_signal(const Json::Value& payload);
+  void on_reaction_added_signal(const Json::Value& payload);
+  void on_reaction_removed_signal(const Json::Value& payload);
+
+  void on_settings_changed(const std::string& key);
+  void rescale_images();
 
   void on_channel_link_clicked(const std::string& channel_id);
   void on_channel_added(Widget* widget);
   void on_channel_unread_count_changed(const std::string& channel_id);
   void on_visible_channel_changed();
+  void on_active_changed();
+  void on_channel_notification(const std::string& summary,
+                               const std::string& channel_id);
+  // Returns the channel the user is looking at, or nullptr if the window
+  // isn't focused.
+  ChannelWindow* focused_channel();
 
   void append_message(const std::string& text);
   ChannelWindow* add_channel_window(const channel& chan);
@@ -36,10 +49,15 @@ class MainWindow : public Gtk::ApplicationWindow {
   void request_update_emoji();
   void emoji_list_finished(const boost::optional<Json::Value>& result);
   void redraw_messages();
+  void on_custom_emoji_loaded(const std::string& name);
+  bool on_redraw_messages_idle();
 
   Gtk::Stack channels_stack_;
-  Glib::RefPtr<Gio::Settings> settings_;
+  std::shared_ptr<settings_snapshot> settings_;
+  sigc::connection redraw_messages_idle_;
 
   team team_;
+  history_prefetcher history_prefetcher_;
+  notification_manager notification_manager_;
 };
 #endif
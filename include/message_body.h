@@ -0,0 +1,62 @@
+#ifndef SLACK_GTK_MESSAGE_BODY_H
+#define SLACK_GTK_MESSAGE_BODY_H
+
+#include <gtkmm/drawingarea.h>
+#include <pangomm/layout.h>
+#include "rich_text.h"
+
+// Draws a rich_text with a single Pango layout, without the buffer, tag
+// table and event handling of a Gtk::TextView. It can't select text; the
+// owner swaps in a TextView when the user starts a selection.
+class MessageBody : public Gtk::DrawingArea {
+ public:
+  MessageBody();
+  ~MessageBody() override;
+
+  // text must outlive the widget or the next call.
+  void set_rich_text(const rich_text& text);
+
+  sigc::signal<void, const rich_text::link&> signal_link_clicked();
+  // Emitted with the byte range the pointer was dragged over
+  sigc::signal<void, std::size_t, std::size_t> signal_selection_started();
+
+ protected:
+  Gtk::SizeRequestMode get_request_mode_vfunc() const override;
+  void get_preferred_width_vfunc(int& minimum_width,
+                                 int& natural_width) const override;
+  void get_preferred_height_for_width_vfunc(int width, int& minimum_height,
+                                            int& natural_height) const override;
+  void get_preferred_height_vfunc(int& minimum_height,
+                                  int& natural_height) const override;
+  void get_preferred_width_for_height_vfunc(int height, int& minimum_width,
+                                            int& natural_width) const override;
+  void on_size_allocate(Gtk::Allocation& allocation) override;
+  void on_style_updated() override;
+  bool on_draw(const Cairo::RefPtr<Cairo::Context>& cr) override;
+  bool on_button_press_event(GdkEventButton* event) override;
+  bool on_button_release_event(GdkEventButton* event) override;
+  bool on_motion_notify_event(GdkEventMotion* event) override;
+
+ private:
+  void update_layout();
+  // Returns the byte index of the character at (x, y), if any.
+  bool index_at(double x, double y, std::size_t& index) const;
+  // Like index_at, but clamps points outside the text to the nearest
+  // character boundary.
+  std::size_t nearest_index_at(double x, double y) const;
+
+  const rich_text* text_;
+  Glib::RefPtr<Pango::Layout> layout_;
+  // Width of the layout without wrapping
+  int natural_width_;
+
+  bool pressed_;
+  double press_x_, press_y_;
+  bool hovering_link_;
+  Glib::RefPtr<Gdk::Cursor> pointer_cursor_;
+
+  sigc::signal<void, const rich_text::link&> signal_link_clicked_;
+  sigc::signal<void, std::size_t, std::size_t> signal_selection_started_;
+};
+
+#endif
@@ -1,42 +1,125 @@
 #ifndef SLACK_GTK_MESSAGE_ROW_H
 #define SLACK_GTK_MESSAGE_ROW_H
 
-#include <giomm/settings.h>
+#include <gtkmm/button.h>
 #include <gtkmm/image.h>
 #include <gtkmm/label.h>
 #include <gtkmm/listboxrow.h>
 #include <libsoup/soup-message.h>
 #include <libsoup/soup-session.h>
 #include <sigc++/sigc++.h>
+#include "icon_loader.h"
+#include "link_preview_loader.h"
 #include "message_text_view.h"
+#include "reactions.h"
+#include "settings_snapshot.h"
 #include "team.h"
 
+class AttachmentsView;
+class FilePreview;
+class ReactionsView;
+class ThreadView;
+
 class MessageRow : public Gtk::ListBoxRow {
  public:
-  MessageRow(team& team, Glib::RefPtr<Gio::Settings> settings,
-             const Json::Value& payload);
+  // A continuation row has no header; it continues the group of messages
+  // from the same user above it.
+  MessageRow(team& team, std::shared_ptr<settings_snapshot> settings,
+             const std::string& channel_id, const Json::Value& payload,
+             bool continuation);
   virtual ~MessageRow();
 
-  std::string summary_for_notification() const;
   const std::string& ts() const;
+  const Json::Value& payload() const;
 
   sigc::signal<void, const std::string&> signal_user_link_clicked();
   sigc::signal<void, const std::string&> signal_channel_link_clicked();
 
+  // Returns true if payload belongs to the group of previous, the message
+  // just before it.
+  static bool continues(const Json::Value& previous,
+                        const Json::Value& payload);
+  void set_continuation(bool continuation);
+
   void redraw_message();
+  // Reloads the user icon and emojis at the current sizes without
+  // formatting the text again.
+  void rescale_images();
+  // Replaces the text and attachments with those of the edited message.
+  void update(const Json::Value& payload);
+  void add_reaction(const std::string& name, const std::string& user_id);
+  void remove_reaction(const std::string& name, const std::string& user_id);
+  // Replies to the thread started by this message
+  void add_reply(const Json::Value& payload);
+  void update_reply(const Json::Value& payload);
+  void remove_reply(const std::string& ts);
+  // Sets the number of replies shown under the message, as reported by
+  // message_replied events.
+  void set_reply_count(int reply_count);
+  // Called by ChannelWindow when the row enters the viewport so that its
+  // images are loaded before those of off-screen rows.
+  void set_on_screen();
+  // Called when the row is far off screen so that it drops its previews.
+  void set_off_screen();
+  // Passes the viewport, from top to bottom in the coordinates of the row,
+  // to the expanded thread so that only the replies in it load previews.
+  void update_on_screen_replies(double top, double bottom, double margin);
 
  private:
+  void create_header();
+  void remove_header();
+  std::string format_time(const std::string& format) const;
   void load_user_icon(const std::string& url);
-  void on_user_icon_loaded(Glib::RefPtr<Gdk::Pixbuf> pixbuf);
+  void on_user_icon_loaded(icon_loader::request_id id,
+                           Glib::RefPtr<Gdk::Pixbuf> pixbuf);
+  void add_file_preview(const Json::Value& file);
+  // Shows attachments, followed by the previews of links loaded so far.
+  void set_attachments(const Json::Value& attachments);
+  // Finds the links of payload that Slack hasn't unfurled.
+  void find_links(const Json::Value& payload);
+  void load_link_previews();
+  void cancel_link_previews();
+  void on_link_preview_loaded(std::size_t index, const Json::Value& attachment);
+  void set_reactions(const Json::Value& reactions);
+  void create_reactions_view();
+  void on_replies_button_clicked();
+  void on_reactions_changed(const std::string& name);
 
-  Gtk::Image user_image_;
-  Gtk::Label user_label_;
+  Gtk::Box* row_box_;
+  // User name and time, and the user icon. nullptr on continuation rows.
+  Gtk::Box* header_box_;
+  Gtk::Image* user_image_;
+  Gtk::Box* content_box_;
   MessageTextView message_text_view_;
+  // Files shared with the message, in file_share messages
+  std::vector<FilePreview*> file_previews_;
+  AttachmentsView* attachments_view_;
+  // Created when the first reaction is added
+  ReactionsView* reactions_view_;
+  // Summary of the thread, and its replies while expanded
+  Gtk::Box* thread_box_;
+  Gtk::Button* replies_button_;
+  ThreadView* thread_view_;
 
+  Json::Value payload_;
+  std::string channel_id_;
   std::string ts_;
+  // ts in microseconds since the epoch
+  gint64 time_;
+  std::string user_name_;
+  bool is_message_;
+  reactions reactions_;
+  int reply_count_;
+  std::string icon_url_;
+  std::vector<icon_loader::request_id> icon_requests_;
+  // Links to preview, and their previews as attachments once loaded
+  std::vector<std::string> link_urls_;
+  std::vector<Json::Value> link_previews_;
+  std::vector<link_preview_loader::request_id> link_requests_;
+  bool on_screen_;
 
   team& team_;
-  Glib::RefPtr<Gio::Settings> settings_;
+  std::shared_ptr<settings_snapshot> settings_;
 };
 
 #endif
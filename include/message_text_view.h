@@ -1,13 +1,18 @@
 #ifndef SLACK_GTK_MESSAGE_TEXT_VIEW_H
 #define SLACK_GTK_MESSAGE_TEXT_VIEW_H
 
-#include <giomm/settings.h>
+#include <gtkmm/box.h>
 #include <gtkmm/textview.h>
+#include "message_body.h"
+#include "rich_text.h"
+#include "settings_snapshot.h"
 #include "team.h"
 
-class MessageTextView : public Gtk::TextView {
+// Shows the text of a message with a MessageBody, and switches to a
+// Gtk::TextView once the user starts selecting text.
+class MessageTextView : public Gtk::Box {
  public:
-  MessageTextView(team& team, Glib::RefPtr<Gio::Settings> settings);
+  MessageTextView(team& team, std::shared_ptr<settings_snapshot> settings);
   ~MessageTextView() override;
 
   void set_text(const std::string& text, bool is_message);
@@ -17,24 +22,44 @@ class MessageTextView : public Gtk::TextView {
   sigc::signal<void, const std::string&> signal_channel_link_clicked();
 
   void redraw_message();
+  // Replaces the emoji pixbufs with ones of the current emoji size.
+  void rescale_emojis();
+  void set_on_screen();
 
  private:
-  Gtk::TextBuffer::iterator insert_hyperlink(
-      Glib::RefPtr<Gtk::TextBuffer> buffer, Gtk::TextBuffer::iterator iter,
-      const std::string& linker);
-  Gtk::TextBuffer::iterator insert_markdown_text(
-      Glib::RefPtr<Gtk::TextBuffer> buffer, Gtk::TextBuffer::iterator iter,
-      const std::string& text, bool is_message);
+  void append_hyperlink(const std::string& linker);
+  void append_emoji(const std::string& name);
+  void highlight_code_block(std::size_t start, std::size_t end,
+                            std::size_t hidden_lines);
+  Glib::RefPtr<Gtk::TextBuffer> create_buffer();
 
-  virtual bool on_motion_notify_event(GdkEventMotion* event) override;
-  void on_event_after(GdkEvent* event);
+  void on_link_clicked(const rich_text::link& link);
+  void on_selection_started(std::size_t start, std::size_t end);
+  const rich_text::link* find_link_in_text_view(double x, double y) const;
+  bool on_text_view_motion_notify_event(GdkEventMotion* event);
+  void on_text_view_event_after(GdkEvent* event);
 
   Glib::RefPtr<Gdk::Cursor> default_cursor_, pointer_cursor_;
 
   team& team_;
-  Glib::RefPtr<Gio::Settings> settings_;
+  std::shared_ptr<settings_snapshot> settings_;
   std::string raw_text_;
   bool is_message_;
+  bool code_blocks_expanded_;
+  bool on_screen_;
+  // Emojis not available yet (e.g. custom emojis still being downloaded)
+  std::vector<std::string> missing_emojis_;
+
+  rich_text text_;
+  MessageBody body_;
+  // Created when the user starts selecting text, and shown instead of body_
+  Gtk::TextView* text_view_;
+  // Links of the text view's buffer by character offset, sorted by start
+  struct buffer_link {
+    int start, end;
+    const rich_text::link* link;
+  };
+  std::vector<buffer_link> buffer_links_;
 
   sigc::signal<void, const std::string &> signal_user_link_clicked_,
       signal_channel_link_clicked_;
@@ -0,0 +1,76 @@
+#ifndef SLACK_GTK_MRKDWN_FORMATTER_H
+#define SLACK_GTK_MRKDWN_FORMATTER_H
+
+#include <functional>
+#include <string>
+#include "rich_text.h"
+
+// Formats Slack's mrkdwn (https://api.slack.com/docs/message-formatting)
+// in a single pass, appending styled text straight to a rich_text. Links
+// (<...>) and emoji (:name:) are passed to the handlers, which append them.
+class mrkdwn_formatter {
+ public:
+  typedef std::function<void(const std::string&)> link_handler_type;
+  typedef std::function<void(const std::string&)> emoji_handler_type;
+  // Called with the range of a fenced block in the output, and the number
+  // of its lines left out
+  typedef std::function<void(std::size_t, std::size_t, std::size_t)>
+      code_block_handler_type;
+
+  mrkdwn_formatter(rich_text& out, const link_handler_type& link_handler,
+                   const emoji_handler_type& emoji_handler,
+                   const code_block_handler_type& code_block_handler);
+  mrkdwn_formatter(const mrkdwn_formatter& other) = delete;
+
+  // Fenced blocks longer than this are cut to collapsed_code_block_lines.
+  // 0 disables collapsing.
+  void set_max_code_block_lines(std::size_t lines);
+
+  void format(const std::string& text);
+
+ private:
+  // Inline styles toggled by a marker character
+  enum { BOLD, ITALIC, STRIKE, INLINE_STYLE_COUNT };
+
+  void start_line();
+  void end_line();
+  // Appends text[begin, end) without formatting except entities and links,
+  // as in code.
+  void append_literal(std::size_t begin, std::size_t end);
+  // Handles the character at pos_ if it's special, and returns false if not.
+  bool format_special();
+  bool format_marker(int style);
+  bool format_code();
+  bool format_fenced_code();
+  bool format_emoji();
+  // Links and entities must end before end, e.g. within an inline code
+  // span.
+  bool format_link(std::size_t end);
+  bool format_entity(std::size_t end);
+  bool can_open(std::size_t pos) const;
+  bool can_close(std::size_t pos) const;
+  // Returns true if a marker of style can close the one at pos_ on the
+  // same line.
+  bool find_closing(int style);
+  void close_span(std::size_t& start, rich_text::style_type style);
+
+  rich_text& out_;
+  link_handler_type link_handler_;
+  emoji_handler_type emoji_handler_;
+  code_block_handler_type code_block_handler_;
+  std::size_t max_code_block_lines_;
+
+  const std::string* text_;
+  std::size_t pos_;
+  // Start offsets in out_ of the open styles, or npos
+  std::size_t inline_starts_[INLINE_STYLE_COUNT];
+  // Closing markers found by find_closing, or npos, and where their search
+  // stopped, so that each line is searched once per style
+  std::size_t closings_[INLINE_STYLE_COUNT];
+  std::size_t closings_searched_[INLINE_STYLE_COUNT];
+  std::size_t quote_start_;
+  // true after ">>>", which quotes the rest of the message
+  bool quote_rest_;
+};
+
+#endif
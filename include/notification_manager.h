@@ -0,0 +1,57 @@
+#ifndef SLACK_GTK_NOTIFICATION_MANAGER_H
+#define SLACK_GTK_NOTIFICATION_MANAGER_H
+
+#include <glib.h>
+#include <libnotify/notification.h>
+#include <sigc++/sigc++.h>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include "settings_snapshot.h"
+
+// Shows desktop notifications of new messages. Each channel has at most one
+// notification, which is updated as more messages arrive ("5 new messages
+// in #ops") and reused after it closes. Notifications are rate-limited
+// across channels; messages arriving too soon are shown with the next
+// update of their channel.
+class notification_manager {
+ public:
+  notification_manager(std::shared_ptr<settings_snapshot> settings);
+  notification_manager(const notification_manager& other) = delete;
+  ~notification_manager();
+
+  void notify(const std::string& channel_id, const std::string& channel_name,
+              const std::string& summary);
+  // Closes and frees the notification of the channel, e.g. once the user
+  // reads it.
+  void dismiss(const std::string& channel_id);
+
+ private:
+  struct channel_notification {
+    std::string channel_name;
+    // Created on the first message and reused until dismissed
+    NotifyNotification* notification;
+    // Messages since the notification was last closed, and how many of
+    // them it shows
+    int count;
+    int shown;
+    std::string last_summary;
+    // Some of the messages haven't been shown yet.
+    bool pending;
+  };
+
+  void show(channel_notification& n);
+  bool on_show_timeout();
+  static void closed_callback(NotifyNotification* notification,
+                              gpointer user_data);
+
+  std::shared_ptr<settings_snapshot> settings_;
+  std::map<std::string, channel_notification> channels_;
+  // Channels with pending messages, in the order they arrived
+  std::deque<std::string> queue_;
+  gint64 last_shown_at_;
+  sigc::connection show_timeout_;
+};
+
+#endif
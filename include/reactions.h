@@ -0,0 +1,37 @@
+#ifndef SLACK_GTK_REACTIONS_H
+#define SLACK_GTK_REACTIONS_H
+
+#include <json/json.h>
+#include <string>
+#include <vector>
+
+// Reactions to a message. Messages rarely have more than a few kinds of
+// reactions, so they are kept in a vector in the order they were added.
+class reactions {
+ public:
+  struct reaction {
+    std::string name;
+    int count;
+    // Sorted. channels.history may list only some of the users.
+    std::vector<std::string> users;
+  };
+
+  reactions();
+  // Parses the "reactions" field of a message.
+  explicit reactions(const Json::Value& json);
+
+  // Return false when nothing changed, e.g. for an event seen twice.
+  bool add(const std::string& name, const std::string& user_id);
+  bool remove(const std::string& name, const std::string& user_id);
+
+  // Returns nullptr if nobody reacted with the emoji.
+  const reaction* find(const std::string& name) const;
+  const std::vector<reaction>& data() const;
+  bool empty() const;
+  Json::Value to_json() const;
+
+ private:
+  std::vector<reaction> data_;
+};
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef SLACK_GTK_REACTIONS_VIEW_H
+#define SLACK_GTK_REACTIONS_VIEW_H
+
+#include <gtkmm/flowbox.h>
+#include <gtkmm/flowboxchild.h>
+#include <gtkmm/image.h>
+#include <gtkmm/label.h>
+#include <map>
+#include "reactions.h"
+#include "settings_snapshot.h"
+#include "team.h"
+
+class ReactionsView : public Gtk::FlowBox {
+ public:
+  ReactionsView(team& team, std::shared_ptr<settings_snapshot> settings);
+  ~ReactionsView() override;
+
+  void set_reactions(const reactions& reactions);
+  // Updates only the entry of the emoji. Pass nullptr when the last
+  // reaction with it has been removed.
+  void update(const std::string& name, const reactions::reaction* reaction);
+  // Replaces the emoji pixbufs with ones of the current emoji size.
+  void rescale_emojis();
+
+ private:
+  struct entry {
+    Gtk::FlowBoxChild* child;
+    // nullptr if the emoji is shown by name
+    Gtk::Image* image;
+    Gtk::Label* count_label;
+  };
+
+  entry create_entry(const reactions::reaction& reaction);
+  void update_entry(const entry& entry, const reactions::reaction& reaction);
+  void remove_entry(const entry& entry);
+
+  team& team_;
+  std::shared_ptr<settings_snapshot> settings_;
+  std::map<std::string, entry> entries_;
+};
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef SLACK_GTK_READ_MARKER_MANAGER_H
+#define SLACK_GTK_READ_MARKER_MANAGER_H
+
+#include <json/json.h>
+#include <sigc++/sigc++.h>
+#include <boost/optional.hpp>
+#include <map>
+#include <memory>
+#include <string>
+
+class api_client;
+
+// Sends channels.mark for the newest message the user has seen in each
+// channel. Marks are debounced, and at most one request per channel is in
+// flight; newer marks issued meanwhile replace the pending one.
+class read_marker_manager {
+ public:
+  read_marker_manager(std::shared_ptr<api_client> api_client);
+  read_marker_manager(const read_marker_manager& other) = delete;
+  ~read_marker_manager();
+
+  // Records that the message at ts has been shown. Older ts are ignored.
+  void mark(const std::string& channel_id, const std::string& ts);
+  // Records a mark done elsewhere (e.g. channel_marked from another client).
+  void set_marked(const std::string& channel_id, const std::string& ts);
+  // Sends all pending marks synchronously. Used on shutdown.
+  void flush();
+
+ private:
+  struct channel_state {
+    // Newest ts known to the server
+    std::string marked;
+    // Newest ts to be sent, or empty
+    std::string pending;
+    bool in_flight;
+  };
+
+  void schedule_send();
+  bool on_send_timeout();
+  void send(const std::string& channel_id);
+  void on_marked(const std::string& channel_id, const std::string& ts,
+                 const boost::optional<Json::Value>& result);
+
+  std::shared_ptr<api_client> api_client_;
+  std::map<std::string, channel_state> channels_;
+  sigc::connection send_timeout_;
+};
+
+#endif
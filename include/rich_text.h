@@ -0,0 +1,74 @@
+#ifndef SLACK_GTK_RICH_TEXT_H
+#define SLACK_GTK_RICH_TEXT_H
+
+#include <gdkmm/pixbuf.h>
+#include <glibmm/refptr.h>
+#include <string>
+#include <vector>
+
+// Tokenized text of a message, shown either by a Pango layout or by a
+// Gtk::TextBuffer. Ranges are byte offsets into text.
+struct rich_text {
+  enum style_type {
+    STYLE_INFO_MESSAGE,
+    STYLE_LINK,
+    STYLE_BOLD,
+    STYLE_ITALIC,
+    STYLE_STRIKE,
+    STYLE_CODE,
+    // Fenced code block
+    STYLE_PRE,
+    STYLE_QUOTE,
+    // Highlighted code
+    STYLE_CODE_KEYWORD,
+    STYLE_CODE_STRING,
+    STYLE_CODE_COMMENT,
+    STYLE_CODE_NUMBER,
+    STYLE_DIFF_ADDED,
+    STYLE_DIFF_REMOVED,
+    STYLE_DIFF_HEADER,
+  };
+  // LINK_EXPAND shows the rest of collapsed code blocks.
+  enum link_type { LINK_USER, LINK_CHANNEL, LINK_URL, LINK_EXPAND };
+
+  struct span {
+    std::size_t start, end;
+    style_type style;
+  };
+  struct link {
+    std::size_t start, end;
+    link_type type;
+    std::string target;
+  };
+  // An emoji takes the object replacement character (U+FFFC) at index, like
+  // a pixbuf in a Gtk::TextBuffer.
+  struct emoji {
+    std::size_t index;
+    std::string name;
+    Glib::RefPtr<Gdk::Pixbuf> pixbuf;
+  };
+
+  std::string text;
+  std::vector<span> spans;
+  // Sorted by start, not overlapping
+  std::vector<link> links;
+  std::vector<emoji> emojis;
+
+  void clear();
+  void append(const std::string& s);
+  // Appends s[pos, pos + count) without copying it first.
+  void append(const std::string& s, std::size_t pos, std::size_t count);
+  void append(const std::string& s, style_type style);
+  // Styles text[start, end) that has already been appended.
+  void add_span(std::size_t start, std::size_t end, style_type style);
+  void append_link(const std::string& s, link_type type,
+                   const std::string& target);
+  void append_emoji(const std::string& name, Glib::RefPtr<Gdk::Pixbuf> pixbuf);
+
+  // Returns nullptr if there's no link at index.
+  const link* find_link(std::size_t index) const;
+  // The text without emoji
+  std::string plain_text() const;
+};
+
+#endif
@@ -24,6 +24,8 @@ class rtm_client {
   message_signal_type channel_left_signal();
   message_signal_type user_typing_signal();
   message_signal_type emoji_changed_signal();
+  message_signal_type reaction_added_signal();
+  message_signal_type reaction_removed_signal();
 
  private:
   static void session_connect_callback(GObject* source, GAsyncResult* result,
@@ -52,7 +54,8 @@ class rtm_client {
   message_signal_type hello_signal_, reconnect_url_signal_,
       presence_change_signal_, pref_change_signal_, message_signal_,
       channel_marked_signal_, channel_joined_signal_, channel_left_signal_,
-      user_typing_signal_, emoji_changed_signal_;
+      user_typing_signal_, emoji_changed_signal_, reaction_added_signal_,
+      reaction_removed_signal_;
 };
 
 #endif
@@ -0,0 +1,48 @@
+#ifndef SLACK_GTK_SETTINGS_SNAPSHOT_H
+#define SLACK_GTK_SETTINGS_SNAPSHOT_H
+
+#include <giomm/settings.h>
+#include <sigc++/sigc++.h>
+#include <string>
+#include <vector>
+
+// Typed copy of the cc.wanko.slack-gtk settings, read where values are needed
+// for every message or emoji instead of going through GSettings. It follows
+// GSettings' changed signal.
+class settings_snapshot {
+ public:
+  settings_snapshot(Glib::RefPtr<Gio::Settings> settings);
+  settings_snapshot(const settings_snapshot& other) = delete;
+
+  unsigned int notification_timeout() const;
+  double dpi() const;
+  int user_icon_size() const;
+  int emoji_size() const;
+  // In MiB
+  unsigned int image_cache_size() const;
+  // Whether links not unfurled by Slack are fetched for previews
+  bool link_previews() const;
+  // Words that make a message notify like a mention
+  const std::vector<std::string>& highlight_words() const;
+
+  // Emitted with the key after the snapshot has been updated.
+  sigc::signal<void, const std::string&> signal_changed();
+
+ private:
+  // Returns false if the key is unknown.
+  bool load(const std::string& key);
+  void on_changed(const Glib::ustring& key);
+
+  Glib::RefPtr<Gio::Settings> settings_;
+  unsigned int notification_timeout_;
+  double dpi_;
+  int user_icon_size_;
+  int emoji_size_;
+  unsigned int image_cache_size_;
+  bool link_previews_;
+  std::vector<std::string> highlight_words_;
+
+  sigc::signal<void, const std::string&> signal_changed_;
+};
+
+#endif
@@ -10,6 +10,12 @@ class users_store;
 class channels_store;
 class icon_loader;
 class emoji_loader;
+class disk_cache;
+class file_downloader;
+class link_preview_loader;
+class read_marker_manager;
+class code_highlighter;
+class highlight_matcher;
 
 class team {
  public:
@@ -21,8 +27,17 @@ class team {
   std::shared_ptr<rtm_client> rtm_client_;
   std::shared_ptr<users_store> users_store_;
   std::shared_ptr<channels_store> channels_store_;
+  std::shared_ptr<disk_cache> disk_cache_;
   std::shared_ptr<icon_loader> icon_loader_;
+  // Loads previews of attached images
+  std::shared_ptr<icon_loader> image_loader_;
   std::shared_ptr<emoji_loader> emoji_loader_;
+  std::shared_ptr<file_downloader> file_downloader_;
+  std::shared_ptr<link_preview_loader> link_preview_loader_;
+  std::shared_ptr<read_marker_manager> read_marker_manager_;
+  std::shared_ptr<code_highlighter> code_highlighter_;
+  // Decides which messages notify
+  std::shared_ptr<highlight_matcher> highlight_matcher_;
 };
 
 #endif
@@ -0,0 +1,85 @@
+#ifndef SLACK_GTK_THREAD_VIEW_H
+#define SLACK_GTK_THREAD_VIEW_H
+
+#include <gtkmm/box.h>
+#include <gtkmm/button.h>
+#include <gtkmm/listbox.h>
+#include <json/json.h>
+#include <boost/optional.hpp>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include "settings_snapshot.h"
+#include "team.h"
+
+class MessageRow;
+
+// Replies of a thread, shown under the parent message while the thread is
+// expanded. Replies are fetched page by page with conversations.replies, and
+// at most a fixed number of them are rendered. Those unloaded are fetched
+// again with the oldest and latest they span.
+class ThreadView : public Gtk::Box {
+ public:
+  ThreadView(team& team, std::shared_ptr<settings_snapshot> settings,
+             const std::string& channel_id, const std::string& thread_ts);
+  ~ThreadView() override;
+
+  // Loads the next page of replies, or the unloaded ones after the rendered.
+  void load_more();
+  // Loads the unloaded replies before the rendered.
+  void load_earlier();
+  // Called for replies arriving through RTM.
+  void add_reply(const Json::Value& payload);
+  void update_reply(const Json::Value& payload);
+  void remove_reply(const std::string& ts);
+  void redraw_messages();
+  void rescale_images();
+  // Sets the replies overlapping the viewport, from top to bottom in the
+  // coordinates of the view, on screen, and those further than margin from
+  // it off screen.
+  void update_on_screen_rows(double top, double bottom, double margin);
+  void set_off_screen();
+
+  sigc::signal<void, const std::string&> signal_channel_link_clicked();
+
+ private:
+  enum page_type { next_page, unloaded_older, unloaded_newer };
+
+  void request_replies(std::map<std::string, std::string> params,
+                       page_type type);
+  void on_replies(const boost::optional<Json::Value>& result, page_type type);
+  // Inserts a row at position, or at the end if it's -1.
+  void insert_reply(const Json::Value& payload, int position);
+  void delete_row(MessageRow* row);
+  void unload_oldest_replies();
+  void unload_newest_replies();
+  void update_buttons();
+
+  team& team_;
+  std::shared_ptr<settings_snapshot> settings_;
+  std::string channel_id_;
+  std::string thread_ts_;
+
+  Gtk::Button earlier_button_;
+  Gtk::ListBox replies_list_box_;
+  Gtk::Button more_button_;
+  std::unordered_map<std::string, MessageRow*> rows_by_ts_;
+  // ts of the replies set on screen and not yet set off screen
+  std::unordered_set<std::string> shown_rows_;
+  // ts of the unloaded replies before and after the rendered, oldest first
+  std::deque<std::string> older_unloaded_;
+  std::deque<std::string> newer_unloaded_;
+  // Range of the unloaded replies being fetched
+  std::string requested_oldest_;
+  std::string requested_latest_;
+  // Cursor of the next page, empty when all replies have been fetched
+  std::string next_cursor_;
+  bool loading_;
+  // true until the first page has arrived
+  bool has_more_;
+
+  sigc::signal<void, const std::string&> signal_channel_link_clicked_;
+};
+
+#endif
@@ -87,6 +87,14 @@ void api_client::queue_post(const std::string& method_name,
   soup_session_queue_message(session_, message, queue_callback, this);
 }
 
+std::size_t api_client::pending_requests() const {
+  return callback_registry_.size();
+}
+
+const std::string& api_client::token() const {
+  return token_;
+}
+
 void api_client::queue_callback(SoupSession*, SoupMessage* message,
                                 gpointer user_data) {
   static_cast<api_client*>(user_data)->on_queue_callback(message);
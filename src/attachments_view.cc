@@ -1,24 +1,295 @@
 #include "attachments_view.h"
+#include <glibmm/markup.h>
+#include <gtkmm/drawingarea.h>
+#include <gtkmm/grid.h>
+#include <gtkmm/label.h>
+#include <algorithm>
+#include <functional>
 #include "message_text_view.h"
 
+// Longer side of image_url and thumb_url previews
+static const int image_preview_size = 360;
+static const int thumb_preview_size = 75;
+static const int color_bar_width = 4;
+// Height reserved for previews of unknown size until they're loaded
+static const int placeholder_height = 48;
+
+// Parses the color of an attachment: a hex RGB value, with or without '#',
+// or one of Slack's named colors.
+static Gdk::RGBA attachment_color(const std::string& color) {
+  Gdk::RGBA rgba("#dddddd");
+  if (color == "good") {
+    rgba.set("#2eb886");
+  } else if (color == "warning") {
+    rgba.set("#daa038");
+  } else if (color == "danger") {
+    rgba.set("#a30200");
+  } else if (!color.empty()) {
+    Gdk::RGBA parsed;
+    if (parsed.set(color[0] == '#' ? color : "#" + color)) {
+      rgba = parsed;
+    }
+  }
+  return rgba;
+}
+
+static Gtk::Label* create_bold_label(const std::string& text) {
+  Gtk::Label* label =
+      Gtk::manage(new Gtk::Label(text, Gtk::ALIGN_START, Gtk::ALIGN_CENTER));
+  Pango::AttrList attrs;
+  Pango::Attribute weight =
+      Pango::Attribute::create_attr_weight(Pango::WEIGHT_BOLD);
+  attrs.insert(weight);
+  label->set_attributes(attrs);
+  label->set_line_wrap(true);
+  return label;
+}
+
 AttachmentsView::AttachmentsView(team& team,
-                                 Glib::RefPtr<Gio::Settings> settings,
-                                 const Json::Value& attachments) {
+                                 std::shared_ptr<settings_snapshot> settings,
+                                 const Json::Value& attachments)
+    : team_(team),
+      settings_(settings),
+      text_views_(),
+      previews_(),
+      on_screen_(false) {
   set_orientation(Gtk::ORIENTATION_VERTICAL);
 
   for (const Json::Value& attachment : attachments) {
-    auto view = Gtk::manage(new MessageTextView(team, settings));
-    // TODO: Render attachment in rich format
-    if (attachment["fallback"].isString()) {
-      view->set_text(attachment["fallback"].asString(), true);
-    } else {
-      view->set_text("No fallback found", true);
-    }
-    add(*view);
+    add_attachment(attachment);
   }
 
   show_all_children();
 }
 
 AttachmentsView::~AttachmentsView() {
+  for (const preview& preview : previews_) {
+    if (preview.request != 0) {
+      team_.image_loader_->cancel(preview.request);
+    }
+  }
+}
+
+Gtk::Box* AttachmentsView::add_attachment(const Json::Value& attachment) {
+  Gtk::Box* card = Gtk::manage(new Gtk::Box(Gtk::ORIENTATION_VERTICAL));
+  pack_start(*card, Gtk::PACK_SHRINK);
+  if (attachment["pretext"].isString()) {
+    add_text(*card, attachment["pretext"].asString());
+  }
+
+  Gtk::Box* hbox = Gtk::manage(new Gtk::Box(Gtk::ORIENTATION_HORIZONTAL, 6));
+  card->pack_start(*hbox, Gtk::PACK_SHRINK);
+
+  Gtk::DrawingArea* color_bar = Gtk::manage(new Gtk::DrawingArea());
+  color_bar->set_size_request(color_bar_width, -1);
+  const Gdk::RGBA color = attachment_color(attachment["color"].asString());
+  color_bar->signal_draw().connect(
+      [color](const Cairo::RefPtr<Cairo::Context>& cr) {
+        cr->set_source_rgba(color.get_red(), color.get_green(),
+                            color.get_blue(), color.get_alpha());
+        cr->paint();
+        return true;
+      });
+  hbox->pack_start(*color_bar, Gtk::PACK_SHRINK);
+
+  Gtk::Box* vbox = Gtk::manage(new Gtk::Box(Gtk::ORIENTATION_VERTICAL, 2));
+  hbox->pack_start(*vbox, Gtk::PACK_EXPAND_WIDGET);
+
+  // The site of link unfurls
+  const std::string service_name = attachment["service_name"].asString();
+  if (!service_name.empty()) {
+    vbox->pack_start(
+        *Gtk::manage(new Gtk::Label(service_name, Gtk::ALIGN_START,
+                                    Gtk::ALIGN_CENTER)),
+        Gtk::PACK_SHRINK);
+  }
+
+  const std::string author_name = attachment["author_name"].asString();
+  if (!author_name.empty()) {
+    vbox->pack_start(
+        *Gtk::manage(new Gtk::Label(author_name, Gtk::ALIGN_START,
+                                    Gtk::ALIGN_CENTER)),
+        Gtk::PACK_SHRINK);
+  }
+
+  const std::string title = attachment["title"].asString();
+  if (!title.empty()) {
+    Gtk::Label* title_label = create_bold_label(title);
+    const std::string title_link = attachment["title_link"].asString();
+    if (!title_link.empty()) {
+      // GtkLabel opens the link itself.
+      title_label->set_markup("<a href=\"" +
+                              Glib::Markup::escape_text(title_link) + "\">" +
+                              Glib::Markup::escape_text(title) + "</a>");
+    }
+    vbox->pack_start(*title_label, Gtk::PACK_SHRINK);
+  }
+
+  const std::string text = attachment["text"].asString();
+  if (!text.empty()) {
+    add_text(*vbox, text);
+  }
+  add_fields(*vbox, attachment["fields"]);
+
+  if (attachment["image_url"].isString()) {
+    add_preview(*vbox, attachment["image_url"].asString(), image_preview_size,
+                attachment["image_width"], attachment["image_height"]);
+  } else if (attachment["thumb_url"].isString()) {
+    add_preview(*hbox, attachment["thumb_url"].asString(), thumb_preview_size,
+                attachment["thumb_width"], attachment["thumb_height"]);
+  }
+
+  const std::string footer = attachment["footer"].asString();
+  if (!footer.empty()) {
+    add_text(*vbox, footer);
+  }
+
+  if (vbox->get_children().empty()) {
+    // Nothing but the plain-text summary
+    add_text(*vbox, attachment["fallback"].isString()
+                        ? attachment["fallback"].asString()
+                        : "No fallback found");
+  }
+  return card;
+}
+
+void AttachmentsView::insert_attachment(int position,
+                                        const Json::Value& attachment) {
+  const std::size_t first_text_view = text_views_.size();
+  const std::size_t first_preview = previews_.size();
+  Gtk::Box* card = add_attachment(attachment);
+  reorder_child(*card, position);
+  card->show_all();
+  if (on_screen_) {
+    for (std::size_t i = first_text_view; i < text_views_.size(); ++i) {
+      text_views_[i]->set_on_screen();
+    }
+    for (std::size_t i = first_preview; i < previews_.size(); ++i) {
+      load_preview(i);
+    }
+  }
+}
+
+void AttachmentsView::add_text(Gtk::Box& box, const std::string& text) {
+  auto view = Gtk::manage(new MessageTextView(team_, settings_));
+  view->set_text(text, true);
+  box.pack_start(*view, Gtk::PACK_SHRINK);
+  text_views_.push_back(view);
+}
+
+void AttachmentsView::add_fields(Gtk::Box& box, const Json::Value& fields) {
+  if (!fields.isArray() || fields.empty()) {
+    return;
+  }
+  Gtk::Grid* grid = Gtk::manage(new Gtk::Grid());
+  grid->set_column_spacing(12);
+  grid->set_column_homogeneous(true);
+  box.pack_start(*grid, Gtk::PACK_SHRINK);
+
+  // Short fields are laid out two per row; others take a whole row.
+  int row = 0;
+  int column = 0;
+  for (const Json::Value& field : fields) {
+    const int width = field["short"].asBool() ? 1 : 2;
+    if (column + width > 2) {
+      row += 2;
+      column = 0;
+    }
+    grid->attach(*create_bold_label(field["title"].asString()), column, row,
+                 width, 1);
+    auto value = Gtk::manage(new MessageTextView(team_, settings_));
+    value->set_text(field["value"].asString(), true);
+    grid->attach(*value, column, row + 1, width, 1);
+    text_views_.push_back(value);
+    column += width;
+  }
+}
+
+void AttachmentsView::add_preview(Gtk::Box& box, const std::string& url,
+                                  int size, const Json::Value& width,
+                                  const Json::Value& height) {
+  Gtk::Image* image = Gtk::manage(new Gtk::Image());
+  image->set_alignment(Gtk::ALIGN_START, Gtk::ALIGN_START);
+  // Reserve the space of the preview so that rows don't move when it's
+  // loaded or dropped. Without the size, a full size x size box would leave
+  // a gap under small images, so only a placeholder is reserved.
+  if (width.isInt() && height.isInt() && width.asInt() > 0 &&
+      height.asInt() > 0) {
+    const int longer = std::max(width.asInt(), height.asInt());
+    image->set_size_request(width.asInt() * size / longer,
+                            height.asInt() * size / longer);
+  } else {
+    image->set_size_request(-1, std::min(size, placeholder_height));
+  }
+  box.pack_start(*image, Gtk::PACK_SHRINK);
+
+  const preview preview = {url, size, image, 0, false};
+  previews_.push_back(preview);
+}
+
+void AttachmentsView::redraw_texts() {
+  for (MessageTextView* view : text_views_) {
+    view->redraw_message();
+  }
+}
+
+void AttachmentsView::rescale_emojis() {
+  for (MessageTextView* view : text_views_) {
+    view->rescale_emojis();
+  }
+}
+
+void AttachmentsView::set_on_screen() {
+  if (on_screen_) {
+    return;
+  }
+  on_screen_ = true;
+  for (MessageTextView* view : text_views_) {
+    view->set_on_screen();
+  }
+  for (std::size_t i = 0; i < previews_.size(); ++i) {
+    load_preview(i);
+  }
+}
+
+void AttachmentsView::set_off_screen() {
+  on_screen_ = false;
+  for (preview& preview : previews_) {
+    if (preview.request != 0) {
+      team_.image_loader_->cancel(preview.request);
+      preview.request = 0;
+    }
+    if (preview.loaded) {
+      // Keep the allocated size; the image comes back with the same one.
+      const Glib::RefPtr<Gdk::Pixbuf> pixbuf = preview.image->get_pixbuf();
+      preview.image->set_size_request(pixbuf->get_width(),
+                                      pixbuf->get_height());
+      preview.image->clear();
+      preview.loaded = false;
+    }
+  }
+}
+
+void AttachmentsView::load_preview(std::size_t index) {
+  preview& preview = previews_[index];
+  if (preview.loaded || preview.request != 0) {
+    return;
+  }
+  // The callback may run right away if the image is in memory.
+  const icon_loader::request_id id = team_.image_loader_->load(
+      preview.url, preview.size,
+      std::bind(&AttachmentsView::on_preview_loaded, this, index,
+                std::placeholders::_1),
+      icon_loader::PRIORITY_VISIBLE);
+  if (id != 0) {
+    preview.request = id;
+  }
+}
+
+void AttachmentsView::on_preview_loaded(std::size_t index,
+                                        Glib::RefPtr<Gdk::Pixbuf> pixbuf) {
+  preview& preview = previews_[index];
+  preview.request = 0;
+  preview.image->set(pixbuf);
+  preview.loaded = true;
 }
@@ -11,28 +11,48 @@ BottomAdjustment::BottomAdjustment(double value, double lower, double upper,
                                    double page_size)
     : Gtk::Adjustment(value, lower, upper, step_increment, page_increment,
                       page_size),
-      is_bottom(double_eq(value + page_size, lower)) {
+      is_bottom(double_eq(value + page_size, lower)),
+      keep_distance_from_bottom_(false),
+      distance_from_bottom_(upper - value),
+      kept_upper_(upper) {
 }
 
 BottomAdjustment::~BottomAdjustment() {
 }
 
-Glib::RefPtr<Gtk::Adjustment> BottomAdjustment::create(
+Glib::RefPtr<BottomAdjustment> BottomAdjustment::create(
     Glib::RefPtr<Gtk::Adjustment> adj) {
-  return Glib::RefPtr<Gtk::Adjustment>(
+  return Glib::RefPtr<BottomAdjustment>(
       new BottomAdjustment(adj->get_value(), adj->get_lower(), adj->get_upper(),
                            adj->get_step_increment(), adj->get_page_increment(),
                            adj->get_page_size()));
 }
 
+void BottomAdjustment::keep_distance_from_bottom() {
+  keep_distance_from_bottom_ = true;
+  distance_from_bottom_ = get_upper() - get_value();
+  kept_upper_ = get_upper();
+}
+
+void BottomAdjustment::keep_value() {
+  keep_distance_from_bottom_ = false;
+}
+
 void BottomAdjustment::on_changed() {
   Adjustment::on_changed();
   if (is_bottom) {
     set_value(get_upper());
+  } else if (keep_distance_from_bottom_ &&
+             !double_eq(get_upper(), kept_upper_)) {
+    // Only for the content changed since keep_distance_from_bottom(); later
+    // changes below the viewport must not scroll.
+    keep_distance_from_bottom_ = false;
+    set_value(get_upper() - distance_from_bottom_);
   }
 }
 
 void BottomAdjustment::on_value_changed() {
   Adjustment::on_value_changed();
   is_bottom = double_eq(get_value() + get_page_size(), get_upper());
+  distance_from_bottom_ = get_upper() - get_value();
 }
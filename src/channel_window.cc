@@ -1,21 +1,61 @@
 #include "channel_window.h"
+#include <glibmm/miscutils.h>
 #include <gtkmm/scrollbar.h>
 #include <gtkmm/scrolledwindow.h>
-#include <libnotify/notification.h>
-#include <chrono>
+#include <gtkmm/window.h>
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 #include "bottom_adjustment.h"
+#include "channels_store.h"
+#include "highlight_matcher.h"
 #include "message_entry.h"
 #include "message_row.h"
+#include "reactions.h"
+#include "read_marker_manager.h"
+#include "users_store.h"
 
-ChannelWindow::ChannelWindow(team& team, Glib::RefPtr<Gio::Settings> settings,
+// Number of messages requested per channels.history page
+static const int history_page_size = 100;
+// Rows beyond this number are unloaded when they are far from the viewport.
+static const std::size_t max_rendered_rows = 400;
+// Load more rows when the viewport gets closer than this many screens to the
+// top (or to the unloaded rows at the bottom).
+static const double prefetch_distance = 1.5;
+// Rows within this many screens from the viewport are never unloaded.
+static const double keep_distance = 3.0;
+// Time spent building history rows per main loop iteration
+static const std::chrono::milliseconds build_slice_budget(5);
+static const unsigned int stall_probe_interval_ms = 10;
+
+ChannelWindow::ChannelWindow(team& team,
+                             std::shared_ptr<settings_snapshot> settings,
                              const channel& chan)
     : Glib::ObjectBase(typeid(ChannelWindow)),
       Gtk::Box(),
       settings_(settings),
       messages_list_box_(),
+      vadjustment_(),
+      scroll_update_(),
       unread_count_(*this, "unread-count", chan.unread_count),
       history_loaded_(false),
+      history_loading_(false),
+      has_more_history_(true),
+      unloaded_newer_messages_(),
+      rows_by_ts_(),
+      prefetched_history_(),
+      prefetched_bytes_(0),
+      prefetch_stale_(false),
+      pending_history_(),
+      history_build_(),
+      stall_probe_(),
+      build_started_at_(),
+      last_probe_(),
+      longest_stall_(),
+      rows_built_(0),
+      shown_rows_(),
+      messages_stale_(false),
+      images_stale_(false),
 
       id_(chan.id),
       name_(chan.name),
@@ -30,14 +70,29 @@ ChannelWindow::ChannelWindow(team& team, Glib::RefPtr<Gio::Settings> settings,
   messages_scrolled_window->add(messages_list_box_);
   messages_scrolled_window->set_policy(Gtk::POLICY_NEVER,
                                        Gtk::POLICY_AUTOMATIC);
-  messages_scrolled_window->set_vadjustment(
-      BottomAdjustment::create(messages_scrolled_window->get_vadjustment()));
+  vadjustment_ =
+      BottomAdjustment::create(messages_scrolled_window->get_vadjustment());
+  messages_scrolled_window->set_vadjustment(vadjustment_);
+  vadjustment_->signal_value_changed().connect(
+      sigc::mem_fun(*this, &ChannelWindow::schedule_scroll_update));
+  vadjustment_->signal_changed().connect(
+      sigc::mem_fun(*this, &ChannelWindow::schedule_scroll_update));
 
   messages_list_box_.set_selection_mode(Gtk::SELECTION_NONE);
 
+  if (!chan.last_read.empty()) {
+    team_.read_marker_manager_->set_marked(id_, chan.last_read);
+  }
+
   show_all_children();
 }
 
+ChannelWindow::~ChannelWindow() {
+  scroll_update_.disconnect();
+  history_build_.disconnect();
+  stall_probe_.disconnect();
+}
+
 const std::string& ChannelWindow::id() const {
   return id_;
 }
@@ -46,86 +101,576 @@ const std::string& ChannelWindow::name() const {
 }
 
 void ChannelWindow::load_history() {
-  if (history_loaded_) {
+  if (history_loading_ || !has_more_history_) {
     return;
   }
+  history_loading_ = true;
 
   // TODO: Show loading indicator
   std::map<std::string, std::string> params;
   params.emplace(std::make_pair("channel", id()));
+  params.emplace(std::make_pair("count", std::to_string(history_page_size)));
+  const MessageRow* row =
+      static_cast<decltype(row)>(messages_list_box_.get_row_at_index(0));
+  if (row != nullptr) {
+    params["latest"] = row->ts();
+  }
+  // The window is deleted when the channel is left, possibly before the
+  // response arrives. The slot is invalidated then.
+  sigc::slot<void, const boost::optional<Json::Value>&> slot =
+      sigc::mem_fun(*this, &ChannelWindow::on_channels_history);
+  team_.api_client_->queue_post(
+      "channels.history", params,
+      [slot](const boost::optional<Json::Value>& result) { slot(result); });
+}
+
+void ChannelWindow::prefetch_history() {
+  if (!needs_prefetch()) {
+    return;
+  }
+  history_loading_ = true;
+  prefetch_stale_ = false;
+
+  std::map<std::string, std::string> params;
+  params.emplace(std::make_pair("channel", id()));
+  params.emplace(std::make_pair("count", std::to_string(history_page_size)));
   const MessageRow* row =
       static_cast<decltype(row)>(messages_list_box_.get_row_at_index(0));
   if (row != nullptr) {
     params["latest"] = row->ts();
   }
-  team_.api_client_->queue_post("channels.history", params,
-                                std::bind(&ChannelWindow::on_channels_history,
-                                          this, std::placeholders::_1));
+  sigc::slot<void, const boost::optional<Json::Value>&> slot =
+      sigc::mem_fun(*this, &ChannelWindow::on_prefetched_history);
+  team_.api_client_->queue_post(
+      "channels.history", params,
+      [slot](const boost::optional<Json::Value>& result) { slot(result); });
+}
+
+bool ChannelWindow::needs_prefetch() const {
+  return unread_count() > 0 && !history_loaded_ && !history_loading_ &&
+         !prefetched_history_;
+}
+
+std::size_t ChannelWindow::prefetched_bytes() const {
+  return prefetched_bytes_;
+}
+
+void ChannelWindow::on_prefetched_history(
+    const boost::optional<Json::Value>& result) {
+  // An event may have changed a message of the page after it was sent.
+  const bool usable = result && !prefetch_stale_;
+  if (usable && get_child_visible()) {
+    // The user has switched to this channel in the meantime.
+    on_channels_history(result);
+    return;
+  }
+
+  history_loading_ = false;
+  if (usable) {
+    prefetched_history_ = result;
+    // Rough estimate; the text dominates and the rest is mostly constant
+    prefetched_bytes_ = 0;
+    for (const Json::Value& message : result.get()["messages"]) {
+      prefetched_bytes_ += 512 + message["text"].asString().size();
+    }
+    return;
+  }
+  if (!result) {
+    std::cerr << "[channel " << name()
+              << "] failed to prefetch history from channels.history API"
+              << std::endl;
+  }
+  if (get_child_visible()) {
+    // Shown in the meantime; nothing else would load the history.
+    load_history();
+  }
+}
+
+void ChannelWindow::drop_prefetched_history() {
+  prefetched_history_ = boost::none;
+  prefetched_bytes_ = 0;
+  prefetch_stale_ = true;
+}
+
+// Replies are shown in their thread, except those also sent to the channel.
+static bool is_thread_reply(const Json::Value& message) {
+  const Json::Value& thread_ts = message["thread_ts"];
+  return thread_ts.isString() &&
+         thread_ts.asString() != message["ts"].asString();
 }
 
 void ChannelWindow::on_message_signal(const Json::Value& payload) {
-  MessageRow* row = append_message(payload);
+  const std::string subtype = payload["subtype"].asString();
+  if (subtype == "message_changed") {
+    const Json::Value& message = payload["message"];
+    if (is_thread_reply(message)) {
+      MessageRow* parent = find_row(message["thread_ts"].asString());
+      if (parent != nullptr) {
+        parent->update_reply(message);
+      }
+    } else {
+      on_message_changed(message);
+    }
+    return;
+  } else if (subtype == "message_deleted") {
+    const Json::Value& previous = payload["previous_message"];
+    const std::string ts = payload["deleted_ts"].asString();
+    if (is_thread_reply(previous)) {
+      MessageRow* parent = find_row(previous["thread_ts"].asString());
+      if (parent != nullptr) {
+        parent->remove_reply(ts);
+      }
+    } else {
+      on_message_deleted(ts);
+    }
+    return;
+  } else if (subtype == "message_replied") {
+    on_message_replied(payload["message"]);
+    return;
+  }
+
+  if (is_thread_reply(payload)) {
+    on_thread_reply(payload);
+    if (subtype != "thread_broadcast") {
+      if (team_.highlight_matcher_->matches(payload)) {
+        send_notification(payload);
+      }
+      return;
+    }
+  }
+
+  const std::string ts = payload["ts"].asString();
+  if (rows_by_ts_.count(ts) != 0) {
+    // Already arrived with channels.history
+    return;
+  }
+
+  if (!unloaded_newer_messages_.empty()) {
+    // The user is reading older history and the rows in between are
+    // unloaded. Keep the message until they scroll back down.
+    unloaded_newer_messages_.push_back(payload);
+    rows_by_ts_.emplace(ts, nullptr);
+    unread_count_.set_value(unread_count() + 1);
+    if (team_.highlight_matcher_->matches(payload)) {
+      send_notification(payload);
+    }
+    return;
+  }
+
+  vadjustment_->keep_value();
+  append_message(payload);
   if (!is_visible() || !get_child_visible()) {
     unread_count_.set_value(unread_count() + 1);
   }
-  send_notification(row);
+  // Other messages only count as unread.
+  if (team_.highlight_matcher_->matches(payload)) {
+    send_notification(payload);
+  }
+}
+
+// Finds the message at ts among those not rendered as rows.
+static std::deque<Json::Value>::iterator find_message(
+    std::deque<Json::Value>& messages, const std::string& ts) {
+  return std::find_if(messages.begin(), messages.end(),
+                      [&ts](const Json::Value& message) {
+                        return message["ts"].asString() == ts;
+                      });
+}
+
+void ChannelWindow::on_thread_reply(const Json::Value& payload) {
+  drop_prefetched_history();
+  const std::string thread_ts = payload["thread_ts"].asString();
+  const auto it = rows_by_ts_.find(thread_ts);
+  if (it == rows_by_ts_.end()) {
+    return;
+  }
+
+  if (it->second != nullptr) {
+    it->second->add_reply(payload);
+    return;
+  }
+  // Keep the summary of the stored parent up to date.
+  auto parent = find_message(pending_history_, thread_ts);
+  if (parent == pending_history_.end()) {
+    parent = find_message(unloaded_newer_messages_, thread_ts);
+    if (parent == unloaded_newer_messages_.end()) {
+      return;
+    }
+  }
+  (*parent)["reply_count"] = (*parent)["reply_count"].asInt() + 1;
+}
+
+void ChannelWindow::on_message_replied(const Json::Value& message) {
+  drop_prefetched_history();
+  const std::string ts = message["ts"].asString();
+  const auto it = rows_by_ts_.find(ts);
+  if (it == rows_by_ts_.end()) {
+    return;
+  }
+
+  const int reply_count = message["reply_count"].asInt();
+  if (it->second != nullptr) {
+    it->second->set_reply_count(reply_count);
+    return;
+  }
+  auto parent = find_message(pending_history_, ts);
+  if (parent == pending_history_.end()) {
+    parent = find_message(unloaded_newer_messages_, ts);
+    if (parent == unloaded_newer_messages_.end()) {
+      return;
+    }
+  }
+  (*parent)["reply_count"] = reply_count;
+}
+
+void ChannelWindow::on_message_changed(const Json::Value& message) {
+  drop_prefetched_history();
+  const std::string ts = message["ts"].asString();
+  const auto it = rows_by_ts_.find(ts);
+  if (it == rows_by_ts_.end()) {
+    // Not loaded; channels.history will return the edited one.
+    return;
+  }
+
+  if (it->second != nullptr) {
+    it->second->update(message);
+    return;
+  }
+  auto pending = find_message(pending_history_, ts);
+  if (pending != pending_history_.end()) {
+    *pending = message;
+  }
+  auto unloaded = find_message(unloaded_newer_messages_, ts);
+  if (unloaded != unloaded_newer_messages_.end()) {
+    *unloaded = message;
+  }
+}
+
+void ChannelWindow::on_message_deleted(const std::string& ts) {
+  drop_prefetched_history();
+  const auto it = rows_by_ts_.find(ts);
+  if (it == rows_by_ts_.end()) {
+    return;
+  }
+
+  MessageRow* row = it->second;
+  rows_by_ts_.erase(it);
+  if (row != nullptr) {
+    const int index = row->get_index();
+    messages_list_box_.remove(*row);
+    delete row;
+    update_continuation(index);
+    return;
+  }
+  auto pending = find_message(pending_history_, ts);
+  if (pending != pending_history_.end()) {
+    pending_history_.erase(pending);
+  }
+  auto unloaded = find_message(unloaded_newer_messages_, ts);
+  if (unloaded != unloaded_newer_messages_.end()) {
+    unloaded_newer_messages_.erase(unloaded);
+  }
+}
+
+void ChannelWindow::on_reaction_added(const Json::Value& payload) {
+  MessageRow* row = find_row(payload["item"]["ts"].asString());
+  if (row == nullptr) {
+    update_stored_reactions(payload, true);
+  } else {
+    row->add_reaction(payload["reaction"].asString(),
+                      payload["user"].asString());
+  }
+}
+
+void ChannelWindow::on_reaction_removed(const Json::Value& payload) {
+  MessageRow* row = find_row(payload["item"]["ts"].asString());
+  if (row == nullptr) {
+    update_stored_reactions(payload, false);
+  } else {
+    row->remove_reaction(payload["reaction"].asString(),
+                         payload["user"].asString());
+  }
+}
+
+void ChannelWindow::update_stored_reactions(const Json::Value& payload,
+                                            bool added) {
+  drop_prefetched_history();
+  const std::string ts = payload["item"]["ts"].asString();
+  if (rows_by_ts_.count(ts) == 0) {
+    // Not loaded; channels.history will have the reaction.
+    return;
+  }
+  auto it = find_message(pending_history_, ts);
+  if (it == pending_history_.end()) {
+    it = find_message(unloaded_newer_messages_, ts);
+    if (it == unloaded_newer_messages_.end()) {
+      return;
+    }
+  }
+
+  reactions r((*it)["reactions"]);
+  const std::string name = payload["reaction"].asString();
+  const std::string user_id = payload["user"].asString();
+  if (added ? r.add(name, user_id) : r.remove(name, user_id)) {
+    (*it)["reactions"] = r.to_json();
+  }
 }
 
 void ChannelWindow::on_channel_marked(const Json::Value& payload) {
   unread_count_.set_value(payload["unread_count"].asInt());
+  team_.read_marker_manager_->set_marked(id(), payload["ts"].asString());
 }
 
 MessageRow* ChannelWindow::append_message(const Json::Value& payload) {
-  auto row = Gtk::manage(new MessageRow(team_, settings_, payload));
+  const std::vector<Gtk::Widget*> rows = messages_list_box_.get_children();
+  const bool continuation =
+      !rows.empty() &&
+      MessageRow::continues(static_cast<MessageRow*>(rows.back())->payload(),
+                            payload);
+  auto row = Gtk::manage(
+      new MessageRow(team_, settings_, id(), payload, continuation));
   messages_list_box_.append(*row);
-  row->signal_channel_link_clicked().connect(
-      sigc::mem_fun(*this, &ChannelWindow::on_channel_link_clicked));
-  row->show();
+  add_row(row);
   return row;
 }
 
-MessageRow* ChannelWindow::prepend_message(const Json::Value& payload) {
-  auto row = Gtk::manage(new MessageRow(team_, settings_, payload));
+MessageRow* ChannelWindow::prepend_message(const Json::Value& payload,
+                                           bool continuation) {
+  auto row = Gtk::manage(
+      new MessageRow(team_, settings_, id(), payload, continuation));
   messages_list_box_.prepend(*row);
+  add_row(row);
+  // Only the oldest row of a page is built before its previous message is
+  // known; for any other row this changes nothing.
+  update_continuation(1);
+  return row;
+}
+
+void ChannelWindow::update_continuation(int index) {
+  MessageRow* row =
+      static_cast<MessageRow*>(messages_list_box_.get_row_at_index(index));
+  if (row == nullptr) {
+    return;
+  }
+  if (index == 0) {
+    row->set_continuation(false);
+    return;
+  }
+  const MessageRow* previous =
+      static_cast<MessageRow*>(messages_list_box_.get_row_at_index(index - 1));
+  row->set_continuation(
+      MessageRow::continues(previous->payload(), row->payload()));
+}
+
+void ChannelWindow::add_row(MessageRow* row) {
+  rows_by_ts_[row->ts()] = row;
   row->signal_channel_link_clicked().connect(
       sigc::mem_fun(*this, &ChannelWindow::on_channel_link_clicked));
   row->show();
-  return row;
 }
 
-void ChannelWindow::send_notification(const MessageRow* row) const {
-  const std::string title = "slack-gtk #" + name();
-  NotifyNotification* notification = notify_notification_new(
-      title.c_str(), row->summary_for_notification().c_str(), nullptr);
-  notify_notification_set_timeout(notification,
-                                  settings_->get_uint("notification-timeout"));
-  notify_notification_set_urgency(notification, NOTIFY_URGENCY_LOW);
+MessageRow* ChannelWindow::find_row(const std::string& ts) const {
+  const auto it = rows_by_ts_.find(ts);
+  if (it == rows_by_ts_.end()) {
+    return nullptr;
+  } else {
+    return it->second;
+  }
+}
 
-  GError* error = nullptr;
-  if (!notify_notification_show(notification, &error)) {
-    std::cerr << "[ChannelWindow] send_notification: " << error->message
-              << std::endl;
+// Builds the text of a notification straight from the payload, so that
+// messages without a row don't need one: links are replaced by their labels
+// and mentions by names.
+static std::string notification_summary(const team& team,
+                                        const Json::Value& payload) {
+  std::string summary = payload["username"].asString();
+  const boost::optional<user> o_user =
+      team.users_store_->find(payload["user"].asString());
+  if (o_user) {
+    summary = o_user.get().name;
+  }
+  summary += ": ";
+
+  const std::string text = payload["text"].asString();
+  std::string plain;
+  std::size_t pos = 0;
+  while (pos < text.size()) {
+    const std::size_t open = text.find('<', pos);
+    const std::size_t close =
+        open == std::string::npos ? open : text.find('>', open);
+    if (close == std::string::npos) {
+      plain.append(text, pos, std::string::npos);
+      break;
+    }
+    plain.append(text, pos, open - pos);
+    const std::string link = text.substr(open + 1, close - open - 1);
+    const std::size_t bar = link.find('|');
+    const std::string target = link.substr(0, bar);
+    const char kind = target.empty() ? '\0' : target[0];
+    if (kind == '@' || kind == '#') {
+      plain += kind;
+    }
+    if (bar != std::string::npos) {
+      plain.append(link, bar + 1, std::string::npos);
+    } else if (kind == '@') {
+      const boost::optional<user> o_linked =
+          team.users_store_->find(target.substr(1));
+      plain += o_linked ? o_linked.get().name : target.substr(1);
+    } else if (kind == '#') {
+      const boost::optional<channel> o_channel =
+          team.channels_store_->find(target.substr(1));
+      plain += o_channel ? o_channel.get().name : target.substr(1);
+    } else if (kind == '!') {
+      // <!here>, <!channel> and <!everyone>
+      plain += "@" + target.substr(1);
+    } else {
+      plain += target;
+    }
+    pos = close + 1;
+  }
+
+  // Slack escapes only these three.
+  static const std::pair<const char*, char> entities[] = {
+      {"&lt;", '<'}, {"&gt;", '>'}, {"&amp;", '&'},
+  };
+  for (std::size_t i = 0; i < plain.size(); ++i) {
+    if (plain[i] != '&') {
+      summary += plain[i];
+      continue;
+    }
+    bool decoded = false;
+    for (const auto& entity : entities) {
+      if (plain.compare(i, std::strlen(entity.first), entity.first) == 0) {
+        summary += entity.second;
+        i += std::strlen(entity.first) - 1;
+        decoded = true;
+        break;
+      }
+    }
+    if (!decoded) {
+      summary += '&';
+    }
   }
+  return summary;
+}
+
+void ChannelWindow::send_notification(const Json::Value& payload) {
+  notification_signal_.emit(notification_summary(team_, payload));
 }
 
 void ChannelWindow::on_channels_history(
     const boost::optional<Json::Value>& result) {
   if (result) {
     for (const Json::Value& message : result.get()["messages"]) {
-      prepend_message(message);
+      if (is_thread_reply(message) &&
+          message["subtype"].asString() != "thread_broadcast") {
+        continue;
+      }
+      // Skip messages that have already arrived through RTM
+      if (rows_by_ts_.emplace(message["ts"].asString(), nullptr).second) {
+        pending_history_.push_back(message);
+      }
     }
+    has_more_history_ = result.get()["has_more"].asBool();
     history_loaded_ = true;
+    start_building_history();
   } else {
+    history_loading_ = false;
     std::cerr << "[channel " << name()
               << "] failed to load history from channels.history API"
               << std::endl;
   }
 }
 
+// Set SLACK_GTK_HISTORY_DEBUG to log how long history takes to build.
+static bool history_debug_enabled() {
+  return !Glib::getenv("SLACK_GTK_HISTORY_DEBUG").empty();
+}
+
+void ChannelWindow::start_building_history() {
+  build_started_at_ = last_probe_ = std::chrono::steady_clock::now();
+  longest_stall_ = std::chrono::steady_clock::duration::zero();
+  rows_built_ = 0;
+  if (history_debug_enabled()) {
+    stall_probe_ = Glib::signal_timeout().connect(
+        sigc::mem_fun(*this, &ChannelWindow::on_stall_probe),
+        stall_probe_interval_ms, Glib::PRIORITY_HIGH);
+  }
+
+  // Build the first slice right away so that something shows up in this
+  // frame, and the rest when the main loop is idle.
+  if (build_history_slice()) {
+    history_build_ = Glib::signal_idle().connect(
+        sigc::mem_fun(*this, &ChannelWindow::build_history_slice));
+  }
+}
+
+bool ChannelWindow::build_history_slice() {
+  const auto deadline = std::chrono::steady_clock::now() + build_slice_budget;
+  // Keep the rows in the viewport where they are while older ones are
+  // prepended above them.
+  vadjustment_->keep_distance_from_bottom();
+  while (!pending_history_.empty()) {
+    // The next pending message is the one before, so rows are built with or
+    // without a header right away.
+    const bool continuation =
+        pending_history_.size() > 1 &&
+        MessageRow::continues(pending_history_[1], pending_history_.front());
+    prepend_message(pending_history_.front(), continuation);
+    pending_history_.pop_front();
+    ++rows_built_;
+    if (std::chrono::steady_clock::now() >= deadline) {
+      break;
+    }
+  }
+
+  if (pending_history_.empty()) {
+    finish_building_history();
+    return false;
+  } else {
+    return true;
+  }
+}
+
+void ChannelWindow::finish_building_history() {
+  history_loading_ = false;
+  if (!stall_probe_.connected()) {
+    return;
+  }
+  on_stall_probe();
+  stall_probe_.disconnect();
+
+  using std::chrono::duration_cast;
+  using std::chrono::milliseconds;
+  std::cerr << "[channel " << name() << "] built " << rows_built_
+            << " rows in "
+            << duration_cast<milliseconds>(std::chrono::steady_clock::now() -
+                                           build_started_at_)
+                   .count()
+            << " ms, longest main loop stall "
+            << duration_cast<milliseconds>(longest_stall_).count() << " ms"
+            << std::endl;
+}
+
+bool ChannelWindow::on_stall_probe() {
+  const auto now = std::chrono::steady_clock::now();
+  const auto stall = now - last_probe_ -
+                     std::chrono::milliseconds(stall_probe_interval_ms);
+  if (stall > longest_stall_) {
+    longest_stall_ = stall;
+  }
+  last_probe_ = now;
+  return true;
+}
+
 sigc::signal<void, const std::string&> ChannelWindow::channel_link_signal() {
   return channel_link_signal_;
 }
 
+sigc::signal<void, const std::string&> ChannelWindow::notification_signal() {
+  return notification_signal_;
+}
+
 void ChannelWindow::on_channel_link_clicked(const std::string& channel_id) {
   channel_link_signal_.emit(channel_id);
 }
@@ -138,36 +683,199 @@ int ChannelWindow::unread_count() const {
   return unread_count_.get_value();
 }
 
-void ChannelWindow::on_channel_visible() {
-  load_history();
-  const std::uint64_t ts =
-      std::chrono::duration_cast<std::chrono::seconds>(
-          std::chrono::system_clock::now().time_since_epoch())
-          .count();
-  mark_as_read(std::to_string(ts));
+void ChannelWindow::schedule_scroll_update() {
+  if (!scroll_update_.connected()) {
+    scroll_update_ = Glib::signal_idle().connect(
+        sigc::mem_fun(*this, &ChannelWindow::on_scroll_update_idle));
+  }
 }
 
-static void channels_mark_finished(const boost::optional<Json::Value>& result) {
-  if (result) {
-    if (!result.get()["ok"].asBool()) {
-      std::cerr << "[ChannelWindow] channels_mark_finished: failed: "
-                << result.get() << std::endl;
+bool ChannelWindow::on_scroll_update_idle() {
+  if (get_child_visible()) {
+    update_on_screen_rows();
+    update_history_window();
+  }
+  return false;
+}
+
+void ChannelWindow::update_on_screen_rows() {
+  // Rows are allocated in the list box's coordinates, which are scrolled by
+  // the adjustment.
+  const double top = vadjustment_->get_value();
+  const double bottom = top + vadjustment_->get_page_size();
+  Gtk::ListBoxRow* first = messages_list_box_.get_row_at_y(top);
+  if (first == nullptr) {
+    return;
+  }
+  MessageRow* last = nullptr;
+  for (int i = first->get_index();; ++i) {
+    Gtk::ListBoxRow* row = messages_list_box_.get_row_at_index(i);
+    if (row == nullptr || row->get_allocation().get_y() > bottom) {
+      break;
     }
-  } else {
-    std::cerr << "[ChannelWindow] channels_mark_finished: failed" << std::endl;
+    last = static_cast<MessageRow*>(row);
+    last->set_on_screen();
+    shown_rows_.insert(last->ts());
+  }
+
+  // Rows scrolled far away drop their previews.
+  const double page = vadjustment_->get_page_size();
+  for (auto it = shown_rows_.begin(); it != shown_rows_.end();) {
+    MessageRow* row = find_row(*it);
+    if (row == nullptr) {
+      it = shown_rows_.erase(it);
+      continue;
+    }
+    const Gtk::Allocation allocation = row->get_allocation();
+    if (allocation.get_y() + allocation.get_height() <
+            top - page * keep_distance ||
+        allocation.get_y() > bottom + page * keep_distance) {
+      row->set_off_screen();
+      it = shown_rows_.erase(it);
+    } else {
+      row->update_on_screen_replies(top - allocation.get_y(),
+                                    bottom - allocation.get_y(),
+                                    page * keep_distance);
+      ++it;
+    }
+  }
+
+  // Only what the user can actually see counts as read.
+  const Gtk::Window* window = dynamic_cast<Gtk::Window*>(get_toplevel());
+  if (last != nullptr && window != nullptr && window->is_active()) {
+    team_.read_marker_manager_->mark(id(), last->ts());
   }
 }
 
-void ChannelWindow::mark_as_read(const std::string& ts) {
-  std::map<std::string, std::string> params;
-  params["channel"] = id();
-  params["ts"] = ts;
-  team_.api_client_->queue_post("channels.mark", params,
-                                channels_mark_finished);
+void ChannelWindow::update_history_window() {
+  if (!history_loaded_) {
+    return;
+  }
+  const double top = vadjustment_->get_value();
+  const double page = vadjustment_->get_page_size();
+  const double bottom = top + page;
+
+  if (top < page * prefetch_distance) {
+    load_history();
+  }
+  if (!unloaded_newer_messages_.empty() &&
+      vadjustment_->get_upper() - bottom < page * prefetch_distance) {
+    restore_newer_rows();
+  }
+
+  if (pending_history_.empty()) {
+    unload_newer_rows();
+    unload_older_rows();
+  }
+}
+
+void ChannelWindow::restore_newer_rows() {
+  vadjustment_->keep_value();
+  for (int i = 0; i < history_page_size && !unloaded_newer_messages_.empty();
+       ++i) {
+    append_message(unloaded_newer_messages_.front());
+    unloaded_newer_messages_.pop_front();
+  }
+}
+
+void ChannelWindow::unload_newer_rows() {
+  std::vector<Gtk::Widget*> rows = messages_list_box_.get_children();
+  const double limit = vadjustment_->get_value() +
+                       vadjustment_->get_page_size() * (1 + keep_distance);
+
+  bool unloaded = false;
+  while (rows.size() > max_rendered_rows) {
+    MessageRow* row = static_cast<MessageRow*>(rows.back());
+    if (row->get_allocation().get_y() < limit) {
+      break;
+    }
+    if (!unloaded) {
+      vadjustment_->keep_value();
+      unloaded = true;
+    }
+    unloaded_newer_messages_.push_front(row->payload());
+    rows_by_ts_[row->ts()] = nullptr;
+    messages_list_box_.remove(*row);
+    delete row;
+    rows.pop_back();
+  }
+}
+
+void ChannelWindow::unload_older_rows() {
+  std::vector<Gtk::Widget*> rows = messages_list_box_.get_children();
+  const double limit = vadjustment_->get_value() -
+                       vadjustment_->get_page_size() * keep_distance;
+
+  std::size_t count = 0;
+  while (rows.size() - count > max_rendered_rows) {
+    MessageRow* row = static_cast<MessageRow*>(rows[count]);
+    const Gtk::Allocation allocation = row->get_allocation();
+    if (allocation.get_y() + allocation.get_height() > limit) {
+      break;
+    }
+    if (count == 0) {
+      vadjustment_->keep_distance_from_bottom();
+    }
+    rows_by_ts_.erase(row->ts());
+    messages_list_box_.remove(*row);
+    delete row;
+    ++count;
+  }
+  if (count != 0) {
+    // They can be loaded again from channels.history.
+    has_more_history_ = true;
+    update_continuation(0);
+  }
+}
+
+void ChannelWindow::on_channel_visible() {
+  if (prefetched_history_) {
+    const boost::optional<Json::Value> result = prefetched_history_;
+    prefetched_history_ = boost::none;
+    prefetched_bytes_ = 0;
+    history_loading_ = true;
+    on_channels_history(result);
+  } else if (!history_loaded_) {
+    load_history();
+  }
+  if (messages_stale_) {
+    redraw_messages();
+  } else if (images_stale_) {
+    rescale_images();
+  }
+  schedule_scroll_update();
 }
 
 void ChannelWindow::redraw_messages() {
+  messages_stale_ = false;
   for (Widget* widget : messages_list_box_.get_children()) {
     static_cast<MessageRow*>(widget)->redraw_message();
   }
+  // Redrawing doesn't reload user icons.
+  if (images_stale_) {
+    rescale_images();
+  }
+}
+
+void ChannelWindow::rescale_images() {
+  images_stale_ = false;
+  for (Widget* widget : messages_list_box_.get_children()) {
+    static_cast<MessageRow*>(widget)->rescale_images();
+  }
+}
+
+void ChannelWindow::invalidate_messages() {
+  if (get_child_visible()) {
+    redraw_messages();
+  } else {
+    messages_stale_ = true;
+  }
+}
+
+void ChannelWindow::invalidate_images() {
+  if (get_child_visible()) {
+    rescale_images();
+  } else {
+    images_stale_ = true;
+  }
 }
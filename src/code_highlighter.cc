@@ -0,0 +1,250 @@
+#include "code_highlighter.h"
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+// Number of highlighted blocks kept
+static const std::size_t max_cache_entries = 512;
+
+enum language_type {
+  LANGUAGE_NONE,
+  LANGUAGE_CPP,
+  LANGUAGE_PYTHON,
+  LANGUAGE_SHELL,
+  LANGUAGE_JSON,
+  LANGUAGE_DIFF,
+};
+
+// Describes a language for lex_generic().
+struct language_syntax {
+  // Null-terminated
+  const char* const* keywords;
+  const char* line_comment;
+  bool block_comments;
+  const char* quotes;
+};
+
+static const char* const cpp_keywords[] = {
+    "auto", "bool", "break", "case", "catch", "char", "class", "const",
+    "constexpr", "continue", "default", "delete", "do", "double", "else",
+    "enum", "explicit", "false", "float", "for", "friend", "if", "inline",
+    "int", "long", "namespace", "new", "nullptr", "operator", "override",
+    "private", "protected", "public", "return", "short", "signed", "sizeof",
+    "static", "struct", "switch", "template", "this", "throw", "true", "try",
+    "typedef", "typename", "union", "unsigned", "using", "virtual", "void",
+    "volatile", "while", nullptr};
+static const char* const python_keywords[] = {
+    "False", "None", "True", "and", "as", "assert", "async", "await", "break",
+    "class", "continue", "def", "del", "elif", "else", "except", "finally",
+    "for", "from", "global", "if", "import", "in", "is", "lambda", "nonlocal",
+    "not", "or", "pass", "raise", "return", "self", "try", "while", "with",
+    "yield", nullptr};
+static const char* const shell_keywords[] = {
+    "case", "do", "done", "echo", "elif", "else", "esac", "exit", "export",
+    "fi", "for", "function", "if", "in", "local", "return", "then", "until",
+    "while", nullptr};
+static const char* const json_keywords[] = {"false", "null", "true", nullptr};
+
+static const language_syntax cpp_syntax = {cpp_keywords, "//", true,
+                                           "\"'"};
+static const language_syntax python_syntax = {python_keywords, "#", false,
+                                              "\"'"};
+static const language_syntax shell_syntax = {shell_keywords, "#", false,
+                                             "\"'"};
+static const language_syntax json_syntax = {json_keywords, nullptr, false,
+                                            "\""};
+
+static bool starts_with(const std::string& text, std::size_t pos,
+                        const char* prefix) {
+  return text.compare(pos, std::strlen(prefix), prefix) == 0;
+}
+
+static bool has_line_starting_with(const std::string& code,
+                                   const char* prefix) {
+  for (std::size_t pos = 0; pos != std::string::npos;) {
+    if (starts_with(code, pos, prefix)) {
+      return true;
+    }
+    pos = code.find('\n', pos);
+    if (pos != std::string::npos) {
+      ++pos;
+    }
+  }
+  return false;
+}
+
+static language_type detect_language(const std::string& code) {
+  if (starts_with(code, 0, "diff ") || has_line_starting_with(code, "@@ ") ||
+      (has_line_starting_with(code, "--- ") &&
+       has_line_starting_with(code, "+++ "))) {
+    return LANGUAGE_DIFF;
+  }
+  const std::size_t first = code.find_first_not_of(" \t\n");
+  const std::size_t last = code.find_last_not_of(" \t\n");
+  if (first != std::string::npos &&
+      ((code[first] == '{' && code[last] == '}') ||
+       (code[first] == '[' && code[last] == ']'))) {
+    return LANGUAGE_JSON;
+  }
+  if (starts_with(code, 0, "#!")) {
+    const std::string shebang = code.substr(0, code.find('\n'));
+    return shebang.find("python") != std::string::npos ? LANGUAGE_PYTHON
+                                                        : LANGUAGE_SHELL;
+  }
+  if (has_line_starting_with(code, "#include") ||
+      code.find("std::") != std::string::npos ||
+      code.find("nullptr") != std::string::npos) {
+    return LANGUAGE_CPP;
+  }
+  if (has_line_starting_with(code, "def ") ||
+      has_line_starting_with(code, "import ") ||
+      has_line_starting_with(code, "from ") ||
+      code.find("self.") != std::string::npos) {
+    return LANGUAGE_PYTHON;
+  }
+  if (has_line_starting_with(code, "$ ") ||
+      code.find("\nfi\n") != std::string::npos ||
+      code.find("; then") != std::string::npos) {
+    return LANGUAGE_SHELL;
+  }
+  return LANGUAGE_NONE;
+}
+
+static bool is_identifier_char(char c) {
+  return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+}
+
+static void add_token(std::vector<code_highlighter::token>& tokens,
+                      std::size_t start, std::size_t end,
+                      rich_text::style_type style) {
+  code_highlighter::token token;
+  token.start = start;
+  token.end = end;
+  token.style = style;
+  tokens.push_back(token);
+}
+
+static bool is_keyword(const language_syntax& syntax, const std::string& code,
+                       std::size_t start, std::size_t end) {
+  for (const char* const* k = syntax.keywords; *k != nullptr; ++k) {
+    if (std::strlen(*k) == end - start &&
+        code.compare(start, end - start, *k) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Handles C-like languages: comments, strings, numbers and keywords.
+static void lex_generic(const language_syntax& syntax, const std::string& code,
+                        std::vector<code_highlighter::token>& tokens) {
+  std::size_t i = 0;
+  while (i < code.size()) {
+    const char c = code[i];
+    if (syntax.line_comment != nullptr &&
+        starts_with(code, i, syntax.line_comment) &&
+        // "#" starts a shell comment only at the start of a word
+        (c != '#' || i == 0 ||
+         std::isspace(static_cast<unsigned char>(code[i - 1])))) {
+      std::size_t end = code.find('\n', i);
+      end = end == std::string::npos ? code.size() : end;
+      add_token(tokens, i, end, rich_text::STYLE_CODE_COMMENT);
+      i = end;
+    } else if (syntax.block_comments && starts_with(code, i, "/*")) {
+      std::size_t end = code.find("*/", i + 2);
+      end = end == std::string::npos ? code.size() : end + 2;
+      add_token(tokens, i, end, rich_text::STYLE_CODE_COMMENT);
+      i = end;
+    } else if (std::strchr(syntax.quotes, c) != nullptr && c != '\0') {
+      std::size_t end = i + 1;
+      while (end < code.size() && code[end] != c && code[end] != '\n') {
+        end += code[end] == '\\' ? 2 : 1;
+      }
+      end = std::min(end + 1, code.size());
+      add_token(tokens, i, end, rich_text::STYLE_CODE_STRING);
+      i = end;
+    } else if (std::isdigit(static_cast<unsigned char>(c)) ||
+               // Negative numbers, as in JSON
+               (c == '-' && i + 1 < code.size() &&
+                std::isdigit(static_cast<unsigned char>(code[i + 1])) &&
+                (i == 0 || !is_identifier_char(code[i - 1])))) {
+      std::size_t end = i + 1;
+      while (end < code.size() &&
+             (is_identifier_char(code[end]) || code[end] == '.')) {
+        ++end;
+      }
+      add_token(tokens, i, end, rich_text::STYLE_CODE_NUMBER);
+      i = end;
+    } else if (is_identifier_char(c)) {
+      std::size_t end = i + 1;
+      while (end < code.size() && is_identifier_char(code[end])) {
+        ++end;
+      }
+      if (is_keyword(syntax, code, i, end)) {
+        add_token(tokens, i, end, rich_text::STYLE_CODE_KEYWORD);
+      }
+      i = end;
+    } else {
+      ++i;
+    }
+  }
+}
+
+static void lex_diff(const std::string& code,
+                     std::vector<code_highlighter::token>& tokens) {
+  for (std::size_t start = 0; start < code.size();) {
+    std::size_t end = code.find('\n', start);
+    end = end == std::string::npos ? code.size() : end;
+    if (starts_with(code, start, "+++") || starts_with(code, start, "---") ||
+        starts_with(code, start, "diff ") || starts_with(code, start, "@@")) {
+      add_token(tokens, start, end, rich_text::STYLE_DIFF_HEADER);
+    } else if (code[start] == '+') {
+      add_token(tokens, start, end, rich_text::STYLE_DIFF_ADDED);
+    } else if (code[start] == '-') {
+      add_token(tokens, start, end, rich_text::STYLE_DIFF_REMOVED);
+    }
+    start = end + 1;
+  }
+}
+
+code_highlighter::code_highlighter() : cache_(), lru_() {
+}
+
+const std::vector<code_highlighter::token>& code_highlighter::highlight(
+    const std::string& code) {
+  auto it = cache_.find(code);
+  if (it != cache_.end()) {
+    lru_.splice(lru_.begin(), lru_, it->second.lru_position);
+    return it->second.tokens;
+  }
+
+  if (cache_.size() >= max_cache_entries) {
+    cache_.erase(*lru_.back());
+    lru_.pop_back();
+  }
+  it = cache_.emplace(code, cache_entry()).first;
+  lru_.push_front(&it->first);
+  cache_entry& entry = it->second;
+  entry.lru_position = lru_.begin();
+
+  switch (detect_language(code)) {
+    case LANGUAGE_CPP:
+      lex_generic(cpp_syntax, code, entry.tokens);
+      break;
+    case LANGUAGE_PYTHON:
+      lex_generic(python_syntax, code, entry.tokens);
+      break;
+    case LANGUAGE_SHELL:
+      lex_generic(shell_syntax, code, entry.tokens);
+      break;
+    case LANGUAGE_JSON:
+      lex_generic(json_syntax, code, entry.tokens);
+      break;
+    case LANGUAGE_DIFF:
+      lex_diff(code, entry.tokens);
+      break;
+    case LANGUAGE_NONE:
+      break;
+  }
+  return entry.tokens;
+}
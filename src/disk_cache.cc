@@ -0,0 +1,442 @@
+#include "disk_cache.h"
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <glibmm/miscutils.h>
+#include <json/json.h>
+#include <algorithm>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <vector>
+
+// Access times are persisted as file mtimes, but only with this granularity
+// so that cache hits rarely cost a syscall.
+static const std::int64_t touch_interval = 60 * 60;
+static const char metadata_suffix[] = ".meta";
+static const char partial_suffix[] = ".part";
+// Partial downloads not resumed for this long are removed on startup.
+static const std::int64_t partial_lifetime = 24 * 60 * 60;
+// Workers may be writing entries while the cache is scanned, so temporary
+// and orphaned files are only removed once they are clearly abandoned.
+static const std::int64_t abandoned_file_age = 60 * 60;
+
+static std::int64_t now_in_seconds() {
+  return g_get_real_time() / G_USEC_PER_SEC;
+}
+
+// Removes the file at path if it hasn't been modified for age seconds.
+static void unlink_if_older(const std::string& path, std::int64_t age) {
+  GStatBuf st;
+  if (g_stat(path.c_str(), &st) == 0 && now_in_seconds() - st.st_mtime > age) {
+    g_unlink(path.c_str());
+  }
+}
+
+disk_cache::metadata_type::metadata_type()
+    : etag(), last_modified(), expires(0) {
+}
+
+bool disk_cache::metadata_type::is_stale() const {
+  return expires <= now_in_seconds();
+}
+
+disk_cache::disk_cache(const std::string& directory, std::uint64_t max_bytes)
+    : directory_(directory),
+      mutex_(),
+      lru_(),
+      index_(),
+      total_bytes_(0),
+      max_bytes_(max_bytes),
+      scanned_(false),
+      stopping_(false),
+      scan_thread_() {
+  if (g_mkdir_with_parents(directory_.c_str(), 0700) != 0) {
+    std::cerr << "[disk_cache] cannot create " << directory_ << std::endl;
+  }
+  scan_thread_ = std::thread(&disk_cache::scan, this);
+}
+
+disk_cache::~disk_cache() {
+  stopping_ = true;
+  scan_thread_.join();
+}
+
+std::string disk_cache::default_directory() {
+  return Glib::build_filename(Glib::get_user_cache_dir(), "slack-gtk",
+                              "images");
+}
+
+std::string disk_cache::hash_of(const std::string& key) const {
+  gchar* hash = g_compute_checksum_for_string(G_CHECKSUM_SHA1, key.c_str(),
+                                              key.size());
+  const std::string ret(hash);
+  g_free(hash);
+  return ret;
+}
+
+std::string disk_cache::path_of(const std::string& hash) const {
+  return Glib::build_filename(directory_, hash.substr(0, 2), hash);
+}
+
+std::string disk_cache::metadata_path_of(const std::string& hash) const {
+  return path_of(hash) + metadata_suffix;
+}
+
+std::uint64_t disk_cache::read_metadata(const std::string& path,
+                                        metadata_type& metadata) {
+  gchar* contents = nullptr;
+  gsize length = 0;
+  if (!g_file_get_contents(path.c_str(), &contents, &length, nullptr)) {
+    return 0;
+  }
+  Json::Reader reader;
+  Json::Value root;
+  if (reader.parse(contents, contents + length, root) && root.isObject()) {
+    metadata.etag = root["etag"].asString();
+    metadata.last_modified = root["last_modified"].asString();
+    metadata.expires = root["expires"].asInt64();
+  }
+  g_free(contents);
+  return length;
+}
+
+std::string disk_cache::serialize_metadata(const metadata_type& metadata) {
+  Json::Value root(Json::objectValue);
+  root["etag"] = metadata.etag;
+  root["last_modified"] = metadata.last_modified;
+  root["expires"] = Json::Int64(metadata.expires);
+  Json::FastWriter writer;
+  return writer.write(root);
+}
+
+std::string disk_cache::lookup(const std::string& key,
+                               metadata_type* metadata) {
+  const std::string hash = hash_of(key);
+  const std::string path = path_of(hash);
+  const std::int64_t now = now_in_seconds();
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = index_.find(hash);
+  if (it == index_.end()) {
+    if (scanned_) {
+      return std::string();
+    }
+    // The index isn't complete yet; ask the file system directly.
+    GStatBuf st;
+    if (g_stat(path.c_str(), &st) != 0) {
+      return std::string();
+    }
+    entry e;
+    e.hash = hash;
+    e.size = st.st_size + read_metadata(metadata_path_of(hash), e.metadata);
+    e.last_access = now;
+    insert_locked(e, true);
+    it = index_.find(hash);
+  } else {
+    lru_.splice(lru_.begin(), lru_, it->second);
+  }
+
+  entry& e = *it->second;
+  if (now - e.last_access >= touch_interval) {
+    e.last_access = now;
+    g_utime(path.c_str(), nullptr);
+  }
+  if (metadata != nullptr) {
+    *metadata = e.metadata;
+  }
+  return path;
+}
+
+bool disk_cache::store(const std::string& key, const char* data,
+                       std::size_t size, const metadata_type& metadata) {
+  const std::string hash = hash_of(key);
+  const std::string path = path_of(hash);
+  const std::string shard = Glib::path_get_dirname(path);
+  const std::string serialized = serialize_metadata(metadata);
+
+  GError* error = nullptr;
+  if (g_mkdir_with_parents(shard.c_str(), 0700) != 0) {
+    std::cerr << "[disk_cache] cannot create " << shard << std::endl;
+    return false;
+  }
+  // g_file_set_contents writes to a temporary file and renames it, so
+  // readers never see a partially written entry.
+  if (!g_file_set_contents(path.c_str(), data, size, &error) ||
+      !g_file_set_contents(metadata_path_of(hash).c_str(), serialized.c_str(),
+                           serialized.size(), &error)) {
+    std::cerr << "[disk_cache] cannot write " << path << ": "
+              << error->message << std::endl;
+    g_error_free(error);
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = index_.find(hash);
+  if (it != index_.end()) {
+    total_bytes_ -= it->second->size;
+    lru_.erase(it->second);
+    index_.erase(it);
+  }
+  entry e;
+  e.hash = hash;
+  e.size = size + serialized.size();
+  e.last_access = now_in_seconds();
+  e.metadata = metadata;
+  insert_locked(e, true);
+  prune_locked(max_bytes_);
+  return true;
+}
+
+bool disk_cache::update_metadata(const std::string& key,
+                                 const metadata_type& metadata) {
+  const std::string hash = hash_of(key);
+  const std::string serialized = serialize_metadata(metadata);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = index_.find(hash);
+    if (it == index_.end()) {
+      return false;
+    }
+    entry& e = *it->second;
+    e.metadata = metadata;
+  }
+
+  GError* error = nullptr;
+  if (!g_file_set_contents(metadata_path_of(hash).c_str(), serialized.c_str(),
+                           serialized.size(), &error)) {
+    std::cerr << "[disk_cache] cannot write metadata for " << key << ": "
+              << error->message << std::endl;
+    g_error_free(error);
+    return false;
+  }
+  return true;
+}
+
+void disk_cache::remove(const std::string& key) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = index_.find(hash_of(key));
+  if (it != index_.end()) {
+    remove_locked(it->second);
+  }
+}
+
+std::string disk_cache::partial_path_of(const std::string& key) const {
+  const std::string path = path_of(hash_of(key));
+  const std::string shard = Glib::path_get_dirname(path);
+  if (g_mkdir_with_parents(shard.c_str(), 0700) != 0) {
+    std::cerr << "[disk_cache] cannot create " << shard << std::endl;
+  }
+  return path + partial_suffix;
+}
+
+bool disk_cache::commit_partial(const std::string& key,
+                                const metadata_type& metadata) {
+  const std::string hash = hash_of(key);
+  const std::string path = path_of(hash);
+  const std::string partial_path = path + partial_suffix;
+  const std::string serialized = serialize_metadata(metadata);
+
+  GStatBuf st;
+  GError* error = nullptr;
+  if (g_stat(partial_path.c_str(), &st) != 0 ||
+      g_rename(partial_path.c_str(), path.c_str()) != 0) {
+    std::cerr << "[disk_cache] cannot commit " << partial_path << std::endl;
+    return false;
+  }
+  g_unlink((partial_path + metadata_suffix).c_str());
+  if (!g_file_set_contents(metadata_path_of(hash).c_str(), serialized.c_str(),
+                           serialized.size(), &error)) {
+    std::cerr << "[disk_cache] cannot write metadata for " << key << ": "
+              << error->message << std::endl;
+    g_error_free(error);
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = index_.find(hash);
+  if (it != index_.end()) {
+    total_bytes_ -= it->second->size;
+    lru_.erase(it->second);
+    index_.erase(it);
+  }
+  entry e;
+  e.hash = hash;
+  e.size = st.st_size + serialized.size();
+  e.last_access = now_in_seconds();
+  e.metadata = metadata;
+  insert_locked(e, true);
+  prune_locked(max_bytes_);
+  return true;
+}
+
+bool disk_cache::store_partial_metadata(const std::string& key,
+                                        const metadata_type& metadata) {
+  const std::string path = partial_path_of(key) + metadata_suffix;
+  const std::string serialized = serialize_metadata(metadata);
+  GError* error = nullptr;
+  if (!g_file_set_contents(path.c_str(), serialized.c_str(),
+                           serialized.size(), &error)) {
+    std::cerr << "[disk_cache] cannot write metadata for " << key << ": "
+              << error->message << std::endl;
+    g_error_free(error);
+    return false;
+  }
+  return true;
+}
+
+bool disk_cache::lookup_partial_metadata(const std::string& key,
+                                         metadata_type& metadata) const {
+  const std::string path =
+      path_of(hash_of(key)) + partial_suffix + metadata_suffix;
+  return read_metadata(path, metadata) > 0;
+}
+
+disk_cache::stats_type disk_cache::stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  stats_type s;
+  s.entries = index_.size();
+  s.bytes = total_bytes_;
+  s.max_bytes = max_bytes_;
+  return s;
+}
+
+void disk_cache::set_max_bytes(std::uint64_t max_bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  max_bytes_ = max_bytes;
+  prune_locked(max_bytes_);
+}
+
+void disk_cache::prune(std::uint64_t target_bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  prune_locked(target_bytes);
+}
+
+void disk_cache::prune() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  prune_locked(max_bytes_);
+}
+
+void disk_cache::insert_locked(const entry& e, bool most_recent) {
+  if (index_.find(e.hash) != index_.end()) {
+    return;
+  }
+  const lru_type::iterator it =
+      lru_.insert(most_recent ? lru_.begin() : lru_.end(), e);
+  index_.emplace(std::make_pair(e.hash, it));
+  total_bytes_ += e.size;
+}
+
+void disk_cache::remove_locked(lru_type::iterator it) {
+  g_unlink(path_of(it->hash).c_str());
+  g_unlink(metadata_path_of(it->hash).c_str());
+  total_bytes_ -= it->size;
+  index_.erase(it->hash);
+  lru_.erase(it);
+}
+
+void disk_cache::prune_locked(std::uint64_t target_bytes) {
+  // Keep the most recently used entry; it has probably just been stored.
+  while (total_bytes_ > target_bytes && lru_.size() > 1) {
+    remove_locked(std::prev(lru_.end()));
+  }
+}
+
+static bool is_hash_name(const std::string& name) {
+  return name.size() == 40 &&
+         std::all_of(name.begin(), name.end(),
+                     [](char c) { return g_ascii_isxdigit(c); });
+}
+
+static bool is_metadata_name(const std::string& name) {
+  return name.size() == 40 + sizeof(metadata_suffix) - 1 &&
+         is_hash_name(name.substr(0, 40)) &&
+         name.compare(40, std::string::npos, metadata_suffix) == 0;
+}
+
+// Partial files and their validators
+static bool is_partial_name(const std::string& name) {
+  const std::string partial_metadata_suffix =
+      std::string(partial_suffix) + metadata_suffix;
+  return name.size() > 40 && is_hash_name(name.substr(0, 40)) &&
+         (name.compare(40, std::string::npos, partial_suffix) == 0 ||
+          name.compare(40, std::string::npos, partial_metadata_suffix) == 0);
+}
+
+// Runs on scan_thread_ and builds the index from the files on disk.
+void disk_cache::scan() {
+  std::map<std::string, entry> found;
+  std::vector<std::string> metadata_paths;
+
+  GDir* root = g_dir_open(directory_.c_str(), 0, nullptr);
+  if (root == nullptr) {
+    scanned_ = true;
+    return;
+  }
+  const gchar* shard_name;
+  while (!stopping_ && (shard_name = g_dir_read_name(root)) != nullptr) {
+    const std::string shard = Glib::build_filename(directory_, shard_name);
+    GDir* dir = g_dir_open(shard.c_str(), 0, nullptr);
+    if (dir == nullptr) {
+      continue;
+    }
+    const gchar* file_name;
+    while (!stopping_ && (file_name = g_dir_read_name(dir)) != nullptr) {
+      const std::string name(file_name);
+      const std::string path = Glib::build_filename(shard, name);
+      if (is_metadata_name(name)) {
+        metadata_paths.push_back(path);
+        continue;
+      }
+      if (is_partial_name(name)) {
+        unlink_if_older(path, partial_lifetime);
+        continue;
+      }
+      if (!is_hash_name(name)) {
+        // Temporary file of g_file_set_contents, left over by an interrupted
+        // write unless store() is writing it right now
+        unlink_if_older(path, abandoned_file_age);
+        continue;
+      }
+      GStatBuf st;
+      if (g_stat(path.c_str(), &st) == 0) {
+        entry& e = found[name];
+        e.hash = name;
+        e.size = st.st_size;
+        e.last_access = st.st_mtime;
+      }
+    }
+    g_dir_close(dir);
+  }
+  g_dir_close(root);
+
+  for (const std::string& path : metadata_paths) {
+    if (stopping_) {
+      break;
+    }
+    const std::string hash = Glib::path_get_basename(path).substr(0, 40);
+    auto it = found.find(hash);
+    if (it == found.end()) {
+      // Orphaned metadata, unless its entry was stored after the shard
+      // was listed
+      unlink_if_older(path, abandoned_file_age);
+    } else {
+      it->second.size += read_metadata(path, it->second.metadata);
+    }
+  }
+
+  std::vector<entry> entries;
+  entries.reserve(found.size());
+  for (const auto& p : found) {
+    entries.push_back(p.second);
+  }
+  std::sort(entries.begin(), entries.end(), [](const entry& a, const entry& b) {
+    return a.last_access > b.last_access;
+  });
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  // Entries found by lookup() during the scan are already at the front.
+  for (const entry& e : entries) {
+    insert_locked(e, false);
+  }
+  scanned_ = true;
+  prune_locked(max_bytes_);
+}
@@ -1,17 +1,88 @@
 #include "emoji_loader.h"
-#include <giomm/file.h>
-#include <glibmm/fileutils.h>
-#include <glibmm/miscutils.h>
 #include <json/json.h>
-#include <libsoup/soup-uri.h>
 #include <fstream>
 #include <iostream>
+#include "disk_cache.h"
+#include "http_cache_validation.h"
 
-emoji_loader::emoji_loader(const std::string& directory)
+// emoji.list can return thousands of custom emojis. Don't let them flood
+// libsoup's queue so that prioritized ones can overtake.
+static const std::size_t max_loads_in_flight = 4;
+
+// Jobs run on a GTask worker thread, so they must only touch the job itself,
+// the thread-safe disk_cache and plain GLib/GdkPixbuf objects.
+struct emoji_loader::cache_job {
+  enum mode_type {
+    // Look up the entries of custom emojis
+    LOOKUP,
+    // Decode an entry at size x size
+    DECODE,
+    // Store a downloaded body
+    STORE,
+    // Update the validators of an entry after 304 Not Modified
+    REFRESH,
+  };
+  struct lookup_entry {
+    std::string name;
+    std::string url;
+    // Results
+    bool cached;
+    disk_cache::metadata_type metadata;
+  };
+
+  emoji_loader* loader;
+  // false once the loader is destroyed
+  std::shared_ptr<bool> alive;
+  mode_type mode;
+  std::shared_ptr<disk_cache> cache;
+  std::vector<lookup_entry> entries;
+  std::string name;
+  std::string url;
+  int size;
+  bool prioritized;
+  GBytes* data;
+  disk_cache::metadata_type metadata;
+
+  // Results
+  bool cached;
+  GdkPixbuf* pixbuf;
+  std::string error;
+
+  cache_job(emoji_loader* l, std::shared_ptr<bool> a, mode_type m,
+            std::shared_ptr<disk_cache> c)
+      : loader(l),
+        alive(a),
+        mode(m),
+        cache(c),
+        entries(),
+        name(),
+        url(),
+        size(0),
+        prioritized(false),
+        data(nullptr),
+        metadata(),
+        cached(false),
+        pixbuf(nullptr),
+        error() {
+  }
+
+  ~cache_job() {
+    if (data != nullptr) {
+      g_bytes_unref(data);
+    }
+    if (pixbuf != nullptr) {
+      g_object_unref(pixbuf);
+    }
+  }
+};
+
+emoji_loader::emoji_loader(const std::string& directory,
+                           std::shared_ptr<disk_cache> cache)
     : session_(soup_session_new()),
       directory_(directory),
-      // TODO: Use proper directory
-      custom_directory_("custom-emojis") {
+      cache_(cache),
+      loads_in_flight_(0),
+      alive_(std::make_shared<bool>(true)) {
   std::ifstream ifs;
   const std::string path = directory_ + "/emoji.json";
   ifs.open(directory + "/" + "emoji.json");
@@ -38,9 +109,11 @@ emoji_loader::emoji_loader(const std::string& directory)
   }
 }
 
-static std::string build_cache_path(const std::string& base, std::string url) {
-  std::replace(url.begin(), url.end(), '/', '_');
-  return Glib::build_filename(base, url);
+emoji_loader::~emoji_loader() {
+  *alive_ = false;
+  for (const auto& p : queued_) {
+    delete p.second;
+  }
 }
 
 std::string emoji_loader::resolve_alias(const std::string& name) const {
@@ -52,47 +125,92 @@ std::string emoji_loader::resolve_alias(const std::string& name) const {
   }
 }
 
-Glib::RefPtr<Gdk::Pixbuf> emoji_loader::find(const std::string& name) const {
-  const std::string key = resolve_alias(name);
-  auto it = dict_.find(key);
+Glib::RefPtr<Gdk::Pixbuf> emoji_loader::load_builtin(
+    const std::string& name) const {
+  auto it = dict_.find(name);
   if (it == dict_.end()) {
-    auto jt = custom_emojis_.find(key);
-    if (jt == custom_emojis_.end()) {
+    return Glib::RefPtr<Gdk::Pixbuf>();
+  }
+  const std::string path = directory_ + "/img-google-64/" + it->second.image;
+  try {
+    return Gdk::Pixbuf::create_from_file(path);
+  } catch (const Glib::FileError& e) {
+    if (e.code() == Glib::FileError::NO_SUCH_ENTITY) {
       return Glib::RefPtr<Gdk::Pixbuf>();
     } else {
-      const std::string path = build_cache_path(custom_directory_, jt->second);
-      try {
-        return Gdk::Pixbuf::create_from_file(path);
-      } catch (const Gdk::PixbufError& e) {
-        std::cerr << "[emoji_loader] cannot load custom emoji from " << path
-                  << " (" << e.code() << ") " << e.what() << std::endl;
-        return Glib::RefPtr<Gdk::Pixbuf>();
-      }
+      throw e;
     }
-  } else {
-    const std::string path = directory_ + "/img-google-64/" + it->second.image;
-    try {
-      return Gdk::Pixbuf::create_from_file(path);
-    } catch (const Glib::FileError& e) {
-      if (e.code() == Glib::FileError::NO_SUCH_ENTITY) {
-        return Glib::RefPtr<Gdk::Pixbuf>();
-      } else {
-        throw e;
-      }
-    } catch (const Gdk::PixbufError& e) {
-      std::cerr << "[emoji_loader] cannot load emoji from " << path << " ("
-                << e.code() << ") " << e.what() << std::endl;
-      return Glib::RefPtr<Gdk::Pixbuf>();
+  } catch (const Gdk::PixbufError& e) {
+    std::cerr << "[emoji_loader] cannot load emoji from " << path << " ("
+              << e.code() << ") " << e.what() << std::endl;
+    return Glib::RefPtr<Gdk::Pixbuf>();
+  }
+}
+
+Glib::RefPtr<Gdk::Pixbuf> emoji_loader::find(const std::string& name,
+                                             int size) {
+  const auto key = std::make_pair(resolve_alias(name), size);
+  auto it = scaled_.find(key);
+  if (it != scaled_.end()) {
+    return it->second;
+  }
+  if (dict_.find(key.first) == dict_.end()) {
+    auto jt = custom_emojis_.find(key.first);
+    if (jt != custom_emojis_.end() && decoding_.insert(key).second) {
+      cache_job* job = new cache_job(this, alive_, cache_job::DECODE, cache_);
+      job->name = key.first;
+      job->url = jt->second;
+      job->size = size;
+      start_job(job);
     }
+    // A custom emoji may become available later.
+    return Glib::RefPtr<Gdk::Pixbuf>();
+  }
+  Glib::RefPtr<Gdk::Pixbuf> pixbuf = load_builtin(key.first);
+  if (!pixbuf) {
+    return pixbuf;
   }
+  pixbuf = pixbuf->scale_simple(size, size, Gdk::INTERP_BILINEAR);
+  scaled_.emplace(std::make_pair(key, pixbuf));
+  return pixbuf;
+}
+
+void emoji_loader::forget_scaled(const std::string& name) {
+  auto it = scaled_.lower_bound(std::make_pair(name, 0));
+  while (it != scaled_.end() && it->first.first == name) {
+    it = scaled_.erase(it);
+  }
+}
+
+void emoji_loader::clear_scaled() {
+  scaled_.clear();
 }
 
 void emoji_loader::add_custom_emoji(const std::string& name,
                                     const std::string& url) {
-  if (url.compare(0, 6, "alias:") == 0) {
-    aliases_.emplace(std::make_pair(name, url.substr(6)));
+  std::map<std::string, std::string> emojis;
+  emojis[name] = url;
+  add_custom_emojis(emojis);
+}
+
+void emoji_loader::add_custom_emojis(
+    const std::map<std::string, std::string>& emojis) {
+  cache_job* job = new cache_job(this, alive_, cache_job::LOOKUP, cache_);
+  for (const auto& p : emojis) {
+    if (p.second.compare(0, 6, "alias:") == 0) {
+      aliases_[p.first] = p.second.substr(6);
+    } else {
+      // Replaces any lookup of an older URL.
+      lookups_[p.first] = p.second;
+      const cache_job::lookup_entry entry = {p.first, p.second, false,
+                                             disk_cache::metadata_type()};
+      job->entries.push_back(entry);
+    }
+  }
+  if (job->entries.empty()) {
+    delete job;
   } else {
-    cache_emoji(name, url);
+    start_job(job);
   }
 }
 
@@ -100,64 +218,268 @@ void emoji_loader::remove_custom_emoji(const std::string& name) {
   auto it = aliases_.find(name);
   if (it == aliases_.end()) {
     auto jt = custom_emojis_.find(name);
-    if (jt == custom_emojis_.end()) {
+    const bool looked_up = lookups_.erase(name) != 0;
+    prioritized_lookups_.erase(name);
+    if (jt != custom_emojis_.end()) {
+      custom_emojis_.erase(jt);
+    } else if (!looked_up) {
       std::cerr
           << "[emoji_loader] Unknown custom emoji is requested to remove: "
           << name << std::endl;
-    } else {
-      custom_emojis_.erase(jt);
+    }
+    forget_scaled(name);
+    auto kt = queued_.find(name);
+    if (kt != queued_.end()) {
+      delete kt->second;
+      queued_.erase(kt);
     }
   } else {
     aliases_.erase(it);
   }
 }
 
-static void ensure_directory(const std::string& path) try {
-  Gio::File::create_for_path(path)->make_directory_with_parents();
-} catch (Gio::Error& e) {
-  if (e.code() != Gio::Error::EXISTS) {
-    throw e;
+void emoji_loader::cache_emoji(const std::string& name, const std::string& url,
+                               bool cached,
+                               const disk_cache::metadata_type& metadata) {
+  load_request* request = new load_request();
+  request->loader = this;
+  request->name = name;
+  request->url = url;
+  request->revalidation = cached;
+  request->prioritized = false;
+  request->metadata = metadata;
+  const bool prioritized = prioritized_lookups_.erase(name) != 0;
+
+  if (request->revalidation) {
+    // The emoji may have been changed to another image.
+    auto it = custom_emojis_.find(name);
+    if (it != custom_emojis_.end() && it->second != url) {
+      forget_scaled(name);
+    }
+    custom_emojis_[name] = url;
+    signal_custom_emoji_loaded_.emit(name);
+    if (!request->metadata.is_stale()) {
+      delete request;
+      return;
+    }
   }
+
+  auto it = queued_.find(name);
+  if (it != queued_.end()) {
+    request->prioritized = it->second->prioritized;
+    delete it->second;
+    it->second = request;
+  } else {
+    queued_.emplace(std::make_pair(name, request));
+    default_queue_.push_back(name);
+  }
+  if (prioritized && !request->prioritized) {
+    request->prioritized = true;
+    visible_queue_.push_back(name);
+  }
+  start_queued_loads();
 }
 
-void emoji_loader::cache_emoji(const std::string& name,
-                               const std::string& url) {
-  ensure_directory(custom_directory_);
-  const std::string path = build_cache_path(custom_directory_, url);
-  if (Glib::file_test(path,
-                      Glib::FILE_TEST_IS_REGULAR | Glib::FILE_TEST_EXISTS)) {
-    custom_emojis_.emplace(std::make_pair(name, url));
+void emoji_loader::prioritize(const std::string& name) {
+  const std::string key = resolve_alias(name);
+  if (lookups_.find(key) != lookups_.end()) {
+    // Queued, if need be, once looked up
+    prioritized_lookups_.insert(key);
     return;
   }
+  auto it = queued_.find(key);
+  if (it == queued_.end() || it->second->prioritized) {
+    return;
+  }
+  it->second->prioritized = true;
+  visible_queue_.push_back(it->first);
+  start_queued_loads();
+}
+
+void emoji_loader::start_queued_loads() {
+  while (loads_in_flight_ < max_loads_in_flight &&
+         !(visible_queue_.empty() && default_queue_.empty())) {
+    std::deque<std::string>& queue =
+        visible_queue_.empty() ? default_queue_ : visible_queue_;
+    const std::string name = queue.front();
+    queue.pop_front();
+
+    auto it = queued_.find(name);
+    if (it == queued_.end()) {
+      continue;
+    }
+    load_request* request = it->second;
+    queued_.erase(it);
+
+    SoupMessage* message = soup_message_new("GET", request->url.c_str());
+    if (message == nullptr) {
+      std::cerr << "[emoji_loader] invalid URL for custom emoji " << name
+                << ": " << request->url << std::endl;
+      delete request;
+      continue;
+    }
+    if (request->revalidation) {
+      add_conditional_headers(message, request->metadata);
+    }
+    ++loads_in_flight_;
+    soup_session_queue_message(session_, message, load_callback, request);
+  }
+}
 
-  SoupMessage* message = soup_message_new("GET", url.c_str());
-  soup_session_queue_message(
-      session_, message, load_callback,
-      new std::pair<std::string, emoji_loader*>(name, this));
+sigc::signal<void, const std::string&>
+emoji_loader::signal_custom_emoji_loaded() {
+  return signal_custom_emoji_loaded_;
 }
 
 void emoji_loader::load_callback(SoupSession*, SoupMessage* message,
                                  gpointer user_data) {
-  std::pair<std::string, emoji_loader*>* arg =
-      static_cast<decltype(arg)>(user_data);
-  arg->second->on_load(arg->first, message);
-  delete arg;
+  load_request* request = static_cast<decltype(request)>(user_data);
+  emoji_loader* loader = request->loader;
+  --loader->loads_in_flight_;
+  loader->on_load(*request, message);
+  delete request;
+  loader->start_queued_loads();
 }
 
-void emoji_loader::on_load(const std::string& name, SoupMessage* message) {
-  char* uri_c = soup_uri_to_string(soup_message_get_uri(message), FALSE);
-  const std::string uri(uri_c);
-  g_free(uri_c);
+void emoji_loader::on_load(const load_request& request, SoupMessage* message) {
+  const std::string& url = request.url;
 
-  if (SOUP_STATUS_IS_TRANSPORT_ERROR(message->status_code)) {
-    std::cerr << "[emoji_loader] " << uri << " (" << message->status_code
+  if (request.revalidation &&
+      message->status_code == SOUP_STATUS_NOT_MODIFIED) {
+    cache_job* job = new cache_job(this, alive_, cache_job::REFRESH, cache_);
+    job->url = url;
+    job->metadata = metadata_from_response(message, request.metadata);
+    start_job(job);
+  } else if (SOUP_STATUS_IS_SUCCESSFUL(message->status_code)) {
+    cache_job* job = new cache_job(this, alive_, cache_job::STORE, cache_);
+    job->name = request.name;
+    job->url = url;
+    job->prioritized = request.prioritized;
+    SoupBuffer* buffer = soup_message_body_flatten(message->response_body);
+    job->data = soup_buffer_get_as_bytes(buffer);
+    soup_buffer_free(buffer);
+    job->metadata =
+        metadata_from_response(message, disk_cache::metadata_type());
+    start_job(job);
+  } else {
+    std::cerr << "[emoji_loader] " << url << " (" << message->status_code
               << ") " << soup_status_get_phrase(message->status_code)
               << std::endl;
-  } else {
-    const std::string path = build_cache_path(custom_directory_, uri);
-    std::ofstream ofs;
-    ofs.open(path, std::ios::binary);
-    ofs.write(message->response_body->data, message->response_body->length);
-    custom_emojis_.emplace(std::make_pair(name, uri));
+  }
+}
+
+void emoji_loader::start_job(cache_job* job) {
+  GTask* task = g_task_new(nullptr, nullptr, job_callback, job);
+  g_task_set_task_data(task, job,
+                       [](gpointer p) { delete static_cast<cache_job*>(p); });
+  g_task_run_in_thread(task, job_thread);
+  g_object_unref(task);
+}
+
+void emoji_loader::job_thread(GTask* task, gpointer, gpointer task_data,
+                              GCancellable*) {
+  cache_job* job = static_cast<cache_job*>(task_data);
+  switch (job->mode) {
+    case cache_job::LOOKUP:
+      for (cache_job::lookup_entry& entry : job->entries) {
+        entry.cached = !job->cache->lookup(entry.url, &entry.metadata).empty();
+      }
+      break;
+    case cache_job::DECODE: {
+      const std::string path = job->cache->lookup(job->url);
+      job->cached = !path.empty();
+      if (!job->cached) {
+        break;
+      }
+      GError* error = nullptr;
+      job->pixbuf = gdk_pixbuf_new_from_file_at_scale(
+          path.c_str(), job->size, job->size, FALSE, &error);
+      if (error != nullptr) {
+        job->error = error->message;
+        g_error_free(error);
+      }
+    } break;
+    case cache_job::STORE: {
+      gsize length = 0;
+      const gchar* body =
+          static_cast<const gchar*>(g_bytes_get_data(job->data, &length));
+      job->cached = job->cache->store(job->url, body, length, job->metadata);
+    } break;
+    case cache_job::REFRESH:
+      job->cache->update_metadata(job->url, job->metadata);
+      break;
+  }
+  g_task_return_boolean(task, TRUE);
+}
+
+// Called from the main loop
+void emoji_loader::job_callback(GObject*, GAsyncResult*, gpointer user_data) {
+  cache_job* job = static_cast<cache_job*>(user_data);
+  if (*job->alive) {
+    job->loader->on_job_done(job);
+  }
+}
+
+void emoji_loader::on_job_done(cache_job* job) {
+  switch (job->mode) {
+    case cache_job::LOOKUP:
+      on_looked_up(job);
+      break;
+    case cache_job::DECODE:
+      on_decoded(job);
+      break;
+    case cache_job::STORE:
+      on_stored(job);
+      break;
+    case cache_job::REFRESH:
+      break;
+  }
+}
+
+void emoji_loader::on_looked_up(cache_job* job) {
+  for (const cache_job::lookup_entry& entry : job->entries) {
+    auto it = lookups_.find(entry.name);
+    if (it == lookups_.end() || it->second != entry.url) {
+      // Removed, or added again with another URL in the meantime
+      continue;
+    }
+    lookups_.erase(it);
+    cache_emoji(entry.name, entry.url, entry.cached, entry.metadata);
+  }
+}
+
+void emoji_loader::on_decoded(cache_job* job) {
+  const auto key = std::make_pair(job->name, job->size);
+  decoding_.erase(key);
+  auto it = custom_emojis_.find(job->name);
+  if (it == custom_emojis_.end() || it->second != job->url) {
+    return;
+  }
+  if (!job->cached) {
+    std::cerr << "[emoji_loader] custom emoji " << job->name
+              << " is no longer cached" << std::endl;
+    // Download it again. It's wanted on screen.
+    custom_emojis_.erase(it);
+    add_custom_emoji(job->name, job->url);
+    prioritized_lookups_.insert(job->name);
+    return;
+  }
+  if (job->pixbuf == nullptr) {
+    std::cerr << "[emoji_loader] cannot load custom emoji " << job->name
+              << ": " << job->error << std::endl;
+    return;
+  }
+  scaled_[key] = Glib::wrap(job->pixbuf, true);
+  signal_custom_emoji_loaded_.emit(job->name);
+}
+
+void emoji_loader::on_stored(cache_job* job) {
+  if (!job->cached) {
+    return;
+  }
+  custom_emojis_[job->name] = job->url;
+  forget_scaled(job->name);
+  if (job->prioritized) {
+    signal_custom_emoji_loaded_.emit(job->name);
   }
 }
@@ -0,0 +1,524 @@
+#include "file_downloader.h"
+#include <glib/gstdio.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include "http_cache_validation.h"
+
+// Progress is reported after each chunk.
+static const gsize chunk_size = 64 * 1024;
+
+struct file_downloader::transfer {
+  file_downloader* downloader;
+  // false once the downloader is destroyed
+  std::shared_ptr<bool> alive;
+  std::string url;
+  std::string partial_path;
+  SoupMessage* message;
+  GCancellable* cancellable;
+  GInputStream* input;
+  GOutputStream* output;
+  // The chunk being written
+  GBytes* chunk;
+  std::uint64_t received;
+  std::uint64_t total;
+  // Bytes needed from the start of the file, or 0 for the whole file
+  std::uint64_t limit;
+  // Requests waiting for the file
+  std::vector<request_id> requests;
+
+  transfer(file_downloader* d, std::shared_ptr<bool> a, const std::string& u,
+           const std::string& p, std::uint64_t l)
+      : downloader(d),
+        alive(a),
+        url(u),
+        partial_path(p),
+        message(nullptr),
+        cancellable(g_cancellable_new()),
+        input(nullptr),
+        output(nullptr),
+        chunk(nullptr),
+        received(0),
+        total(0),
+        limit(l),
+        requests() {
+  }
+
+  ~transfer() {
+    if (chunk != nullptr) {
+      g_bytes_unref(chunk);
+    }
+    if (output != nullptr) {
+      g_output_stream_close(output, nullptr, nullptr);
+      g_object_unref(output);
+    }
+    if (input != nullptr) {
+      g_input_stream_close(input, nullptr, nullptr);
+      g_object_unref(input);
+    }
+    if (message != nullptr) {
+      g_object_unref(message);
+    }
+    g_object_unref(cancellable);
+  }
+};
+
+// Jobs run on a GTask worker thread, so they must only touch the job itself,
+// the thread-safe disk_cache and plain GLib/GdkPixbuf objects.
+struct file_downloader::decode_job {
+  file_downloader* downloader;
+  // false once the downloader is destroyed
+  std::shared_ptr<bool> alive;
+  request_id id;
+  std::string url;
+  std::shared_ptr<disk_cache> cache;
+  int size;
+  std::size_t max_bytes;
+
+  // Results
+  bool cache_miss;
+  // Bytes already downloaded by an earlier, interrupted transfer
+  std::uint64_t partial_size;
+  // Validators of the partial file
+  disk_cache::metadata_type partial_metadata;
+  GdkPixbuf* pixbuf;
+  std::string text;
+  std::string error;
+
+  decode_job(file_downloader* d, std::shared_ptr<bool> a, request_id i,
+             const request& r, std::shared_ptr<disk_cache> c)
+      : downloader(d),
+        alive(a),
+        id(i),
+        url(r.url),
+        cache(c),
+        size(r.size),
+        max_bytes(r.max_bytes),
+        cache_miss(false),
+        partial_size(0),
+        partial_metadata(),
+        pixbuf(nullptr),
+        text(),
+        error() {
+  }
+
+  ~decode_job() {
+    if (pixbuf != nullptr) {
+      g_object_unref(pixbuf);
+    }
+  }
+};
+
+file_downloader::file_downloader(std::shared_ptr<disk_cache> cache,
+                                 const std::string& token)
+    : cache_(cache),
+      token_(token),
+      session_(soup_session_new()),
+      requests_(),
+      next_request_id_(1),
+      transfers_(),
+      alive_(std::make_shared<bool>(true)) {
+}
+
+file_downloader::~file_downloader() {
+  // Every transfer waits for exactly one operation, which completes with
+  // G_IO_ERROR_CANCELLED; its callback deletes the transfer.
+  *alive_ = false;
+  for (const auto& p : transfers_) {
+    g_cancellable_cancel(p.second->cancellable);
+  }
+  g_object_unref(session_);
+}
+
+file_downloader::request_id file_downloader::load_thumbnail(
+    const std::string& url, int size, const progress_callback_type& progress,
+    const thumbnail_callback_type& callback) {
+  request r;
+  r.url = url;
+  r.size = size;
+  r.max_bytes = 0;
+  r.progress = progress;
+  r.thumbnail_callback = callback;
+  return add_request(r);
+}
+
+file_downloader::request_id file_downloader::load_text(
+    const std::string& url, std::size_t max_bytes,
+    const progress_callback_type& progress,
+    const text_callback_type& callback) {
+  request r;
+  r.url = url;
+  r.size = 0;
+  r.max_bytes = max_bytes;
+  r.progress = progress;
+  r.text_callback = callback;
+  return add_request(r);
+}
+
+file_downloader::request_id file_downloader::add_request(const request& r) {
+  const request_id id = next_request_id_++;
+  requests_.emplace(std::make_pair(id, r));
+  start_decode(id);
+  return id;
+}
+
+void file_downloader::cancel(request_id id) {
+  auto it = requests_.find(id);
+  if (it == requests_.end()) {
+    return;
+  }
+  auto jt = transfers_.find(it->second.url);
+  requests_.erase(it);
+  if (jt == transfers_.end()) {
+    // A decode job may be running; its result is dropped.
+    return;
+  }
+  transfer* t = jt->second;
+  t->requests.erase(std::remove(t->requests.begin(), t->requests.end(), id),
+                    t->requests.end());
+  if (t->requests.empty()) {
+    // What has been written so far is kept for the next request.
+    g_cancellable_cancel(t->cancellable);
+  }
+}
+
+void file_downloader::start_decode(request_id id) {
+  decode_job* job = new decode_job(this, alive_, id, requests_.at(id), cache_);
+  GTask* task = g_task_new(nullptr, nullptr, decode_callback, job);
+  g_task_set_task_data(task, job,
+                       [](gpointer p) { delete static_cast<decode_job*>(p); });
+  g_task_run_in_thread(task, decode_thread);
+  g_object_unref(task);
+}
+
+// Reads at most max_bytes from the start of the file at path, cut to whole
+// UTF-8 characters.
+static void read_text(const std::string& path, std::size_t max_bytes,
+                      std::string& text, std::string& error) {
+  std::ifstream ifs(path, std::ios::binary);
+  std::vector<char> buffer(max_bytes);
+  ifs.read(buffer.data(), buffer.size());
+  const gchar* end = nullptr;
+  g_utf8_validate(buffer.data(), ifs.gcount(), &end);
+  text.assign(buffer.data(), end);
+  if (!ifs && !ifs.eof()) {
+    error = "cannot read " + path;
+  }
+}
+
+void file_downloader::decode_thread(GTask* task, gpointer, gpointer task_data,
+                                    GCancellable*) {
+  decode_job* job = static_cast<decode_job*>(task_data);
+  const std::string path = job->cache->lookup(job->url);
+  if (path.empty()) {
+    const std::string partial_path = job->cache->partial_path_of(job->url);
+    GStatBuf st;
+    if (g_stat(partial_path.c_str(), &st) == 0) {
+      job->partial_size = st.st_size;
+    }
+    if (job->size == 0 && job->partial_size >= job->max_bytes) {
+      // Text previews only download the start of the file.
+      read_text(partial_path, job->max_bytes, job->text, job->error);
+    } else {
+      job->cache_miss = true;
+      if (job->partial_size > 0) {
+        job->cache->lookup_partial_metadata(job->url, job->partial_metadata);
+      }
+    }
+    g_task_return_boolean(task, TRUE);
+    return;
+  }
+
+  if (job->size > 0) {
+    // The loader scales while decoding, so the full-size image is never
+    // held in memory.
+    GError* error = nullptr;
+    job->pixbuf = gdk_pixbuf_new_from_file_at_scale(
+        path.c_str(), job->size, job->size, TRUE, &error);
+    if (error != nullptr) {
+      job->error = error->message;
+      g_error_free(error);
+    }
+  } else {
+    read_text(path, job->max_bytes, job->text, job->error);
+  }
+  g_task_return_boolean(task, TRUE);
+}
+
+// Called from the main loop
+void file_downloader::decode_callback(GObject*, GAsyncResult*,
+                                      gpointer user_data) {
+  decode_job* job = static_cast<decode_job*>(user_data);
+  if (*job->alive) {
+    job->downloader->on_decoded(job);
+  }
+}
+
+void file_downloader::on_decoded(decode_job* job) {
+  if (requests_.find(job->id) == requests_.end()) {
+    return;
+  }
+  if (!job->cache_miss) {
+    if (!job->error.empty()) {
+      std::cerr << "[file_downloader] " << job->url << ": " << job->error
+                << std::endl;
+    }
+    finish_request(job->id,
+                   job->pixbuf == nullptr ? Glib::RefPtr<Gdk::Pixbuf>()
+                                          : Glib::wrap(job->pixbuf, true),
+                   job->text);
+    return;
+  }
+
+  auto it = transfers_.find(job->url);
+  if (it == transfers_.end()) {
+    SoupMessage* message = soup_message_new("GET", job->url.c_str());
+    if (message == nullptr) {
+      std::cerr << "[file_downloader] invalid URL " << job->url << std::endl;
+      finish_request(job->id, Glib::RefPtr<Gdk::Pixbuf>(), std::string());
+      return;
+    }
+    start_transfer(job->url, message, job->partial_size,
+                   job->partial_metadata, job->size == 0 ? job->max_bytes : 0);
+    it = transfers_.find(job->url);
+  }
+  it->second->requests.push_back(job->id);
+}
+
+void file_downloader::finish_request(request_id id,
+                                     Glib::RefPtr<Gdk::Pixbuf> pixbuf,
+                                     const std::string& text) {
+  auto it = requests_.find(id);
+  if (it == requests_.end()) {
+    return;
+  }
+  const request r = it->second;
+  requests_.erase(it);
+  if (r.thumbnail_callback) {
+    r.thumbnail_callback(pixbuf);
+  } else {
+    r.text_callback(text);
+  }
+}
+
+void file_downloader::start_transfer(
+    const std::string& url, SoupMessage* message, std::uint64_t offset,
+    const disk_cache::metadata_type& validators, std::uint64_t limit) {
+  transfer* t =
+      new transfer(this, alive_, url, cache_->partial_path_of(url), limit);
+  transfers_.emplace(std::make_pair(url, t));
+  t->message = message;
+  soup_message_headers_append(message->request_headers, "Authorization",
+                              ("Bearer " + token_).c_str());
+  // Without a validator, the partial file may belong to an older version of
+  // the file; download it again.
+  if (offset > 0 && add_if_range_header(message, validators)) {
+    t->received = offset;
+  }
+  if (t->received > 0 || limit > 0) {
+    soup_message_headers_set_range(message->request_headers, t->received,
+                                   limit > 0 ? goffset(limit) - 1 : -1);
+  }
+  soup_session_send_async(session_, message, t->cancellable, send_callback,
+                          t);
+}
+
+void file_downloader::send_callback(GObject* source_object,
+                                    GAsyncResult* result,
+                                    gpointer user_data) {
+  transfer* t = static_cast<transfer*>(user_data);
+  GError* error = nullptr;
+  GInputStream* input =
+      soup_session_send_finish(SOUP_SESSION(source_object), result, &error);
+  if (!*t->alive) {
+    if (input != nullptr) {
+      g_object_unref(input);
+    }
+    if (error != nullptr) {
+      g_error_free(error);
+    }
+    delete t;
+    return;
+  }
+  t->downloader->on_sent(t, input, error);
+}
+
+void file_downloader::on_sent(transfer* t, GInputStream* input,
+                              GError* error) {
+  if (error != nullptr) {
+    if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+      std::cerr << "[file_downloader] " << t->url << ": " << error->message
+                << std::endl;
+    }
+    g_error_free(error);
+    finish_transfer(t, false);
+    return;
+  }
+  t->input = input;
+
+  const guint status = t->message->status_code;
+  GFile* file = g_file_new_for_path(t->partial_path.c_str());
+  GFileOutputStream* output = nullptr;
+  if (status == SOUP_STATUS_PARTIAL_CONTENT && t->received > 0) {
+    output = g_file_append_to(file, G_FILE_CREATE_PRIVATE, nullptr, &error);
+  } else if (SOUP_STATUS_IS_SUCCESSFUL(status)) {
+    // A new download, or the file has changed since the partial file was
+    // written (If-Range); start over.
+    t->received = 0;
+    output = g_file_replace(file, nullptr, FALSE, G_FILE_CREATE_PRIVATE,
+                            nullptr, &error);
+    if (output != nullptr) {
+      cache_->store_partial_metadata(
+          t->url,
+          metadata_from_response(t->message, disk_cache::metadata_type()));
+    }
+  } else {
+    std::cerr << "[file_downloader] " << t->url << " (" << status << ") "
+              << soup_status_get_phrase(status) << std::endl;
+    if (status == SOUP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE) {
+      // The partial file doesn't match the file on the server.
+      g_unlink(t->partial_path.c_str());
+    }
+  }
+  g_object_unref(file);
+  if (error != nullptr) {
+    std::cerr << "[file_downloader] cannot write " << t->partial_path << ": "
+              << error->message << std::endl;
+    g_error_free(error);
+  }
+  if (output == nullptr) {
+    finish_transfer(t, false);
+    return;
+  }
+  t->output = G_OUTPUT_STREAM(output);
+
+  const goffset length =
+      soup_message_headers_get_content_length(t->message->response_headers);
+  t->total = length > 0 ? t->received + length : 0;
+  read_next(t);
+}
+
+void file_downloader::read_next(transfer* t) {
+  g_input_stream_read_bytes_async(t->input, chunk_size, G_PRIORITY_DEFAULT,
+                                  t->cancellable, read_callback, t);
+}
+
+void file_downloader::read_callback(GObject* source_object,
+                                    GAsyncResult* result,
+                                    gpointer user_data) {
+  transfer* t = static_cast<transfer*>(user_data);
+  GError* error = nullptr;
+  GBytes* bytes = g_input_stream_read_bytes_finish(
+      G_INPUT_STREAM(source_object), result, &error);
+  if (!*t->alive) {
+    if (bytes != nullptr) {
+      g_bytes_unref(bytes);
+    }
+    if (error != nullptr) {
+      g_error_free(error);
+    }
+    delete t;
+    return;
+  }
+  t->downloader->on_read(t, bytes, error);
+}
+
+void file_downloader::on_read(transfer* t, GBytes* bytes, GError* error) {
+  if (error != nullptr) {
+    if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+      std::cerr << "[file_downloader] " << t->url << ": " << error->message
+                << std::endl;
+    }
+    g_error_free(error);
+    finish_transfer(t, false);
+    return;
+  }
+  gsize size = 0;
+  const void* data = g_bytes_get_data(bytes, &size);
+  if (size == 0) {
+    g_bytes_unref(bytes);
+    finish_transfer(t, true);
+    return;
+  }
+  t->chunk = bytes;
+  g_output_stream_write_all_async(t->output, data, size, G_PRIORITY_DEFAULT,
+                                  t->cancellable, write_callback, t);
+}
+
+void file_downloader::write_callback(GObject* source_object,
+                                     GAsyncResult* result,
+                                     gpointer user_data) {
+  transfer* t = static_cast<transfer*>(user_data);
+  GError* error = nullptr;
+  gsize written = 0;
+  g_output_stream_write_all_finish(G_OUTPUT_STREAM(source_object), result,
+                                   &written, &error);
+  if (!*t->alive) {
+    if (error != nullptr) {
+      g_error_free(error);
+    }
+    delete t;
+    return;
+  }
+  t->downloader->on_written(t, written, error);
+}
+
+void file_downloader::on_written(transfer* t, gsize written, GError* error) {
+  g_bytes_unref(t->chunk);
+  t->chunk = nullptr;
+  t->received += written;
+  if (error != nullptr) {
+    if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+      std::cerr << "[file_downloader] cannot write " << t->partial_path
+                << ": " << error->message << std::endl;
+    }
+    g_error_free(error);
+    finish_transfer(t, false);
+    return;
+  }
+
+  // Callbacks may cancel their requests.
+  const std::vector<request_id> ids = t->requests;
+  for (request_id id : ids) {
+    auto it = requests_.find(id);
+    if (it != requests_.end() && it->second.progress) {
+      it->second.progress(t->received, t->total);
+    }
+  }
+  if (t->limit > 0 && t->received >= t->limit) {
+    // The server ignored the range; the rest isn't needed.
+    finish_transfer(t, true);
+    return;
+  }
+  read_next(t);
+}
+
+void file_downloader::finish_transfer(transfer* t, bool ok) {
+  transfers_.erase(t->url);
+  // The file must be complete on disk before it's moved into the cache.
+  if (t->output != nullptr) {
+    g_output_stream_close(t->output, nullptr, nullptr);
+    g_object_unref(t->output);
+    t->output = nullptr;
+  }
+  // Unless the file was smaller than the limit, the partial file only has
+  // its start, which is decoded from there.
+  if (ok && (t->limit == 0 || t->received < t->limit)) {
+    ok = cache_->commit_partial(
+        t->url,
+        metadata_from_response(t->message, disk_cache::metadata_type()));
+  }
+  const bool cancelled = g_cancellable_is_cancelled(t->cancellable);
+  const std::vector<request_id> ids = t->requests;
+  delete t;
+
+  for (request_id id : ids) {
+    if (ok || cancelled) {
+      // Decoded from the cache, or attached after the transfer had been
+      // cancelled and resumed by a new one.
+      start_decode(id);
+    } else {
+      finish_request(id, Glib::RefPtr<Gdk::Pixbuf>(), std::string());
+    }
+  }
+}
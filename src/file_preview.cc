@@ -0,0 +1,184 @@
+#include "file_preview.h"
+#include <glib.h>
+#include <algorithm>
+#include <functional>
+
+// Longer side of image thumbnails
+static const int thumbnail_size = 360;
+// Height reserved for thumbnails of unknown size until they're loaded
+static const int placeholder_height = 48;
+// Text files are previewed by their beginning.
+static const std::size_t snippet_max_bytes = 4096;
+static const int snippet_max_lines = 10;
+
+static bool starts_with(const std::string& s, const char* prefix) {
+  return s.compare(0, std::char_traits<char>::length(prefix), prefix) == 0;
+}
+
+FilePreview::FilePreview(team& team, const Json::Value& file)
+    : Gtk::Box(Gtk::ORIENTATION_VERTICAL, 2),
+      team_(team),
+      url_(),
+      image_(nullptr),
+      snippet_label_(nullptr),
+      progress_bar_(),
+      request_(0),
+      loaded_(false),
+      on_screen_(false) {
+  std::string title = file["title"].asString();
+  if (title.empty()) {
+    title = file["name"].asString();
+  }
+  std::string details = file["pretty_type"].asString();
+  if (file["size"].isIntegral()) {
+    gchar* size = g_format_size(file["size"].asUInt64());
+    details += details.empty() ? size : std::string(", ") + size;
+    g_free(size);
+  }
+  if (!details.empty()) {
+    title += " (" + details + ")";
+  }
+  Gtk::Label* title_label =
+      Gtk::manage(new Gtk::Label(title, Gtk::ALIGN_START, Gtk::ALIGN_CENTER));
+  title_label->set_line_wrap(true);
+  pack_start(*title_label, Gtk::PACK_SHRINK);
+
+  const std::string mimetype = file["mimetype"].asString();
+  if (starts_with(mimetype, "image/")) {
+    // Slack's own thumbnail is a much smaller download when there is one.
+    int width = file["original_w"].asInt();
+    int height = file["original_h"].asInt();
+    if (file["thumb_360"].isString()) {
+      url_ = file["thumb_360"].asString();
+      width = file["thumb_360_w"].asInt();
+      height = file["thumb_360_h"].asInt();
+    } else {
+      url_ = file["url_private"].asString();
+    }
+    image_ = Gtk::manage(new Gtk::Image());
+    image_->set_alignment(Gtk::ALIGN_START, Gtk::ALIGN_START);
+    if (width > 0 && height > 0) {
+      const int longer = std::max(width, height);
+      image_->set_size_request(width * thumbnail_size / longer,
+                               height * thumbnail_size / longer);
+    } else {
+      image_->set_size_request(-1, placeholder_height);
+    }
+    pack_start(*image_, Gtk::PACK_SHRINK);
+  } else if (file["preview"].isString() || starts_with(mimetype, "text/") ||
+             file["mode"].asString() == "snippet") {
+    snippet_label_ = Gtk::manage(
+        new Gtk::Label("", Gtk::ALIGN_START, Gtk::ALIGN_START));
+    Pango::AttrList attrs;
+    Pango::Attribute family = Pango::Attribute::create_attr_family("monospace");
+    attrs.insert(family);
+    snippet_label_->set_attributes(attrs);
+    snippet_label_->set_selectable(true);
+    pack_start(*snippet_label_, Gtk::PACK_SHRINK);
+    if (file["preview"].isString()) {
+      // Slack sends the beginning of snippets along.
+      set_snippet(file["preview"].asString());
+      loaded_ = true;
+    } else {
+      url_ = file["url_private"].asString();
+    }
+  }
+
+  pack_start(progress_bar_, Gtk::PACK_SHRINK);
+  progress_bar_.set_no_show_all(true);
+  show_all_children();
+}
+
+FilePreview::~FilePreview() {
+  cancel_request();
+}
+
+void FilePreview::set_on_screen() {
+  if (on_screen_) {
+    return;
+  }
+  on_screen_ = true;
+  if (loaded_ || request_ != 0 || url_.empty()) {
+    return;
+  }
+
+  const file_downloader::progress_callback_type progress = std::bind(
+      &FilePreview::on_progress, this, std::placeholders::_1,
+      std::placeholders::_2);
+  if (image_ != nullptr) {
+    request_ = team_.file_downloader_->load_thumbnail(
+        url_, thumbnail_size, progress,
+        std::bind(&FilePreview::on_thumbnail_loaded, this,
+                  std::placeholders::_1));
+  } else {
+    request_ = team_.file_downloader_->load_text(
+        url_, snippet_max_bytes, progress,
+        std::bind(&FilePreview::on_text_loaded, this, std::placeholders::_1));
+  }
+}
+
+void FilePreview::set_off_screen() {
+  on_screen_ = false;
+  // An interrupted download is resumed when the row comes back.
+  cancel_request();
+  if (image_ != nullptr && loaded_) {
+    // Keep the allocated size; the thumbnail comes back with the same one.
+    const Glib::RefPtr<Gdk::Pixbuf> pixbuf = image_->get_pixbuf();
+    image_->set_size_request(pixbuf->get_width(), pixbuf->get_height());
+    image_->clear();
+    loaded_ = false;
+  }
+}
+
+void FilePreview::cancel_request() {
+  if (request_ != 0) {
+    team_.file_downloader_->cancel(request_);
+    request_ = 0;
+    progress_bar_.hide();
+  }
+}
+
+void FilePreview::on_progress(std::uint64_t received, std::uint64_t total) {
+  if (total == 0) {
+    progress_bar_.pulse();
+  } else {
+    progress_bar_.set_fraction(double(received) / total);
+  }
+  progress_bar_.show();
+}
+
+void FilePreview::on_thumbnail_loaded(Glib::RefPtr<Gdk::Pixbuf> pixbuf) {
+  request_ = 0;
+  progress_bar_.hide();
+  if (pixbuf) {
+    image_->set(pixbuf);
+    loaded_ = true;
+  } else {
+    // Leave just the name.
+    image_->hide();
+  }
+}
+
+void FilePreview::on_text_loaded(const std::string& text) {
+  request_ = 0;
+  progress_bar_.hide();
+  set_snippet(text);
+  // Snippets are small; they're kept off screen too.
+  loaded_ = true;
+}
+
+void FilePreview::set_snippet(const std::string& text) {
+  // The newline ending the last line shown
+  std::size_t end = std::string::npos;
+  std::size_t pos = 0;
+  for (int i = 0; i < snippet_max_lines && pos != std::string::npos; ++i) {
+    end = text.find('\n', pos);
+    pos = end == std::string::npos ? end : end + 1;
+  }
+  if (end == std::string::npos || end + 1 == text.size()) {
+    snippet_label_->set_text(text);
+  } else {
+    snippet_label_->set_text(text.substr(0, end) + "\n\xe2\x80\xa6");
+  }
+  snippet_label_->set_visible(!text.empty());
+}
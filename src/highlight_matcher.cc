@@ -0,0 +1,112 @@
+#include "highlight_matcher.h"
+#include <glib.h>
+#include <deque>
+
+static const std::size_t alphabet_size = 256;
+
+// Both the patterns and the text are case-folded, so that matching on bytes
+// ignores case beyond ASCII too.
+static std::string casefold(const std::string& s) {
+  gchar* folded = g_utf8_casefold(s.c_str(), s.size());
+  const std::string result(folded);
+  g_free(folded);
+  return result;
+}
+
+highlight_matcher::highlight_matcher(const std::string& self_id)
+    : self_id_(self_id), transitions_(), accepting_() {
+  set_keywords(std::vector<std::string>());
+}
+
+void highlight_matcher::set_keywords(
+    const std::vector<std::string>& keywords) {
+  // Mentions are formatted as <@U123>, <@U123|name> and <!here>.
+  std::vector<std::string> patterns = {"<!channel", "<!here", "<!everyone"};
+  if (!self_id_.empty()) {
+    // Whole IDs only, so that a longer ID starting with ours doesn't match
+    patterns.push_back("<@" + self_id_ + ">");
+    patterns.push_back("<@" + self_id_ + "|");
+  }
+  for (const std::string& keyword : keywords) {
+    if (!keyword.empty()) {
+      patterns.push_back(keyword);
+    }
+  }
+  build(patterns);
+}
+
+void highlight_matcher::build(const std::vector<std::string>& patterns) {
+  // Trie of the patterns. 0 marks missing edges; no edge leads to the root.
+  transitions_.assign(alphabet_size, 0);
+  accepting_.assign(1, false);
+  for (const std::string& pattern : patterns) {
+    std::uint32_t state = 0;
+    for (unsigned char c : casefold(pattern)) {
+      std::uint32_t next = transitions_[state * alphabet_size + c];
+      if (next == 0) {
+        next = accepting_.size();
+        transitions_[state * alphabet_size + c] = next;
+        transitions_.resize(transitions_.size() + alphabet_size, 0);
+        accepting_.push_back(false);
+      }
+      state = next;
+    }
+    accepting_[state] = true;
+  }
+
+  // Breadth first, so that the failure state of each state is complete
+  // before the state is. Missing edges then take the transition of the
+  // failure state, which turns the trie into a DFA.
+  std::vector<std::uint32_t> failure(accepting_.size(), 0);
+  std::deque<std::uint32_t> queue;
+  for (std::size_t c = 0; c < alphabet_size; ++c) {
+    if (transitions_[c] != 0) {
+      queue.push_back(transitions_[c]);
+    }
+  }
+  while (!queue.empty()) {
+    const std::uint32_t state = queue.front();
+    queue.pop_front();
+    if (accepting_[failure[state]]) {
+      accepting_[state] = true;
+    }
+    const std::size_t row = state * alphabet_size;
+    const std::size_t failure_row = failure[state] * alphabet_size;
+    for (std::size_t c = 0; c < alphabet_size; ++c) {
+      const std::uint32_t child = transitions_[row + c];
+      if (child != 0) {
+        failure[child] = transitions_[failure_row + c];
+        queue.push_back(child);
+      } else {
+        transitions_[row + c] = transitions_[failure_row + c];
+      }
+    }
+  }
+}
+
+bool highlight_matcher::matches(const Json::Value& message) const {
+  if (!self_id_.empty() && message["user"].asString() == self_id_) {
+    return false;
+  }
+  if (scan(casefold(message["text"].asString()))) {
+    return true;
+  }
+  // Bots often post only attachments.
+  for (const Json::Value& attachment : message["attachments"]) {
+    if (scan(casefold(attachment["fallback"].asString()))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool highlight_matcher::scan(const std::string& text) const {
+  std::uint32_t state = 0;
+  for (unsigned char c : text) {
+    state = transitions_[state * alphabet_size + c];
+    if (accepting_[state]) {
+      return true;
+    }
+  }
+  return false;
+}
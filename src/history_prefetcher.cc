@@ -0,0 +1,77 @@
+#include "history_prefetcher.h"
+#include <glibmm/main.h>
+#include "api_client.h"
+#include "channel_window.h"
+
+static const unsigned int tick_interval_ms = 2000;
+static const std::size_t max_requests_per_minute = 6;
+// Upper bound of prefetched messages held without rows
+static const std::size_t max_prefetched_bytes = 4 * 1024 * 1024;
+
+history_prefetcher::history_prefetcher(std::shared_ptr<api_client> api_client)
+    : api_client_(api_client), windows_(), recent_requests_(), tick_() {
+  // Low priority keeps the prefetcher behind redraws, input and idle work
+  // such as building rows.
+  tick_ = Glib::signal_timeout().connect(
+      sigc::mem_fun(*this, &history_prefetcher::on_tick), tick_interval_ms,
+      Glib::PRIORITY_LOW);
+}
+
+history_prefetcher::~history_prefetcher() {
+  tick_.disconnect();
+}
+
+void history_prefetcher::add(ChannelWindow* window) {
+  windows_.insert(window);
+}
+
+void history_prefetcher::remove(ChannelWindow* window) {
+  windows_.erase(window);
+}
+
+bool history_prefetcher::on_tick() {
+  if (api_client_->pending_requests() != 0) {
+    // Don't compete with requests the user is waiting for.
+    return true;
+  }
+  if (prefetched_bytes() >= max_prefetched_bytes) {
+    return true;
+  }
+  ChannelWindow* window = next_candidate();
+  if (window != nullptr && within_request_budget()) {
+    recent_requests_.push_back(std::chrono::steady_clock::now());
+    window->prefetch_history();
+  }
+  return true;
+}
+
+bool history_prefetcher::within_request_budget() {
+  const auto now = std::chrono::steady_clock::now();
+  while (!recent_requests_.empty() &&
+         now - recent_requests_.front() > std::chrono::minutes(1)) {
+    recent_requests_.pop_front();
+  }
+  return recent_requests_.size() < max_requests_per_minute;
+}
+
+std::size_t history_prefetcher::prefetched_bytes() const {
+  std::size_t bytes = 0;
+  for (const ChannelWindow* window : windows_) {
+    bytes += window->prefetched_bytes();
+  }
+  return bytes;
+}
+
+ChannelWindow* history_prefetcher::next_candidate() const {
+  ChannelWindow* candidate = nullptr;
+  for (ChannelWindow* window : windows_) {
+    if (!window->needs_prefetch()) {
+      continue;
+    }
+    if (candidate == nullptr ||
+        window->unread_count() > candidate->unread_count()) {
+      candidate = window;
+    }
+  }
+  return candidate;
+}
@@ -0,0 +1,81 @@
+#include "http_cache_validation.h"
+#include <libsoup/soup-headers.h>
+#include <libsoup/soup-message-headers.h>
+#include <algorithm>
+#include <cstdlib>
+
+// Upper bound of freshness regardless of Cache-Control, so that changed
+// avatars and emoji show up within a day.
+static const std::int64_t max_ttl = 24 * 60 * 60;
+
+void add_conditional_headers(SoupMessage* message,
+                             const disk_cache::metadata_type& metadata) {
+  if (!metadata.etag.empty()) {
+    soup_message_headers_replace(message->request_headers, "If-None-Match",
+                                 metadata.etag.c_str());
+  }
+  if (!metadata.last_modified.empty()) {
+    soup_message_headers_replace(message->request_headers,
+                                 "If-Modified-Since",
+                                 metadata.last_modified.c_str());
+  }
+}
+
+bool add_if_range_header(SoupMessage* message,
+                         const disk_cache::metadata_type& metadata) {
+  // Weak entity tags can't be used for ranges.
+  const std::string& etag = metadata.etag;
+  if (!etag.empty() && etag.compare(0, 2, "W/") != 0) {
+    soup_message_headers_replace(message->request_headers, "If-Range",
+                                 etag.c_str());
+    return true;
+  }
+  if (!metadata.last_modified.empty()) {
+    soup_message_headers_replace(message->request_headers, "If-Range",
+                                 metadata.last_modified.c_str());
+    return true;
+  }
+  return false;
+}
+
+static std::int64_t ttl_from_cache_control(const char* cache_control) {
+  if (cache_control == nullptr) {
+    return max_ttl;
+  }
+
+  std::int64_t ttl = max_ttl;
+  GHashTable* params = soup_header_parse_param_list(cache_control);
+  gpointer value = nullptr;
+  if (g_hash_table_lookup_extended(params, "no-cache", nullptr, nullptr) ||
+      g_hash_table_lookup_extended(params, "no-store", nullptr, nullptr)) {
+    ttl = 0;
+  } else if (g_hash_table_lookup_extended(params, "max-age", nullptr,
+                                          &value) &&
+             value != nullptr) {
+    ttl = std::min<std::int64_t>(
+        max_ttl, std::strtoll(static_cast<const char*>(value), nullptr, 10));
+  }
+  soup_header_free_param_list(params);
+  return ttl;
+}
+
+disk_cache::metadata_type metadata_from_response(
+    SoupMessage* message, const disk_cache::metadata_type& previous) {
+  SoupMessageHeaders* headers = message->response_headers;
+  disk_cache::metadata_type metadata(previous);
+
+  const char* etag = soup_message_headers_get_one(headers, "ETag");
+  if (etag != nullptr) {
+    metadata.etag = etag;
+  }
+  const char* last_modified =
+      soup_message_headers_get_one(headers, "Last-Modified");
+  if (last_modified != nullptr) {
+    metadata.last_modified = last_modified;
+  }
+  metadata.expires =
+      g_get_real_time() / G_USEC_PER_SEC +
+      ttl_from_cache_control(
+          soup_message_headers_get_one(headers, "Cache-Control"));
+  return metadata;
+}
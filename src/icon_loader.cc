@@ -1,78 +1,415 @@
 #include "icon_loader.h"
-#include <gdkmm/pixbufloader.h>
-#include <giomm/file.h>
-#include <glibmm/fileutils.h>
-#include <glibmm/miscutils.h>
-#include <libsoup/soup-uri.h>
-#include <fstream>
+#include <algorithm>
 #include <iostream>
+#include "http_cache_validation.h"
 
-icon_loader::icon_loader(const std::string &cache_directory)
-    : cache_directory_(cache_directory),
-      load_callback_registry_(),
-      session_(soup_session_new()) {
+// Enough for a couple of thousand avatars at the default icon size.
+static const std::size_t default_memory_cache_budget = 8 * 1024 * 1024;
+// Keep libsoup's own (FIFO) queue short so that priorities take effect.
+static const std::size_t max_loads_in_flight = 4;
+
+icon_loader::icon_loader(std::shared_ptr<disk_cache> cache,
+                         bool keep_aspect_ratio)
+    : cache_(cache),
+      keep_aspect_ratio_(keep_aspect_ratio),
+      requests_(),
+      url_loads_(),
+      queue_(),
+      next_request_id_(1),
+      loads_in_flight_(0),
+      session_(soup_session_new()),
+      revalidations_(),
+      memory_cache_lru_(),
+      memory_cache_index_(),
+      memory_cache_bytes_(0),
+      memory_cache_budget_(default_memory_cache_budget) {
 }
 
 icon_loader::~icon_loader() {
   g_object_unref(session_);
 }
 
-void icon_loader::load(const std::string &url,
-                       const load_callback_type &callback) {
-  Glib::RefPtr<Gdk::Pixbuf> pixbuf = load_from_cache(url);
+icon_loader::request_id icon_loader::load(const std::string &url, int size,
+                                          const load_callback_type &callback,
+                                          priority_type priority) {
+  Glib::RefPtr<Gdk::Pixbuf> pixbuf = find_in_memory(url, size);
   if (pixbuf) {
     callback(pixbuf);
-    return;
+    return 0;
   }
 
-  auto it = load_callback_registry_.find(url);
-  if (it == load_callback_registry_.end()) {
-    SoupMessage *message = soup_message_new("GET", url.c_str());
-    load_callback_registry_.emplace(std::make_pair(url, callback));
-    soup_session_queue_message(session_, message, load_callback, this);
-  } else {
-    load_callback_registry_.emplace(std::make_pair(url, callback));
+  const request_id id = next_request_id_++;
+  const pending_load pending = {url, size, priority, callback};
+  requests_.emplace(std::make_pair(id, pending));
+
+  url_load &load = url_loads_[url];
+  load.requests.push_back(id);
+  if (!load.started) {
+    queue_.insert(queue_key(priority, id));
+    start_queued_loads();
   }
+  return id;
 }
 
-static std::string build_cache_path(const std::string &base, std::string url) {
-  std::replace(url.begin(), url.end(), '/', '_');
-  return Glib::build_filename(base, url);
+void icon_loader::set_priority(request_id id, priority_type priority) {
+  auto it = requests_.find(id);
+  if (it == requests_.end() || it->second.priority == priority) {
+    return;
+  }
+  pending_load &pending = it->second;
+  if (queue_.erase(queue_key(pending.priority, id)) != 0) {
+    queue_.insert(queue_key(priority, id));
+  }
+  pending.priority = priority;
 }
 
-static void ensure_directory(const std::string &path) try {
-  Gio::File::create_for_path(path)->make_directory_with_parents();
-} catch (Gio::Error &e) {
-  if (e.code() != Gio::Error::EXISTS) {
-    throw e;
+void icon_loader::cancel(request_id id) {
+  auto it = requests_.find(id);
+  if (it == requests_.end()) {
+    return;
+  }
+  const pending_load &pending = it->second;
+  queue_.erase(queue_key(pending.priority, id));
+
+  auto jt = url_loads_.find(pending.url);
+  if (jt != url_loads_.end()) {
+    url_load &load = jt->second;
+    load.requests.erase(
+        std::remove(load.requests.begin(), load.requests.end(), id),
+        load.requests.end());
+    // Started loads are left running; the result still ends up in the
+    // memory cache.
+    if (load.requests.empty() && !load.started) {
+      url_loads_.erase(jt);
+    }
   }
+  requests_.erase(it);
 }
 
-Glib::RefPtr<Gdk::Pixbuf> icon_loader::load_from_cache(
-    const std::string &url) const {
-  ensure_directory(cache_directory_);
-  const std::string cache_path = build_cache_path(cache_directory_, url);
-  if (Glib::file_test(cache_path,
-                      Glib::FILE_TEST_IS_REGULAR | Glib::FILE_TEST_EXISTS)) {
-    try {
-      return Gdk::Pixbuf::create_from_file(cache_path);
-    } catch (const Gdk::PixbufError &e) {
-      std::cerr << "[icon_loader] cannot load icon from " << cache_path << " ("
-                << e.code() << ") " << e.what() << std::endl;
-      return Glib::RefPtr<Gdk::Pixbuf>();
+void icon_loader::start_queued_loads() {
+  while (loads_in_flight_ < max_loads_in_flight && !queue_.empty()) {
+    const request_id id = queue_.begin()->second;
+    const pending_load &pending = requests_.at(id);
+    url_load &load = url_loads_.at(pending.url);
+
+    for (request_id other : load.requests) {
+      queue_.erase(queue_key(requests_.at(other).priority, other));
     }
-  } else {
+    load.started = true;
+    load.size = pending.size;
+    ++loads_in_flight_;
+    // Try the disk cache first. A miss is reported back by the worker and
+    // then the icon is fetched over HTTP.
+    start_read(pending.url, pending.size);
+  }
+}
+
+void icon_loader::clear_memory_cache() {
+  memory_cache_lru_.clear();
+  memory_cache_index_.clear();
+  memory_cache_bytes_ = 0;
+}
+
+void icon_loader::set_memory_cache_budget(std::size_t bytes) {
+  memory_cache_budget_ = bytes;
+  evict_memory_cache();
+}
+
+Glib::RefPtr<Gdk::Pixbuf> icon_loader::find_in_memory(const std::string &url,
+                                                      int size) {
+  auto it = memory_cache_index_.find(std::make_pair(url, size));
+  if (it == memory_cache_index_.end()) {
     return Glib::RefPtr<Gdk::Pixbuf>();
   }
+  // Move to the most recently used position
+  memory_cache_lru_.splice(memory_cache_lru_.begin(), memory_cache_lru_,
+                           it->second);
+  return it->second->pixbuf;
+}
+
+Glib::RefPtr<Gdk::Pixbuf> icon_loader::store_in_memory(
+    const std::string &url, int size, Glib::RefPtr<Gdk::Pixbuf> pixbuf) {
+  const memory_cache_key key(url, size);
+  auto it = memory_cache_index_.find(key);
+  if (it != memory_cache_index_.end()) {
+    memory_cache_lru_.splice(memory_cache_lru_.begin(), memory_cache_lru_,
+                             it->second);
+    return it->second->pixbuf;
+  }
+
+  int width = size;
+  int height = size;
+  if (keep_aspect_ratio_) {
+    // The decoded pixbuf may have been requested with another size.
+    const int longer = std::max(pixbuf->get_width(), pixbuf->get_height());
+    width = std::max(1, pixbuf->get_width() * size / longer);
+    height = std::max(1, pixbuf->get_height() * size / longer);
+  }
+  Glib::RefPtr<Gdk::Pixbuf> scaled = pixbuf;
+  if (pixbuf->get_width() != width || pixbuf->get_height() != height) {
+    scaled = pixbuf->scale_simple(width, height, Gdk::INTERP_BILINEAR);
+  }
+  const memory_cache_entry entry = {
+      key, scaled,
+      static_cast<std::size_t>(scaled->get_rowstride()) * scaled->get_height()};
+  memory_cache_lru_.push_front(entry);
+  memory_cache_index_.emplace(std::make_pair(key, memory_cache_lru_.begin()));
+  memory_cache_bytes_ += entry.bytes;
+  evict_memory_cache();
+  return scaled;
 }
 
-void icon_loader::store_cache(const std::string &url, const char *data,
-                              std::size_t size) const {
-  ensure_directory(cache_directory_);
-  const std::string cache_path = build_cache_path(cache_directory_, url);
-  std::ofstream ofs;
-  ofs.open(cache_path, std::ios::binary);
-  ofs.write(data, size);
+void icon_loader::forget_in_memory(const std::string &url) {
+  for (auto it = memory_cache_lru_.begin(); it != memory_cache_lru_.end();) {
+    if (it->key.first == url) {
+      memory_cache_bytes_ -= it->bytes;
+      memory_cache_index_.erase(it->key);
+      it = memory_cache_lru_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void icon_loader::evict_memory_cache() {
+  // Always keep the most recently used entry so that the caller of
+  // store_in_memory gets a live pixbuf even with a tiny budget.
+  while (memory_cache_bytes_ > memory_cache_budget_ &&
+         memory_cache_lru_.size() > 1) {
+    const memory_cache_entry &victim = memory_cache_lru_.back();
+    memory_cache_bytes_ -= victim.bytes;
+    memory_cache_index_.erase(victim.key);
+    memory_cache_lru_.pop_back();
+  }
+}
+
+// Jobs run on a GTask worker thread, so they must only touch the job itself,
+// the thread-safe disk_cache and plain GLib/GdkPixbuf objects.
+struct icon_loader::decode_job {
+  enum mode_type {
+    // Look up the disk cache and decode the entry
+    READ,
+    // Store a downloaded body and decode it unless size is 0
+    STORE,
+    // Update the validators of an entry after 304 Not Modified
+    REFRESH,
+  };
+
+  icon_loader *loader;
+  mode_type mode;
+  std::string url;
+  std::shared_ptr<disk_cache> cache;
+  int size;
+  bool keep_aspect_ratio;
+  GBytes *data;
+  disk_cache::metadata_type metadata;
+
+  // Results
+  std::string cache_path;
+  GdkPixbuf *pixbuf;
+  bool cache_miss;
+  std::string error;
+
+  decode_job(icon_loader *l, mode_type m, const std::string &u,
+             std::shared_ptr<disk_cache> c, int s)
+      : loader(l),
+        mode(m),
+        url(u),
+        cache(c),
+        size(s),
+        keep_aspect_ratio(l->keep_aspect_ratio_),
+        data(nullptr),
+        metadata(),
+        cache_path(),
+        pixbuf(nullptr),
+        cache_miss(false),
+        error() {
+  }
+
+  ~decode_job() {
+    if (data != nullptr) {
+      g_bytes_unref(data);
+    }
+    if (pixbuf != nullptr) {
+      g_object_unref(pixbuf);
+    }
+  }
+};
+
+void icon_loader::start_read(const std::string &url, int size) {
+  start_job(new decode_job(this, decode_job::READ, url, cache_, size));
+}
+
+void icon_loader::start_store(const std::string &url, int size, GBytes *data,
+                              const disk_cache::metadata_type &metadata) {
+  decode_job *job = new decode_job(this, decode_job::STORE, url, cache_, size);
+  job->data = data;
+  job->metadata = metadata;
+  start_job(job);
+}
+
+void icon_loader::start_refresh(const std::string &url,
+                                const disk_cache::metadata_type &metadata) {
+  decode_job *job = new decode_job(this, decode_job::REFRESH, url, cache_, 0);
+  job->metadata = metadata;
+  start_job(job);
+}
+
+void icon_loader::start_job(decode_job *job) {
+  GTask *task = g_task_new(nullptr, nullptr, decode_callback, job);
+  g_task_set_task_data(task, job,
+                       [](gpointer p) { delete static_cast<decode_job *>(p); });
+  g_task_run_in_thread(task, decode_thread);
+  g_object_unref(task);
+}
+
+void icon_loader::decode_thread(GTask *task, gpointer, gpointer task_data,
+                                GCancellable *) {
+  decode_job *job = static_cast<decode_job *>(task_data);
+  GError *error = nullptr;
+
+  switch (job->mode) {
+    case decode_job::READ:
+      job->cache_path = job->cache->lookup(job->url, &job->metadata);
+      if (job->cache_path.empty()) {
+        job->cache_miss = true;
+        break;
+      }
+      job->pixbuf = gdk_pixbuf_new_from_file_at_scale(
+          job->cache_path.c_str(), job->size, job->size,
+          job->keep_aspect_ratio, &error);
+      break;
+    case decode_job::STORE: {
+      gsize length = 0;
+      const gchar *body =
+          static_cast<const gchar *>(g_bytes_get_data(job->data, &length));
+      job->cache->store(job->url, body, length, job->metadata);
+      if (job->size > 0) {
+        GInputStream *stream = g_memory_input_stream_new_from_bytes(job->data);
+        job->pixbuf = gdk_pixbuf_new_from_stream_at_scale(
+            stream, job->size, job->size, job->keep_aspect_ratio, nullptr,
+            &error);
+        g_object_unref(stream);
+      }
+    } break;
+    case decode_job::REFRESH:
+      job->cache->update_metadata(job->url, job->metadata);
+      break;
+  }
+
+  if (error != nullptr) {
+    job->error = error->message;
+    g_error_free(error);
+  }
+  g_task_return_boolean(task, TRUE);
+}
+
+// Called from the main loop
+void icon_loader::decode_callback(GObject *, GAsyncResult *,
+                                  gpointer user_data) {
+  decode_job *job = static_cast<decode_job *>(user_data);
+  job->loader->on_decoded(job);
+}
+
+void icon_loader::on_decoded(decode_job *job) {
+  switch (job->mode) {
+    case decode_job::READ:
+      if (job->cache_miss) {
+        fetch(job->url);
+        return;
+      }
+      if (job->pixbuf == nullptr) {
+        std::cerr << "[icon_loader] cannot load icon from " << job->cache_path
+                  << ": " << job->error << std::endl;
+        // The cache file may be broken; fetch it again.
+        cache_->remove(job->url);
+        fetch(job->url);
+        return;
+      }
+      // Show the cached icon right away even if it's stale, and check for
+      // a newer one in the background.
+      finish_load(job->url, Glib::wrap(job->pixbuf, true));
+      if (job->metadata.is_stale()) {
+        revalidate(job->url, job->metadata);
+      }
+      break;
+    case decode_job::STORE:
+      if (job->size == 0) {
+        break;
+      }
+      if (job->pixbuf == nullptr) {
+        std::cerr << "[icon_loader] cannot load icon from " << job->url << ": "
+                  << job->error << std::endl;
+        finish_load(job->url, Glib::RefPtr<Gdk::Pixbuf>());
+      } else {
+        finish_load(job->url, Glib::wrap(job->pixbuf, true));
+      }
+      break;
+    case decode_job::REFRESH:
+      break;
+  }
+}
+
+void icon_loader::fetch(const std::string &url) {
+  SoupMessage *message = soup_message_new("GET", url.c_str());
+  if (message == nullptr) {
+    std::cerr << "[icon_loader] invalid icon URL " << url << std::endl;
+    finish_load(url, Glib::RefPtr<Gdk::Pixbuf>());
+    return;
+  }
+  queue_message(message, url);
+}
+
+// libsoup may normalize the URI of a message, so keep the URL as requested.
+static const char url_data_key[] = "slack-gtk-icon-url";
+// Set on revalidations. A URL can be fetched and revalidated at the same
+// time, so the role of a response can't be told from its URL.
+static const char revalidation_data_key[] = "slack-gtk-icon-revalidation";
+
+void icon_loader::queue_message(SoupMessage *message, const std::string &url) {
+  g_object_set_data_full(G_OBJECT(message), url_data_key,
+                         g_strdup(url.c_str()), g_free);
+  soup_session_queue_message(session_, message, load_callback, this);
+}
+
+void icon_loader::revalidate(const std::string &url,
+                             const disk_cache::metadata_type &metadata) {
+  if (revalidations_.find(url) != revalidations_.end()) {
+    return;
+  }
+  SoupMessage *message = soup_message_new("GET", url.c_str());
+  if (message == nullptr) {
+    return;
+  }
+  add_conditional_headers(message, metadata);
+  g_object_set_data(G_OBJECT(message), revalidation_data_key,
+                    GINT_TO_POINTER(TRUE));
+  revalidations_.emplace(std::make_pair(url, metadata));
+  queue_message(message, url);
+}
+
+void icon_loader::finish_load(const std::string &url,
+                              Glib::RefPtr<Gdk::Pixbuf> pixbuf) {
+  auto it = url_loads_.find(url);
+  if (it == url_loads_.end()) {
+    return;
+  }
+  // Callbacks may request more icons, so detach them from the registry first.
+  std::vector<pending_load> pendings;
+  for (request_id id : it->second.requests) {
+    auto jt = requests_.find(id);
+    pendings.push_back(jt->second);
+    requests_.erase(jt);
+  }
+  url_loads_.erase(it);
+  --loads_in_flight_;
+
+  if (pixbuf) {
+    for (const pending_load &pending : pendings) {
+      pending.callback(store_in_memory(url, pending.size, pixbuf));
+    }
+  }
+  start_queued_loads();
 }
 
 void icon_loader::load_callback(SoupSession *, SoupMessage *message,
@@ -81,33 +418,46 @@ void icon_loader::load_callback(SoupSession *, SoupMessage *message,
 }
 
 void icon_loader::on_load(SoupMessage *message) {
-  char *uri_c = soup_uri_to_string(soup_message_get_uri(message), FALSE);
-  const std::string uri(uri_c);
-  auto equal_range = load_callback_registry_.equal_range(uri);
+  const std::string uri(static_cast<const char *>(
+      g_object_get_data(G_OBJECT(message), url_data_key)));
+
+  if (g_object_get_data(G_OBJECT(message), revalidation_data_key) !=
+      nullptr) {
+    auto revalidation = revalidations_.find(uri);
+    const disk_cache::metadata_type previous = revalidation->second;
+    revalidations_.erase(revalidation);
+
+    if (message->status_code == SOUP_STATUS_NOT_MODIFIED) {
+      start_refresh(uri, metadata_from_response(message, previous));
+    } else if (SOUP_STATUS_IS_SUCCESSFUL(message->status_code)) {
+      // The icon has changed. Store it without decoding; icons requested
+      // from now on are decoded from the new entry.
+      forget_in_memory(uri);
+      SoupBuffer *buffer = soup_message_body_flatten(message->response_body);
+      start_store(uri, 0, soup_buffer_get_as_bytes(buffer),
+                  metadata_from_response(message, disk_cache::metadata_type()));
+      soup_buffer_free(buffer);
+    } else {
+      std::cerr << "[icon_loader] cannot revalidate " << uri << " ("
+                << message->status_code << ") "
+                << soup_status_get_phrase(message->status_code) << std::endl;
+    }
+    return;
+  }
 
-  if (SOUP_STATUS_IS_TRANSPORT_ERROR(message->status_code)) {
+  auto it = url_loads_.find(uri);
+  if (it == url_loads_.end()) {
+    return;
+  }
+
+  if (!SOUP_STATUS_IS_SUCCESSFUL(message->status_code)) {
     std::cerr << "[icon_loader] " << uri << " (" << message->status_code << ") "
               << soup_status_get_phrase(message->status_code) << std::endl;
+    finish_load(uri, Glib::RefPtr<Gdk::Pixbuf>());
   } else {
-    Glib::RefPtr<Gdk::PixbufLoader> loader = Gdk::PixbufLoader::create();
-    store_cache(uri, message->response_body->data,
-                message->response_body->length);
-    loader->write(
-        reinterpret_cast<const guint8 *>(message->response_body->data),
-        message->response_body->length);
-    loader->close();
-
-    try {
-      Glib::RefPtr<Gdk::Pixbuf> pixbuf = loader->get_pixbuf();
-      for (auto it = equal_range.first; it != equal_range.second; ++it) {
-        (it->second)(pixbuf);
-      }
-    } catch (const Gdk::PixbufError &e) {
-      std::cerr << "[icon_loader] cannot load icon from " << uri << " ("
-                << e.code() << ") " << e.what() << std::endl;
-    }
+    SoupBuffer *buffer = soup_message_body_flatten(message->response_body);
+    start_store(uri, it->second.size, soup_buffer_get_as_bytes(buffer),
+                metadata_from_response(message, disk_cache::metadata_type()));
+    soup_buffer_free(buffer);
   }
-
-  load_callback_registry_.erase(equal_range.first, equal_range.second);
-  g_free(uri_c);
 }
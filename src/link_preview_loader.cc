@@ -0,0 +1,505 @@
+#include "link_preview_loader.h"
+#include <glib.h>
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <initializer_list>
+#include <iostream>
+
+// OpenGraph metadata is in <head>, so the rest of large pages isn't read.
+static const goffset max_page_bytes = 256 * 1024;
+static const std::int64_t preview_lifetime = 24 * 60 * 60;
+// Pages without metadata may get some later, or have failed to load.
+static const std::int64_t missing_preview_lifetime = 60 * 60;
+static const std::size_t max_memory_cache_entries = 1024;
+// Longer descriptions are cut like Slack's own unfurls.
+static const glong max_text_length = 300;
+// Disk cache entries are keyed by URL, and links may well be images too.
+static const char cache_key_prefix[] = "link-preview:";
+static const char url_data_key[] = "slack-gtk-link-url";
+static const char truncated_data_key[] = "slack-gtk-link-truncated";
+static const char alive_data_key[] = "slack-gtk-link-loader-alive";
+
+// Whether the loader that queued message still exists
+static bool loader_alive(SoupMessage* message) {
+  const std::shared_ptr<bool>& alive = *static_cast<std::shared_ptr<bool>*>(
+      g_object_get_data(G_OBJECT(message), alive_data_key));
+  return *alive;
+}
+
+static std::int64_t now_in_seconds() {
+  return g_get_real_time() / G_USEC_PER_SEC;
+}
+
+static std::string lowercase(std::string s) {
+  std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c) {
+    return static_cast<char>(std::tolower(c));
+  });
+  return s;
+}
+
+static void append_utf8(std::string& s, gunichar c) {
+  gchar buffer[6];
+  s.append(buffer, g_unichar_to_utf8(c, buffer));
+}
+
+// Decodes the character references common in metadata.
+static std::string decode_entities(const std::string& s) {
+  static const std::map<std::string, std::string> entities = {
+      {"amp", "&"},   {"lt", "<"},    {"gt", ">"},
+      {"quot", "\""}, {"apos", "'"},  {"nbsp", "\xc2\xa0"},
+  };
+  std::string decoded;
+  std::size_t pos = 0;
+  while (pos < s.size()) {
+    const std::size_t amp = s.find('&', pos);
+    if (amp == std::string::npos) {
+      decoded.append(s, pos, std::string::npos);
+      break;
+    }
+    decoded.append(s, pos, amp - pos);
+    const std::size_t semicolon = s.find(';', amp);
+    if (semicolon == std::string::npos || semicolon - amp > 10) {
+      decoded += '&';
+      pos = amp + 1;
+      continue;
+    }
+    const std::string name = s.substr(amp + 1, semicolon - amp - 1);
+    if (name.size() > 1 && name[0] == '#') {
+      const bool hex = name[1] == 'x' || name[1] == 'X';
+      const gunichar c = static_cast<gunichar>(
+          std::strtoul(name.c_str() + (hex ? 2 : 1), nullptr, hex ? 16 : 10));
+      if (g_unichar_validate(c) && c != 0) {
+        append_utf8(decoded, c);
+      }
+    } else {
+      auto it = entities.find(lowercase(name));
+      decoded += it == entities.end() ? "&" + name + ";" : it->second;
+    }
+    pos = semicolon + 1;
+  }
+  return decoded;
+}
+
+// Parses the attributes of a tag, given the text between its name and '>'.
+// Names are lowercased.
+static std::map<std::string, std::string> parse_attributes(
+    const std::string& tag) {
+  std::map<std::string, std::string> attributes;
+  std::size_t pos = 0;
+  while (pos < tag.size()) {
+    if (std::isspace(static_cast<unsigned char>(tag[pos])) || tag[pos] == '/') {
+      ++pos;
+      continue;
+    }
+    const std::size_t name_end = tag.find_first_of("= \t\r\n/", pos);
+    const std::string name = lowercase(tag.substr(pos, name_end - pos));
+    pos = name_end;
+    if (pos == std::string::npos || tag[pos] != '=') {
+      attributes.emplace(name, "");
+      continue;
+    }
+    ++pos;
+    std::size_t value_end;
+    if (pos < tag.size() && (tag[pos] == '"' || tag[pos] == '\'')) {
+      value_end = tag.find(tag[pos], pos + 1);
+      ++pos;
+    } else {
+      value_end = tag.find_first_of(" \t\r\n", pos);
+    }
+    attributes.emplace(name, decode_entities(tag.substr(pos, value_end - pos)));
+    pos = value_end == std::string::npos ? value_end : value_end + 1;
+  }
+  return attributes;
+}
+
+static std::string first_of(const std::map<std::string, std::string>& values,
+                            std::initializer_list<const char*> keys) {
+  for (const char* key : keys) {
+    auto it = values.find(key);
+    if (it != values.end() && !it->second.empty()) {
+      return it->second;
+    }
+  }
+  return std::string();
+}
+
+static std::string escape_mrkdwn(const std::string& text) {
+  std::string escaped;
+  for (char c : text) {
+    switch (c) {
+      case '&':
+        escaped += "&amp;";
+        break;
+      case '<':
+        escaped += "&lt;";
+        break;
+      case '>':
+        escaped += "&gt;";
+        break;
+      default:
+        escaped += c;
+    }
+  }
+  return escaped;
+}
+
+// Builds an attachment from the OpenGraph (or Twitter card, or plain HTML)
+// metadata in the head of html. Returns null if there is none.
+static Json::Value parse_metadata(const std::string& url,
+                                  const std::string& html) {
+  std::map<std::string, std::string> properties;
+  std::string title_element;
+  std::size_t pos = 0;
+  while ((pos = html.find('<', pos)) != std::string::npos) {
+    const std::size_t end = html.find('>', pos);
+    if (end == std::string::npos) {
+      break;
+    }
+    const std::size_t name_end = html.find_first_of(" \t\r\n/>", pos + 1);
+    const std::string name =
+        lowercase(html.substr(pos + 1, std::min(name_end, end) - pos - 1));
+    if (name == "meta") {
+      std::map<std::string, std::string> attributes =
+          parse_attributes(html.substr(name_end, end - name_end));
+      const std::string key =
+          lowercase(first_of(attributes, {"property", "name"}));
+      if (!key.empty()) {
+        // The first one wins, as with multiple og:image.
+        properties.emplace(key, attributes["content"]);
+      }
+    } else if (name == "title" && title_element.empty()) {
+      const std::size_t close = html.find('<', end);
+      if (close != std::string::npos) {
+        title_element = decode_entities(html.substr(end + 1, close - end - 1));
+      }
+    } else if (name == "body" || name == "/head") {
+      break;
+    }
+    pos = end + 1;
+  }
+
+  std::string title = first_of(properties, {"og:title", "twitter:title"});
+  if (title.empty()) {
+    title = title_element;
+  }
+  std::string text = first_of(
+      properties, {"og:description", "twitter:description", "description"});
+  if (!g_utf8_validate(title.c_str(), title.size(), nullptr) ||
+      !g_utf8_validate(text.c_str(), text.size(), nullptr)) {
+    // Only UTF-8 pages are supported.
+    return Json::Value();
+  }
+  gchar* stripped = g_strstrip(g_strdup(title.c_str()));
+  title = stripped;
+  g_free(stripped);
+  if (title.empty() && text.empty()) {
+    return Json::Value();
+  }
+  if (g_utf8_strlen(text.c_str(), -1) > max_text_length) {
+    gchar* cut = g_utf8_substring(text.c_str(), 0, max_text_length);
+    text = std::string(cut) + "\xe2\x80\xa6";
+    g_free(cut);
+  }
+
+  SoupURI* base = soup_uri_new(url.c_str());
+  Json::Value attachment(Json::objectValue);
+  attachment["from_url"] = url;
+  attachment["fallback"] = title.empty() ? url : title;
+  attachment["title"] = title;
+  attachment["title_link"] = url;
+  attachment["text"] = escape_mrkdwn(text);
+  std::string service_name = first_of(properties, {"og:site_name"});
+  if (service_name.empty() && base != nullptr) {
+    service_name = soup_uri_get_host(base);
+  }
+  attachment["service_name"] = service_name;
+  const std::string image =
+      first_of(properties, {"og:image", "og:image:url", "twitter:image"});
+  if (!image.empty() && base != nullptr) {
+    // Images may be relative to the page.
+    SoupURI* image_uri = soup_uri_new_with_base(base, image.c_str());
+    if (image_uri != nullptr) {
+      gchar* image_url = soup_uri_to_string(image_uri, FALSE);
+      attachment["thumb_url"] = image_url;
+      g_free(image_url);
+      soup_uri_free(image_uri);
+    }
+  }
+  if (base != nullptr) {
+    soup_uri_free(base);
+  }
+  return attachment;
+}
+
+// Jobs run on a GTask worker thread, so they must only touch the job itself,
+// the thread-safe disk_cache and plain GLib objects.
+struct link_preview_loader::parse_job {
+  enum mode_type {
+    // Look up the disk cache
+    READ,
+    // Parse a downloaded page and store the result
+    PARSE,
+  };
+
+  link_preview_loader* loader;
+  // false once the loader is destroyed
+  std::shared_ptr<bool> alive;
+  mode_type mode;
+  std::string url;
+  std::shared_ptr<disk_cache> cache;
+  std::string html;
+
+  // Results
+  Json::Value attachment;
+  std::int64_t expires;
+  bool cache_miss;
+
+  parse_job(link_preview_loader* l, std::shared_ptr<bool> a, mode_type m,
+            const std::string& u, std::shared_ptr<disk_cache> c)
+      : loader(l),
+        alive(a),
+        mode(m),
+        url(u),
+        cache(c),
+        html(),
+        attachment(),
+        expires(0),
+        cache_miss(false) {
+  }
+};
+
+link_preview_loader::link_preview_loader(std::shared_ptr<disk_cache> cache)
+    : cache_(cache),
+      session_(soup_session_new_with_options(
+          SOUP_SESSION_USER_AGENT, "slack-gtk ", SOUP_SESSION_TIMEOUT, 30,
+          nullptr)),
+      requests_(),
+      url_loads_(),
+      next_request_id_(1),
+      memory_cache_(),
+      alive_(std::make_shared<bool>(true)) {
+}
+
+link_preview_loader::~link_preview_loader() {
+  // Queued messages and parse jobs may still call back.
+  *alive_ = false;
+  soup_session_abort(session_);
+  g_object_unref(session_);
+}
+
+link_preview_loader::request_id link_preview_loader::load(
+    const std::string& url, const load_callback_type& callback) {
+  auto cached = memory_cache_.find(url);
+  if (cached != memory_cache_.end()) {
+    if (cached->second.expires > now_in_seconds()) {
+      if (!cached->second.attachment.isNull()) {
+        callback(cached->second.attachment);
+      }
+      return 0;
+    }
+    memory_cache_.erase(cached);
+  }
+
+  const request_id id = next_request_id_++;
+  const pending_load pending = {url, callback};
+  requests_.emplace(std::make_pair(id, pending));
+
+  auto load = url_loads_.emplace(url, std::vector<request_id>());
+  load.first->second.push_back(id);
+  if (load.second) {
+    start_job(new parse_job(this, alive_, parse_job::READ, url, cache_));
+  }
+  return id;
+}
+
+void link_preview_loader::cancel(request_id id) {
+  auto it = requests_.find(id);
+  if (it == requests_.end()) {
+    return;
+  }
+  // The load is left running; the result still ends up in the memory cache.
+  auto jt = url_loads_.find(it->second.url);
+  if (jt != url_loads_.end()) {
+    jt->second.erase(std::remove(jt->second.begin(), jt->second.end(), id),
+                     jt->second.end());
+  }
+  requests_.erase(it);
+}
+
+void link_preview_loader::start_job(parse_job* job) {
+  GTask* task = g_task_new(nullptr, nullptr, parse_callback, job);
+  g_task_set_task_data(task, job,
+                       [](gpointer p) { delete static_cast<parse_job*>(p); });
+  g_task_run_in_thread(task, parse_thread);
+  g_object_unref(task);
+}
+
+void link_preview_loader::parse_thread(GTask* task, gpointer,
+                                       gpointer task_data, GCancellable*) {
+  parse_job* job = static_cast<parse_job*>(task_data);
+  const std::string key = cache_key_prefix + job->url;
+
+  switch (job->mode) {
+    case parse_job::READ: {
+      disk_cache::metadata_type metadata;
+      const std::string path = job->cache->lookup(key, &metadata);
+      gchar* contents = nullptr;
+      gsize length = 0;
+      Json::Reader reader;
+      if (path.empty() || metadata.is_stale() ||
+          !g_file_get_contents(path.c_str(), &contents, &length, nullptr) ||
+          !reader.parse(contents, contents + length, job->attachment)) {
+        job->cache_miss = true;
+      }
+      job->expires = metadata.expires;
+      g_free(contents);
+    } break;
+    case parse_job::PARSE: {
+      job->attachment = parse_metadata(job->url, job->html);
+      disk_cache::metadata_type metadata;
+      metadata.expires = now_in_seconds() + (job->attachment.isNull()
+                                                 ? missing_preview_lifetime
+                                                 : preview_lifetime);
+      job->expires = metadata.expires;
+      const std::string serialized =
+          Json::FastWriter().write(job->attachment);
+      job->cache->store(key, serialized.data(), serialized.size(), metadata);
+    } break;
+  }
+  g_task_return_boolean(task, TRUE);
+}
+
+// Called from the main loop
+void link_preview_loader::parse_callback(GObject*, GAsyncResult*,
+                                         gpointer user_data) {
+  parse_job* job = static_cast<parse_job*>(user_data);
+  if (*job->alive) {
+    job->loader->on_parsed(job);
+  }
+}
+
+void link_preview_loader::on_parsed(parse_job* job) {
+  if (job->cache_miss) {
+    fetch(job->url);
+  } else {
+    finish_load(job->url, job->attachment, job->expires);
+  }
+}
+
+void link_preview_loader::fetch(const std::string& url) {
+  SoupMessage* message = soup_message_new("GET", url.c_str());
+  if (message == nullptr) {
+    std::cerr << "[link_preview_loader] invalid URL " << url << std::endl;
+    finish_load(url, Json::Value(), 0);
+    return;
+  }
+  soup_message_headers_append(message->request_headers, "Accept",
+                              "text/html,application/xhtml+xml");
+  // libsoup may normalize the URI of a message, so keep the URL as requested.
+  g_object_set_data_full(G_OBJECT(message), url_data_key,
+                         g_strdup(url.c_str()), g_free);
+  g_object_set_data_full(
+      G_OBJECT(message), alive_data_key, new std::shared_ptr<bool>(alive_),
+      [](gpointer p) { delete static_cast<std::shared_ptr<bool>*>(p); });
+  g_signal_connect(message, "got-headers", G_CALLBACK(got_headers_callback),
+                   this);
+  g_signal_connect(message, "got-chunk", G_CALLBACK(got_chunk_callback), this);
+  soup_session_queue_message(session_, message, load_callback, this);
+}
+
+// Links to images, videos and the like have no metadata; don't download
+// them.
+void link_preview_loader::got_headers_callback(SoupMessage* message,
+                                               gpointer user_data) {
+  if (!loader_alive(message) ||
+      !SOUP_STATUS_IS_SUCCESSFUL(message->status_code)) {
+    return;
+  }
+  const char* content_type =
+      soup_message_headers_get_content_type(message->response_headers, nullptr);
+  const std::string type = lowercase(content_type ? content_type : "");
+  if (type != "text/html" && type != "application/xhtml+xml") {
+    link_preview_loader* loader = static_cast<link_preview_loader*>(user_data);
+    soup_session_cancel_message(loader->session_, message,
+                                SOUP_STATUS_CANCELLED);
+  }
+}
+
+void link_preview_loader::got_chunk_callback(SoupMessage* message,
+                                             SoupBuffer*, gpointer user_data) {
+  if (!loader_alive(message) ||
+      message->response_body->length < max_page_bytes) {
+    return;
+  }
+  g_object_set_data(G_OBJECT(message), truncated_data_key,
+                    GINT_TO_POINTER(TRUE));
+  link_preview_loader* loader = static_cast<link_preview_loader*>(user_data);
+  soup_session_cancel_message(loader->session_, message,
+                              SOUP_STATUS_CANCELLED);
+}
+
+void link_preview_loader::load_callback(SoupSession*, SoupMessage* message,
+                                        gpointer user_data) {
+  if (loader_alive(message)) {
+    static_cast<link_preview_loader*>(user_data)->on_load(message);
+  }
+}
+
+void link_preview_loader::on_load(SoupMessage* message) {
+  const std::string url(static_cast<const char*>(
+      g_object_get_data(G_OBJECT(message), url_data_key)));
+  const bool truncated =
+      g_object_get_data(G_OBJECT(message), truncated_data_key) != nullptr;
+
+  if (SOUP_STATUS_IS_TRANSPORT_ERROR(message->status_code) && !truncated &&
+      message->status_code != SOUP_STATUS_CANCELLED) {
+    // Don't remember network errors.
+    std::cerr << "[link_preview_loader] " << url << " ("
+              << message->status_code << ") "
+              << soup_status_get_phrase(message->status_code) << std::endl;
+    finish_load(url, Json::Value(), 0);
+    return;
+  }
+
+  // Anything else, including non-HTML responses, is parsed (into nothing
+  // if need be) and remembered so that it isn't fetched again soon.
+  parse_job* job = new parse_job(this, alive_, parse_job::PARSE, url, cache_);
+  if (truncated || SOUP_STATUS_IS_SUCCESSFUL(message->status_code)) {
+    job->html.assign(message->response_body->data,
+                     message->response_body->length);
+  }
+  start_job(job);
+}
+
+void link_preview_loader::finish_load(const std::string& url,
+                                      const Json::Value& attachment,
+                                      std::int64_t expires) {
+  if (expires != 0) {
+    if (memory_cache_.size() >= max_memory_cache_entries) {
+      memory_cache_.clear();
+    }
+    const cached_preview cached = {attachment, expires};
+    memory_cache_[url] = cached;
+  }
+
+  auto it = url_loads_.find(url);
+  if (it == url_loads_.end()) {
+    return;
+  }
+  // Callbacks may request more previews, so detach them from the registry
+  // first.
+  std::vector<pending_load> pendings;
+  for (request_id id : it->second) {
+    auto jt = requests_.find(id);
+    pendings.push_back(jt->second);
+    requests_.erase(jt);
+  }
+  url_loads_.erase(it);
+
+  if (!attachment.isNull()) {
+    for (const pending_load& pending : pendings) {
+      pending.callback(attachment);
+    }
+  }
+}
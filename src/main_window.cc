@@ -3,15 +3,22 @@
 #include <iostream>
 #include "api_client.h"
 #include "channels_store.h"
+#include "disk_cache.h"
 #include "emoji_loader.h"
+#include "highlight_matcher.h"
+#include "icon_loader.h"
+#include "read_marker_manager.h"
 #include "rtm_client.h"
 #include "users_store.h"
 
 MainWindow::MainWindow(std::shared_ptr<api_client> api_client,
                        const std::string& emoji_directory,
                        const Json::Value& json)
-    : settings_(Gio::Settings::create("cc.wanko.slack-gtk")),
-      team_(api_client, emoji_directory, json) {
+    : settings_(std::make_shared<settings_snapshot>(
+          Gio::Settings::create("cc.wanko.slack-gtk"))),
+      team_(api_client, emoji_directory, json),
+      history_prefetcher_(api_client),
+      notification_manager_(settings_) {
   Gtk::Box* box = Gtk::manage(new Gtk::Box(Gtk::ORIENTATION_HORIZONTAL));
   add(*box);
 
@@ -21,7 +28,11 @@ MainWindow::MainWindow(std::shared_ptr<api_client> api_client,
 
   channels_sidebar->set_stack(channels_stack_);
 
-  get_screen()->set_resolution(settings_->get_double("dpi"));
+  get_screen()->set_resolution(settings_->dpi());
+  on_settings_changed("image-cache-size");
+  on_settings_changed("highlight-words");
+  settings_->signal_changed().connect(
+      sigc::mem_fun(*this, &MainWindow::on_settings_changed));
 
   team_.rtm_client_->hello_signal().connect(
       sigc::mem_fun(*this, &MainWindow::on_hello_signal));
@@ -43,11 +54,19 @@ MainWindow::MainWindow(std::shared_ptr<api_client> api_client,
       sigc::mem_fun(*this, &MainWindow::on_user_typing_signal));
   team_.rtm_client_->emoji_changed_signal().connect(
       sigc::mem_fun(*this, &MainWindow::on_emoji_changed_signal));
+  team_.rtm_client_->reaction_added_signal().connect(
+      sigc::mem_fun(*this, &MainWindow::on_reaction_added_signal));
+  team_.rtm_client_->reaction_removed_signal().connect(
+      sigc::mem_fun(*this, &MainWindow::on_reaction_removed_signal));
+  team_.emoji_loader_->signal_custom_emoji_loaded().connect(
+      sigc::mem_fun(*this, &MainWindow::on_custom_emoji_loaded));
 
   channels_stack_.signal_add().connect(
       sigc::mem_fun(*this, &MainWindow::on_channel_added));
   channels_stack_.property_visible_child().signal_changed().connect(
       sigc::mem_fun(*this, &MainWindow::on_visible_channel_changed));
+  property_is_active().signal_changed().connect(
+      sigc::mem_fun(*this, &MainWindow::on_active_changed));
   for (const auto& p : team_.channels_store_->data()) {
     const channel& chan = p.second;
     if (chan.is_member) {
@@ -62,6 +81,32 @@ MainWindow::MainWindow(std::shared_ptr<api_client> api_client,
 }
 
 MainWindow::~MainWindow() {
+  redraw_messages_idle_.disconnect();
+  team_.read_marker_manager_->flush();
+  // Rows cancel their loads through team_ when they're destroyed, so the
+  // channels must go before the members.
+  for (Widget* widget : channels_stack_.get_children()) {
+    history_prefetcher_.remove(static_cast<ChannelWindow*>(widget));
+    channels_stack_.remove(*widget);
+    delete widget;
+  }
+}
+
+void MainWindow::on_settings_changed(const std::string& key) {
+  if (key == "dpi") {
+    get_screen()->set_resolution(settings_->dpi());
+  } else if (key == "user-icon-size") {
+    team_.icon_loader_->clear_memory_cache();
+    rescale_images();
+  } else if (key == "emoji-size") {
+    team_.emoji_loader_->clear_scaled();
+    rescale_images();
+  } else if (key == "image-cache-size") {
+    team_.disk_cache_->set_max_bytes(
+        std::uint64_t(settings_->image_cache_size()) * 1024 * 1024);
+  } else if (key == "highlight-words") {
+    team_.highlight_matcher_->set_keywords(settings_->highlight_words());
+  }
 }
 
 void MainWindow::on_hello_signal(const Json::Value&) {
@@ -103,6 +148,30 @@ void MainWindow::on_message_signal(const Json::Value& payload) {
   }
 }
 
+void MainWindow::on_reaction_added_signal(const Json::Value& payload) {
+  const Json::Value& item = payload["item"];
+  if (item["type"].asString() != "message") {
+    return;
+  }
+  Widget* widget =
+      channels_stack_.get_child_by_name(item["channel"].asString());
+  if (widget != nullptr) {
+    static_cast<ChannelWindow*>(widget)->on_reaction_added(payload);
+  }
+}
+
+void MainWindow::on_reaction_removed_signal(const Json::Value& payload) {
+  const Json::Value& item = payload["item"];
+  if (item["type"].asString() != "message") {
+    return;
+  }
+  Widget* widget =
+      channels_stack_.get_child_by_name(item["channel"].asString());
+  if (widget != nullptr) {
+    static_cast<ChannelWindow*>(widget)->on_reaction_removed(payload);
+  }
+}
+
 void MainWindow::on_channel_marked_signal(const Json::Value& payload) {
   const std::string channel_id = payload["channel"].asString();
   Widget* widget = channels_stack_.get_child_by_name(channel_id);
@@ -171,6 +240,8 @@ void MainWindow::on_channel_left_signal(const Json::Value& payload) {
                  "ChannelWindow with id="
               << channel_id << std::endl;
   } else {
+    history_prefetcher_.remove(static_cast<ChannelWindow*>(widget));
+    notification_manager_.dismiss(channel_id);
     channels_stack_.remove(*widget);
     delete widget;
   }
@@ -218,10 +289,13 @@ ChannelWindow* MainWindow::add_channel_window(const channel& chan) {
   auto w = Gtk::manage(new ChannelWindow(team_, settings_, chan));
   w->channel_link_signal().connect(
       sigc::mem_fun(*this, &MainWindow::on_channel_link_clicked));
+  w->notification_signal().connect(sigc::bind(
+      sigc::mem_fun(*this, &MainWindow::on_channel_notification), chan.id));
   w->property_unread_count().signal_changed().connect(sigc::bind(
       sigc::mem_fun(*this, &MainWindow::on_channel_unread_count_changed),
       chan.id));
   channels_stack_.add(*w, w->id(), build_channel_title(*w));
+  history_prefetcher_.add(w);
   return w;
 }
 
@@ -246,6 +320,37 @@ void MainWindow::on_visible_channel_changed() {
   if (widget != nullptr) {
     static_cast<ChannelWindow*>(widget)->on_channel_visible();
   }
+  on_active_changed();
+}
+
+// The notification of a channel is stale once the user looks at it.
+void MainWindow::on_active_changed() {
+  ChannelWindow* window = focused_channel();
+  if (window != nullptr) {
+    notification_manager_.dismiss(window->id());
+  }
+}
+
+void MainWindow::on_channel_notification(const std::string& summary,
+                                         const std::string& channel_id) {
+  ChannelWindow* window = focused_channel();
+  if (window != nullptr && window->id() == channel_id) {
+    // The user sees the message already.
+    return;
+  }
+  Widget* widget = channels_stack_.get_child_by_name(channel_id);
+  if (widget == nullptr) {
+    return;
+  }
+  notification_manager_.notify(
+      channel_id, static_cast<ChannelWindow*>(widget)->name(), summary);
+}
+
+ChannelWindow* MainWindow::focused_channel() {
+  if (!is_active()) {
+    return nullptr;
+  }
+  return static_cast<ChannelWindow*>(channels_stack_.get_visible_child());
 }
 
 void MainWindow::request_update_emoji() {
@@ -258,10 +363,11 @@ void MainWindow::emoji_list_finished(
     const boost::optional<Json::Value>& result) {
   if (result) {
     const Json::Value emojis = result.get()["emoji"];
+    std::map<std::string, std::string> urls;
     for (const std::string key : emojis.getMemberNames()) {
-      const std::string val = emojis[key].asString();
-      team_.emoji_loader_->add_custom_emoji(key, val);
+      urls[key] = emojis[key].asString();
     }
+    team_.emoji_loader_->add_custom_emojis(urls);
     redraw_messages();
   } else {
     std::cerr << "[MainWindow] failed to get custom emoji list" << std::endl;
@@ -287,7 +393,28 @@ void MainWindow::on_emoji_changed_signal(const Json::Value& payload) {
 }
 
 void MainWindow::redraw_messages() {
+  // Hidden channels are redrawn when they are shown.
   for (Widget* widget : channels_stack_.get_children()) {
-    static_cast<ChannelWindow*>(widget)->redraw_messages();
+    static_cast<ChannelWindow*>(widget)->invalidate_messages();
   }
 }
+
+void MainWindow::rescale_images() {
+  // Hidden channels are rescaled when they are shown.
+  for (Widget* widget : channels_stack_.get_children()) {
+    static_cast<ChannelWindow*>(widget)->invalidate_images();
+  }
+}
+
+void MainWindow::on_custom_emoji_loaded(const std::string&) {
+  // Emojis tend to arrive in bursts; redraw once for all of them.
+  if (!redraw_messages_idle_.connected()) {
+    redraw_messages_idle_ = Glib::signal_idle().connect(
+        sigc::mem_fun(*this, &MainWindow::on_redraw_messages_idle));
+  }
+}
+
+bool MainWindow::on_redraw_messages_idle() {
+  redraw_messages();
+  return false;
+}
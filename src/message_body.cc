@@ -0,0 +1,307 @@
+#include "message_body.h"
+#include <gdk/gdk.h>
+#include <pango/pangocairo.h>
+#include <algorithm>
+
+// Draws an emoji at the position Pango reserved for its shape attribute.
+static void render_emoji(cairo_t* cr, PangoAttrShape* attr, gboolean do_path,
+                         gpointer) {
+  if (do_path) {
+    return;
+  }
+  double x, y;
+  cairo_get_current_point(cr, &x, &y);
+  cairo_save(cr);
+  gdk_cairo_set_source_pixbuf(
+      cr, static_cast<GdkPixbuf*>(attr->data), x,
+      y + static_cast<double>(attr->logical_rect.y) / PANGO_SCALE);
+  cairo_paint(cr);
+  cairo_restore(cr);
+}
+
+static gpointer copy_pixbuf(gconstpointer pixbuf) {
+  return g_object_ref(const_cast<gpointer>(pixbuf));
+}
+
+static PangoAttribute* create_foreground_attribute(const char* spec) {
+  PangoColor color;
+  pango_color_parse(&color, spec);
+  return pango_attr_foreground_new(color.red, color.green, color.blue);
+}
+
+static void insert_attribute(PangoAttrList* attrs, PangoAttribute* attr,
+                             std::size_t start, std::size_t end) {
+  attr->start_index = start;
+  attr->end_index = end;
+  pango_attr_list_insert(attrs, attr);
+}
+
+MessageBody::MessageBody()
+    : text_(nullptr),
+      layout_(),
+      natural_width_(0),
+      pressed_(false),
+      press_x_(0),
+      press_y_(0),
+      hovering_link_(false) {
+  add_events(Gdk::BUTTON_PRESS_MASK | Gdk::BUTTON_RELEASE_MASK |
+             Gdk::POINTER_MOTION_MASK);
+  pango_cairo_context_set_shape_renderer(get_pango_context()->gobj(),
+                                         render_emoji, nullptr, nullptr);
+}
+
+MessageBody::~MessageBody() {
+}
+
+void MessageBody::set_rich_text(const rich_text& text) {
+  text_ = &text;
+  pressed_ = false;
+  update_layout();
+  queue_resize();
+}
+
+void MessageBody::update_layout() {
+  layout_ = create_pango_layout(text_->text);
+  layout_->set_wrap(Pango::WRAP_WORD_CHAR);
+
+  PangoAttrList* attrs = pango_attr_list_new();
+  for (const rich_text::span& span : text_->spans) {
+    switch (span.style) {
+      case rich_text::STYLE_INFO_MESSAGE:
+        insert_attribute(attrs,
+                         pango_attr_foreground_new(0x8080, 0x8080, 0x8080),
+                         span.start, span.end);
+        break;
+      case rich_text::STYLE_LINK:
+        insert_attribute(attrs, pango_attr_foreground_new(0, 0, 0xffff),
+                         span.start, span.end);
+        insert_attribute(attrs,
+                         pango_attr_underline_new(PANGO_UNDERLINE_SINGLE),
+                         span.start, span.end);
+        break;
+      case rich_text::STYLE_BOLD:
+        insert_attribute(attrs, pango_attr_weight_new(PANGO_WEIGHT_BOLD),
+                         span.start, span.end);
+        break;
+      case rich_text::STYLE_ITALIC:
+        insert_attribute(attrs, pango_attr_style_new(PANGO_STYLE_ITALIC),
+                         span.start, span.end);
+        break;
+      case rich_text::STYLE_STRIKE:
+        insert_attribute(attrs, pango_attr_strikethrough_new(TRUE), span.start,
+                         span.end);
+        break;
+      case rich_text::STYLE_CODE:
+      case rich_text::STYLE_PRE:
+        insert_attribute(attrs, pango_attr_family_new("monospace"), span.start,
+                         span.end);
+        insert_attribute(attrs,
+                         pango_attr_background_new(0xf0f0, 0xf0f0, 0xf0f0),
+                         span.start, span.end);
+        break;
+      case rich_text::STYLE_QUOTE:
+        insert_attribute(attrs,
+                         pango_attr_foreground_new(0x6060, 0x6060, 0x6060),
+                         span.start, span.end);
+        break;
+      case rich_text::STYLE_CODE_KEYWORD:
+        insert_attribute(attrs, create_foreground_attribute("#0033b3"),
+                         span.start, span.end);
+        insert_attribute(attrs, pango_attr_weight_new(PANGO_WEIGHT_BOLD),
+                         span.start, span.end);
+        break;
+      case rich_text::STYLE_CODE_STRING:
+        insert_attribute(attrs, create_foreground_attribute("#067d17"),
+                         span.start, span.end);
+        break;
+      case rich_text::STYLE_CODE_COMMENT:
+        insert_attribute(attrs, create_foreground_attribute("#8c8c8c"),
+                         span.start, span.end);
+        insert_attribute(attrs, pango_attr_style_new(PANGO_STYLE_ITALIC),
+                         span.start, span.end);
+        break;
+      case rich_text::STYLE_CODE_NUMBER:
+        insert_attribute(attrs, create_foreground_attribute("#1750eb"),
+                         span.start, span.end);
+        break;
+      case rich_text::STYLE_DIFF_ADDED:
+        insert_attribute(attrs, create_foreground_attribute("#22863a"),
+                         span.start, span.end);
+        break;
+      case rich_text::STYLE_DIFF_REMOVED:
+        insert_attribute(attrs, create_foreground_attribute("#b31d28"),
+                         span.start, span.end);
+        break;
+      case rich_text::STYLE_DIFF_HEADER:
+        insert_attribute(attrs, create_foreground_attribute("#6f42c1"),
+                         span.start, span.end);
+        break;
+    }
+  }
+  for (const rich_text::emoji& emoji : text_->emojis) {
+    const int width = emoji.pixbuf->get_width() * PANGO_SCALE;
+    const int height = emoji.pixbuf->get_height() * PANGO_SCALE;
+    // Slightly below the baseline, like glyphs of the same height
+    PangoRectangle rect = {0, -height * 4 / 5, width, height};
+    PangoAttribute* attr = pango_attr_shape_new_with_data(
+        &rect, &rect, g_object_ref(emoji.pixbuf->gobj()), copy_pixbuf,
+        g_object_unref);
+    // The replacement character is 3 bytes long in UTF-8.
+    insert_attribute(attrs, attr, emoji.index, emoji.index + 3);
+  }
+  pango_layout_set_attributes(layout_->gobj(), attrs);
+  pango_attr_list_unref(attrs);
+
+  int height;
+  layout_->get_pixel_size(natural_width_, height);
+}
+
+sigc::signal<void, const rich_text::link&> MessageBody::signal_link_clicked() {
+  return signal_link_clicked_;
+}
+
+sigc::signal<void, std::size_t, std::size_t>
+MessageBody::signal_selection_started() {
+  return signal_selection_started_;
+}
+
+Gtk::SizeRequestMode MessageBody::get_request_mode_vfunc() const {
+  return Gtk::SIZE_REQUEST_HEIGHT_FOR_WIDTH;
+}
+
+void MessageBody::get_preferred_width_vfunc(int& minimum_width,
+                                            int& natural_width) const {
+  // Wraps anywhere if needed
+  minimum_width = 0;
+  natural_width = natural_width_;
+}
+
+void MessageBody::get_preferred_height_for_width_vfunc(
+    int width, int& minimum_height, int& natural_height) const {
+  if (!layout_) {
+    minimum_height = natural_height = 0;
+    return;
+  }
+  // Pango keeps the lines until the width changes, so asking again for the
+  // allocated width is cheap.
+  layout_->set_width(width * PANGO_SCALE);
+  int layout_width;
+  layout_->get_pixel_size(layout_width, minimum_height);
+  natural_height = minimum_height;
+}
+
+void MessageBody::get_preferred_height_vfunc(int& minimum_height,
+                                             int& natural_height) const {
+  get_preferred_height_for_width_vfunc(natural_width_, minimum_height,
+                                       natural_height);
+}
+
+void MessageBody::get_preferred_width_for_height_vfunc(
+    int, int& minimum_width, int& natural_width) const {
+  get_preferred_width_vfunc(minimum_width, natural_width);
+}
+
+void MessageBody::on_size_allocate(Gtk::Allocation& allocation) {
+  Gtk::DrawingArea::on_size_allocate(allocation);
+  if (layout_) {
+    layout_->set_width(allocation.get_width() * PANGO_SCALE);
+  }
+}
+
+void MessageBody::on_style_updated() {
+  Gtk::DrawingArea::on_style_updated();
+  if (text_ != nullptr) {
+    // The font may have changed.
+    update_layout();
+    queue_resize();
+  }
+}
+
+bool MessageBody::on_draw(const Cairo::RefPtr<Cairo::Context>& cr) {
+  if (layout_) {
+    get_style_context()->render_layout(cr, 0, 0, layout_);
+  }
+  return true;
+}
+
+bool MessageBody::index_at(double x, double y, std::size_t& index) const {
+  if (!layout_) {
+    return false;
+  }
+  int i, trailing;
+  if (!layout_->xy_to_index(x * PANGO_SCALE, y * PANGO_SCALE, i, trailing)) {
+    return false;
+  }
+  index = i;
+  return true;
+}
+
+std::size_t MessageBody::nearest_index_at(double x, double y) const {
+  int i, trailing;
+  layout_->xy_to_index(x * PANGO_SCALE, y * PANGO_SCALE, i, trailing);
+  const char* text = text_->text.c_str();
+  const char* p = text + i;
+  for (; trailing > 0 && *p != '\0'; --trailing) {
+    p = g_utf8_next_char(p);
+  }
+  return p - text;
+}
+
+bool MessageBody::on_button_press_event(GdkEventButton* event) {
+  if (event->type == GDK_BUTTON_PRESS && event->button == GDK_BUTTON_PRIMARY) {
+    pressed_ = true;
+    press_x_ = event->x;
+    press_y_ = event->y;
+  }
+  return false;
+}
+
+bool MessageBody::on_button_release_event(GdkEventButton* event) {
+  if (!pressed_ || event->button != GDK_BUTTON_PRIMARY) {
+    return false;
+  }
+  pressed_ = false;
+
+  std::size_t index;
+  if (index_at(event->x, event->y, index)) {
+    const rich_text::link* link = text_->find_link(index);
+    if (link != nullptr) {
+      signal_link_clicked_.emit(*link);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool MessageBody::on_motion_notify_event(GdkEventMotion* event) {
+  if (pressed_) {
+    if ((event->state & GDK_BUTTON1_MASK) &&
+        drag_check_threshold(press_x_, press_y_, event->x, event->y)) {
+      pressed_ = false;
+      const std::size_t start = nearest_index_at(press_x_, press_y_);
+      const std::size_t end = nearest_index_at(event->x, event->y);
+      signal_selection_started_.emit(std::min(start, end),
+                                     std::max(start, end));
+      // The owner has replaced this widget with a text view by now.
+      return true;
+    }
+    return false;
+  }
+
+  std::size_t index;
+  const bool hovering =
+      index_at(event->x, event->y, index) && text_->find_link(index) != nullptr;
+  if (hovering != hovering_link_) {
+    hovering_link_ = hovering;
+    Glib::RefPtr<Gdk::Window> window = get_window();
+    if (hovering) {
+      if (!pointer_cursor_) {
+        pointer_cursor_ = Gdk::Cursor::create(window->get_display(), "pointer");
+      }
+      window->set_cursor(pointer_cursor_);
+    } else {
+      window->set_cursor();
+    }
+  }
+  return false;
+}
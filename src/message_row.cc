@@ -1,49 +1,86 @@
 #include "message_row.h"
 #include <gdkmm/pixbufloader.h>
 #include <glibmm/datetime.h>
+#include <glibmm/timeval.h>
 #include <gtkmm/stock.h>
 #include <libsoup/soup-uri.h>
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <set>
 #include "attachments_view.h"
-#include "icon_loader.h"
+#include "file_preview.h"
+#include "reactions_view.h"
+#include "thread_view.h"
 #include "users_store.h"
 
-MessageRow::MessageRow(team &team, Glib::RefPtr<Gio::Settings> settings,
-                       const Json::Value &payload)
-    : user_image_(Gtk::Stock::MISSING_IMAGE,
-                  Gtk::IconSize(Gtk::ICON_SIZE_BUTTON)),
-      user_label_("", Gtk::ALIGN_START, Gtk::ALIGN_CENTER),
+// Messages from the same user closer than this share a header.
+static const gint64 group_interval_us = 5 * 60 * G_USEC_PER_SEC;
+// Like Slack, only the first few links of a message are unfurled.
+static const std::size_t max_link_previews = 3;
+
+// Parses a Slack timestamp such as "1466000000.000123" into microseconds
+// since the epoch. Going through float would lose far more than the
+// fraction.
+static gint64 parse_ts(const std::string &ts) {
+  char *rest = nullptr;
+  const gint64 seconds = std::strtoll(ts.c_str(), &rest, 10);
+  gint64 microseconds = 0;
+  int digits = 0;
+  if (*rest == '.') {
+    for (const char *p = rest + 1;
+         digits < 6 && std::isdigit(static_cast<unsigned char>(*p));
+         ++p, ++digits) {
+      microseconds = microseconds * 10 + (*p - '0');
+    }
+  }
+  for (; digits < 6; ++digits) {
+    microseconds *= 10;
+  }
+  return seconds * G_USEC_PER_SEC + microseconds;
+}
+
+MessageRow::MessageRow(team &team, std::shared_ptr<settings_snapshot> settings,
+                       const std::string &channel_id,
+                       const Json::Value &payload, bool continuation)
+    : row_box_(nullptr),
+      header_box_(nullptr),
+      user_image_(nullptr),
+      content_box_(nullptr),
       message_text_view_(team, settings),
+      file_previews_(),
+      attachments_view_(nullptr),
+      reactions_view_(nullptr),
+      thread_box_(nullptr),
+      replies_button_(nullptr),
+      thread_view_(nullptr),
 
+      payload_(payload),
+      channel_id_(channel_id),
       ts_(payload["ts"].asString()),
+      time_(parse_ts(ts_)),
+      user_name_(),
+      is_message_(false),
+      reactions_(),
+      reply_count_(0),
+      icon_url_(),
+      icon_requests_(),
+      link_urls_(),
+      link_previews_(),
+      link_requests_(),
+      on_screen_(false),
 
       team_(team),
       settings_(settings) {
-  Gtk::Box *hbox = Gtk::manage(new Gtk::Box(Gtk::ORIENTATION_HORIZONTAL));
-  add(*hbox);
+  row_box_ = Gtk::manage(new Gtk::Box(Gtk::ORIENTATION_HORIZONTAL));
+  add(*row_box_);
 
   Gtk::Box *vbox = Gtk::manage(new Gtk::Box(Gtk::ORIENTATION_VERTICAL));
-  hbox->pack_start(user_image_, Gtk::PACK_SHRINK);
-  hbox->pack_end(*vbox);
-  user_image_.set_alignment(Gtk::ALIGN_CENTER, Gtk::ALIGN_START);
-
-  Gtk::Box *info_hbox = Gtk::manage(new Gtk::Box(Gtk::ORIENTATION_HORIZONTAL));
-  vbox->pack_start(*info_hbox, Gtk::PACK_SHRINK);
-
-  Gtk::Label *timestamp_label =
-      Gtk::manage(new Gtk::Label("", Gtk::ALIGN_END, Gtk::ALIGN_CENTER));
-  info_hbox->pack_start(user_label_, Gtk::PACK_SHRINK);
-  info_hbox->pack_end(*timestamp_label, Gtk::PACK_SHRINK);
-
-  Pango::AttrList attrs;
-  Pango::Attribute weight =
-      Pango::Attribute::create_attr_weight(Pango::WEIGHT_BOLD);
-  attrs.insert(weight);
-  user_label_.set_attributes(attrs);
-
-  const Glib::DateTime timestamp =
-      Glib::DateTime::create_now_local(gint64(std::stof(ts())));
-  timestamp_label->set_text(timestamp.format("%F %R"));
+  content_box_ = vbox;
+  row_box_->pack_end(*vbox);
 
   const Json::Value subtype_value = payload["subtype"];
   std::string text = payload["text"].asString();
@@ -52,32 +89,30 @@ MessageRow::MessageRow(team &team, Glib::RefPtr<Gio::Settings> settings,
   const boost::optional<user> o_user = team_.users_store_->find(user_id);
   if (o_user) {
     const user &user = o_user.get();
-    user_label_.set_text(user.name);
-    load_user_icon(user.profile.image_72);
+    user_name_ = user.name;
+    icon_url_ = user.profile.image_72;
   }
 
-  bool is_message = false;
-
   if (subtype_value.isNull()) {
-    is_message = true;
+    is_message_ = true;
   } else {
     const std::string subtype = subtype_value.asString();
     if (subtype == "bot_message") {
-      is_message = true;
+      is_message_ = true;
       std::string username = payload["username"].asString();
       const Json::Value image64 = payload["icons"]["image_64"];
       const Json::Value image48 = payload["icons"]["image_48"];
       const Json::Value bot_id = payload["bot_id"];
       if (image64.isString()) {
-        load_user_icon(image64.asString());
+        icon_url_ = image64.asString();
       } else if (image48.isString()) {
-        load_user_icon(image48.asString());
+        icon_url_ = image48.asString();
       } else if (bot_id.isString()) {
         const boost::optional<user> ou =
             team_.users_store_->find(bot_id.asString());
         if (ou) {
           const user &u = ou.get();
-          load_user_icon(u.icons.image_72);
+          icon_url_ = u.icons.image_72;
           if (username.empty()) {
             username = u.name;
           }
@@ -89,9 +124,9 @@ MessageRow::MessageRow(team &team, Glib::RefPtr<Gio::Settings> settings,
         const std::string default_icon_url =
             "https://i0.wp.com/slack-assets2.s3-us-west-2.amazonaws.com/8390/"
             "img/avatars/ava_0002-48.png";
-        load_user_icon(default_icon_url);
+        icon_url_ = default_icon_url;
       }
-      user_label_.set_text(username);
+      user_name_ = username;
     } else if (subtype == "channel_join") {
       const Json::Value inviter_value = payload["inviter"];
       if (inviter_value.isString()) {
@@ -118,33 +153,425 @@ MessageRow::MessageRow(team &team, Glib::RefPtr<Gio::Settings> settings,
       // nothing special
     } else if (subtype == "file_share") {
       // nothing special
+    } else if (subtype == "thread_broadcast") {
+      // A reply also sent to the channel
+      is_message_ = true;
     } else {
       std::cout << "Unhandled subtype " << subtype << ": \n"
                 << payload << std::endl;
     }
   }
-  if (payload["attachments"].isArray()) {
-    auto attachments_view = Gtk::manage(
-        new AttachmentsView(team_, settings_, payload["attachments"]));
-    vbox->pack_end(*attachments_view);
+  vbox->pack_start(message_text_view_);
+  message_text_view_.set_text(text, is_message_);
+  if (payload["files"].isArray()) {
+    for (const Json::Value &file : payload["files"]) {
+      add_file_preview(file);
+    }
+  } else if (payload["file"].isObject()) {
+    add_file_preview(payload["file"]);
   }
-  vbox->pack_end(message_text_view_);
-  message_text_view_.set_text(text, is_message);
+  find_links(payload);
+  set_attachments(payload["attachments"]);
+  set_reactions(payload["reactions"]);
+  set_reply_count(payload["reply_count"].asInt());
 
+  if (continuation) {
+    remove_header();
+  } else {
+    create_header();
+  }
   show_all_children();
 }
 
 MessageRow::~MessageRow() {
+  for (icon_loader::request_id id : icon_requests_) {
+    team_.icon_loader_->cancel(id);
+  }
+  cancel_link_previews();
+}
+
+void MessageRow::update(const Json::Value &payload) {
+  payload_ = payload;
+  message_text_view_.set_text(payload["text"].asString(), is_message_);
+  // Slack unfurls links by editing the message, which makes our own
+  // previews of them redundant.
+  cancel_link_previews();
+  find_links(payload);
+  set_attachments(payload["attachments"]);
+  set_reactions(payload["reactions"]);
+  set_reply_count(payload["reply_count"].asInt());
+  if (on_screen_) {
+    load_link_previews();
+  }
+}
+
+void MessageRow::add_file_preview(const Json::Value &file) {
+  FilePreview *preview = Gtk::manage(new FilePreview(team_, file));
+  content_box_->pack_start(*preview, Gtk::PACK_SHRINK);
+  file_previews_.push_back(preview);
+}
+
+void MessageRow::set_attachments(const Json::Value &attachments) {
+  if (attachments_view_ != nullptr) {
+    content_box_->remove(*attachments_view_);
+    delete attachments_view_;
+    attachments_view_ = nullptr;
+  }
+  Json::Value all_attachments =
+      attachments.isArray() ? attachments : Json::Value(Json::arrayValue);
+  for (const Json::Value &preview : link_previews_) {
+    if (!preview.isNull()) {
+      all_attachments.append(preview);
+    }
+  }
+  if (!all_attachments.empty()) {
+    attachments_view_ =
+        Gtk::manage(new AttachmentsView(team_, settings_, all_attachments));
+    content_box_->pack_start(*attachments_view_);
+    // Below the header, the text and the files, above the reactions
+    content_box_->reorder_child(
+        *attachments_view_,
+        (header_box_ == nullptr ? 1 : 2) + file_previews_.size());
+    attachments_view_->show_all();
+    if (on_screen_) {
+      attachments_view_->set_on_screen();
+    }
+  }
+}
+
+void MessageRow::find_links(const Json::Value &payload) {
+  link_urls_.clear();
+  link_previews_.clear();
+  if (!is_message_) {
+    return;
+  }
+  std::set<std::string> unfurled;
+  for (const Json::Value &attachment : payload["attachments"]) {
+    unfurled.insert(attachment["from_url"].asString());
+    unfurled.insert(attachment["original_url"].asString());
+  }
+
+  // Links are formatted as <url> or <url|label>.
+  const std::string text = payload["text"].asString();
+  std::size_t pos = 0;
+  while (link_urls_.size() < max_link_previews &&
+         (pos = text.find('<', pos)) != std::string::npos) {
+    const std::size_t end = text.find('>', pos);
+    if (end == std::string::npos) {
+      break;
+    }
+    const std::string link = text.substr(pos + 1, end - pos - 1);
+    const std::string url = link.substr(0, link.find('|'));
+    if ((url.compare(0, 7, "http://") == 0 ||
+         url.compare(0, 8, "https://") == 0) &&
+        unfurled.find(url) == unfurled.end() &&
+        std::find(link_urls_.begin(), link_urls_.end(), url) ==
+            link_urls_.end()) {
+      link_urls_.push_back(url);
+    }
+    pos = end + 1;
+  }
+  link_previews_.resize(link_urls_.size());
+}
+
+void MessageRow::load_link_previews() {
+  if (!settings_->link_previews() || !link_requests_.empty()) {
+    return;
+  }
+  for (std::size_t i = 0; i < link_urls_.size(); ++i) {
+    if (!link_previews_[i].isNull()) {
+      continue;
+    }
+    // The callback may run right away if the preview is in memory.
+    const link_preview_loader::request_id id =
+        team_.link_preview_loader_->load(
+            link_urls_[i], std::bind(&MessageRow::on_link_preview_loaded,
+                                     this, i, std::placeholders::_1));
+    if (id != 0) {
+      link_requests_.push_back(id);
+    }
+  }
+}
+
+void MessageRow::cancel_link_previews() {
+  for (link_preview_loader::request_id id : link_requests_) {
+    team_.link_preview_loader_->cancel(id);
+  }
+  link_requests_.clear();
+}
+
+void MessageRow::on_link_preview_loaded(std::size_t index,
+                                        const Json::Value &attachment) {
+  link_previews_[index] = attachment;
+  if (attachments_view_ == nullptr) {
+    set_attachments(payload_["attachments"]);
+    return;
+  }
+  // After the message's own attachments and the previews of earlier links
+  int position = payload_["attachments"].isArray()
+                     ? static_cast<int>(payload_["attachments"].size())
+                     : 0;
+  for (std::size_t i = 0; i < index; ++i) {
+    if (!link_previews_[i].isNull()) {
+      ++position;
+    }
+  }
+  attachments_view_->insert_attachment(position, attachment);
+}
+
+void MessageRow::set_reactions(const Json::Value &json) {
+  reactions_ = reactions(json);
+  if (reactions_view_ == nullptr && reactions_.empty()) {
+    return;
+  }
+  create_reactions_view();
+  reactions_view_->set_reactions(reactions_);
+  reactions_view_->set_visible(!reactions_.empty());
+}
+
+void MessageRow::create_reactions_view() {
+  if (reactions_view_ == nullptr) {
+    reactions_view_ = Gtk::manage(new ReactionsView(team_, settings_));
+    content_box_->pack_start(*reactions_view_, Gtk::PACK_SHRINK);
+  }
+}
+
+void MessageRow::add_reaction(const std::string &name,
+                              const std::string &user_id) {
+  if (reactions_.add(name, user_id)) {
+    on_reactions_changed(name);
+  }
+}
+
+void MessageRow::remove_reaction(const std::string &name,
+                                 const std::string &user_id) {
+  if (reactions_.remove(name, user_id)) {
+    on_reactions_changed(name);
+  }
+}
+
+void MessageRow::on_reactions_changed(const std::string &name) {
+  // Kept in sync for when the row is unloaded and built again
+  payload_["reactions"] = reactions_.to_json();
+
+  create_reactions_view();
+  reactions_view_->update(name, reactions_.find(name));
+  reactions_view_->set_visible(!reactions_.empty());
+}
+
+void MessageRow::add_reply(const Json::Value &payload) {
+  set_reply_count(reply_count_ + 1);
+  if (thread_view_ != nullptr) {
+    thread_view_->add_reply(payload);
+  }
+}
+
+void MessageRow::update_reply(const Json::Value &payload) {
+  if (thread_view_ != nullptr) {
+    thread_view_->update_reply(payload);
+  }
+}
+
+void MessageRow::remove_reply(const std::string &ts) {
+  set_reply_count(reply_count_ - 1);
+  if (thread_view_ != nullptr) {
+    thread_view_->remove_reply(ts);
+  }
+}
+
+void MessageRow::set_reply_count(int reply_count) {
+  reply_count_ = reply_count;
+  payload_["reply_count"] = reply_count_;
+  if (reply_count_ <= 0) {
+    if (thread_box_ != nullptr) {
+      thread_box_->hide();
+    }
+    return;
+  }
+
+  if (thread_box_ == nullptr) {
+    thread_box_ = Gtk::manage(new Gtk::Box(Gtk::ORIENTATION_VERTICAL));
+    replies_button_ = Gtk::manage(new Gtk::Button());
+    replies_button_->set_relief(Gtk::RELIEF_NONE);
+    replies_button_->set_halign(Gtk::ALIGN_START);
+    replies_button_->signal_clicked().connect(
+        sigc::mem_fun(*this, &MessageRow::on_replies_button_clicked));
+    thread_box_->pack_start(*replies_button_, Gtk::PACK_SHRINK);
+    // End-packed, so it stays below the attachments and reactions added
+    // later
+    content_box_->pack_end(*thread_box_, Gtk::PACK_SHRINK);
+  }
+  replies_button_->set_label(reply_count_ == 1
+                                 ? "1 reply"
+                                 : std::to_string(reply_count_) + " replies");
+  replies_button_->show();
+  thread_box_->show();
+}
+
+void MessageRow::on_replies_button_clicked() {
+  if (thread_view_ == nullptr) {
+    thread_view_ =
+        Gtk::manage(new ThreadView(team_, settings_, channel_id_, ts_));
+    thread_view_->signal_channel_link_clicked().connect(
+        signal_channel_link_clicked().make_slot());
+    thread_box_->pack_start(*thread_view_, Gtk::PACK_SHRINK);
+    thread_view_->show();
+    thread_view_->load_more();
+  } else {
+    // Collapsing drops the replies; they're fetched again when expanded.
+    thread_box_->remove(*thread_view_);
+    delete thread_view_;
+    thread_view_ = nullptr;
+  }
+}
+
+bool MessageRow::continues(const Json::Value &previous,
+                           const Json::Value &payload) {
+  // Only plain messages are grouped; bots and info messages keep headers.
+  if (!previous["subtype"].isNull() || !payload["subtype"].isNull()) {
+    return false;
+  }
+  const std::string user_id = payload["user"].asString();
+  if (user_id.empty() || user_id != previous["user"].asString()) {
+    return false;
+  }
+  const gint64 interval =
+      parse_ts(payload["ts"].asString()) - parse_ts(previous["ts"].asString());
+  return interval >= 0 && interval < group_interval_us;
+}
+
+void MessageRow::set_continuation(bool continuation) {
+  if (continuation == (header_box_ == nullptr)) {
+    return;
+  }
+  if (continuation) {
+    remove_header();
+  } else {
+    create_header();
+  }
+}
+
+void MessageRow::create_header() {
+  content_box_->set_margin_start(0);
+  set_has_tooltip(false);
+
+  user_image_ = Gtk::manage(new Gtk::Image(
+      Gtk::Stock::MISSING_IMAGE, Gtk::IconSize(Gtk::ICON_SIZE_BUTTON)));
+  user_image_->set_alignment(Gtk::ALIGN_CENTER, Gtk::ALIGN_START);
+  row_box_->pack_start(*user_image_, Gtk::PACK_SHRINK);
+  user_image_->show();
+
+  header_box_ = Gtk::manage(new Gtk::Box(Gtk::ORIENTATION_HORIZONTAL));
+  Gtk::Label *user_label = Gtk::manage(
+      new Gtk::Label(user_name_, Gtk::ALIGN_START, Gtk::ALIGN_CENTER));
+  Pango::AttrList attrs;
+  Pango::Attribute weight =
+      Pango::Attribute::create_attr_weight(Pango::WEIGHT_BOLD);
+  attrs.insert(weight);
+  user_label->set_attributes(attrs);
+  Gtk::Label *timestamp_label = Gtk::manage(new Gtk::Label(
+      format_time("%F %R"), Gtk::ALIGN_END, Gtk::ALIGN_CENTER));
+  header_box_->pack_start(*user_label, Gtk::PACK_SHRINK);
+  header_box_->pack_end(*timestamp_label, Gtk::PACK_SHRINK);
+  content_box_->pack_start(*header_box_, Gtk::PACK_SHRINK);
+  content_box_->reorder_child(*header_box_, 0);
+  header_box_->show_all();
+
+  if (!icon_url_.empty()) {
+    load_user_icon(icon_url_);
+  }
+}
+
+void MessageRow::remove_header() {
+  for (icon_loader::request_id id : icon_requests_) {
+    team_.icon_loader_->cancel(id);
+  }
+  icon_requests_.clear();
+  if (header_box_ != nullptr) {
+    content_box_->remove(*header_box_);
+    delete header_box_;
+    header_box_ = nullptr;
+    row_box_->remove(*user_image_);
+    delete user_image_;
+    user_image_ = nullptr;
+  }
+  // Line the text up with that of the rows with an icon.
+  content_box_->set_margin_start(settings_->user_icon_size());
+  set_tooltip_text(format_time("%F %R"));
+}
+
+std::string MessageRow::format_time(const std::string &format) const {
+  const Glib::DateTime time = Glib::DateTime::create_now_local(
+      Glib::TimeVal(time_ / G_USEC_PER_SEC, time_ % G_USEC_PER_SEC));
+  return time.format(format);
 }
 
 void MessageRow::load_user_icon(const std::string &icon_url) {
-  team_.icon_loader_->load(icon_url, std::bind(&MessageRow::on_user_icon_loaded,
-                                               this, std::placeholders::_1));
+  const int size = settings_->user_icon_size();
+  // The id is only known once load returns, before the callback can run
+  // unless the icon is in memory.
+  auto id = std::make_shared<icon_loader::request_id>(0);
+  *id = team_.icon_loader_->load(
+      icon_url, size,
+      [this, id](Glib::RefPtr<Gdk::Pixbuf> pixbuf) {
+        on_user_icon_loaded(*id, pixbuf);
+      },
+      on_screen_ ? icon_loader::PRIORITY_VISIBLE
+                 : icon_loader::PRIORITY_DEFAULT);
+  if (*id != 0) {
+    icon_requests_.push_back(*id);
+  }
+}
+
+void MessageRow::set_on_screen() {
+  if (on_screen_) {
+    return;
+  }
+  on_screen_ = true;
+  for (icon_loader::request_id id : icon_requests_) {
+    team_.icon_loader_->set_priority(id, icon_loader::PRIORITY_VISIBLE);
+  }
+  message_text_view_.set_on_screen();
+  load_link_previews();
+  for (FilePreview *preview : file_previews_) {
+    preview->set_on_screen();
+  }
+  if (attachments_view_ != nullptr) {
+    attachments_view_->set_on_screen();
+  }
 }
 
-void MessageRow::on_user_icon_loaded(Glib::RefPtr<Gdk::Pixbuf> pixbuf) {
-  const auto size = settings_->get_uint("user-icon-size");
-  user_image_.set(pixbuf->scale_simple(size, size, Gdk::INTERP_BILINEAR));
+void MessageRow::set_off_screen() {
+  on_screen_ = false;
+  for (FilePreview *preview : file_previews_) {
+    preview->set_off_screen();
+  }
+  if (attachments_view_ != nullptr) {
+    attachments_view_->set_off_screen();
+  }
+  if (thread_view_ != nullptr) {
+    thread_view_->set_off_screen();
+  }
+}
+
+void MessageRow::update_on_screen_replies(double top, double bottom,
+                                          double margin) {
+  int x = 0;
+  int y = 0;
+  if (thread_view_ != nullptr &&
+      translate_coordinates(*thread_view_, 0, 0, x, y)) {
+    thread_view_->update_on_screen_rows(top + y, bottom + y, margin);
+  }
+}
+
+void MessageRow::on_user_icon_loaded(icon_loader::request_id id,
+                                     Glib::RefPtr<Gdk::Pixbuf> pixbuf) {
+  icon_requests_.erase(
+      std::remove(icon_requests_.begin(), icon_requests_.end(), id),
+      icon_requests_.end());
+  if (user_image_ != nullptr) {
+    user_image_->set(pixbuf);
+  }
 }
 
 sigc::signal<void, const std::string &>
@@ -156,14 +583,46 @@ sigc::signal<void, const std::string &> MessageRow::signal_user_link_clicked() {
   return message_text_view_.signal_user_link_clicked();
 }
 
-std::string MessageRow::summary_for_notification() const {
-  return user_label_.get_text() + ": " + message_text_view_.get_text();
-}
-
 const std::string &MessageRow::ts() const {
   return ts_;
 }
 
+const Json::Value &MessageRow::payload() const {
+  return payload_;
+}
+
 void MessageRow::redraw_message() {
   message_text_view_.redraw_message();
+  if (attachments_view_ != nullptr) {
+    attachments_view_->redraw_texts();
+  }
+  if (reactions_view_ != nullptr) {
+    reactions_view_->set_reactions(reactions_);
+  }
+  if (thread_view_ != nullptr) {
+    thread_view_->redraw_messages();
+  }
+}
+
+void MessageRow::rescale_images() {
+  if (header_box_ == nullptr) {
+    content_box_->set_margin_start(settings_->user_icon_size());
+  } else if (!icon_url_.empty()) {
+    // A load still in flight would bring the old size.
+    for (icon_loader::request_id id : icon_requests_) {
+      team_.icon_loader_->cancel(id);
+    }
+    icon_requests_.clear();
+    load_user_icon(icon_url_);
+  }
+  message_text_view_.rescale_emojis();
+  if (attachments_view_ != nullptr) {
+    attachments_view_->rescale_emojis();
+  }
+  if (reactions_view_ != nullptr) {
+    reactions_view_->rescale_emojis();
+  }
+  if (thread_view_ != nullptr) {
+    thread_view_->rescale_images();
+  }
 }
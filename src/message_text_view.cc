@@ -1,75 +1,124 @@
 #include "message_text_view.h"
+#include <gtkmm/texttagtable.h>
+#include <algorithm>
 #include <iostream>
-#include <regex>
 #include "channels_store.h"
+#include "code_highlighter.h"
 #include "emoji_loader.h"
+#include "mrkdwn_formatter.h"
 #include "users_store.h"
 
 MessageTextView::MessageTextView(team& team,
-                                 Glib::RefPtr<Gio::Settings> settings)
-    : team_(team), settings_(settings), raw_text_(), is_message_(false) {
-  signal_event_after().connect(
-      sigc::mem_fun(*this, &MessageTextView::on_event_after));
+                                 std::shared_ptr<settings_snapshot> settings)
+    : team_(team),
+      settings_(settings),
+      raw_text_(),
+      is_message_(false),
+      code_blocks_expanded_(false),
+      on_screen_(false),
+      missing_emojis_(),
+      text_(),
+      body_(),
+      text_view_(nullptr),
+      buffer_links_() {
+  pack_start(body_);
+  body_.signal_link_clicked().connect(
+      sigc::mem_fun(*this, &MessageTextView::on_link_clicked));
+  body_.signal_selection_started().connect(
+      sigc::mem_fun(*this, &MessageTextView::on_selection_started));
+  body_.show();
 }
 
 MessageTextView::~MessageTextView() {
 }
 
-static void create_tags(Glib::RefPtr<Gtk::TextBuffer> buffer) {
-  auto tag = buffer->create_tag("info_message");
-  tag->property_foreground() = "gray";
-}
-
-static Gtk::TextBuffer::iterator insert_user_link(
-    Glib::RefPtr<Gtk::TextBuffer> buffer, Gtk::TextBuffer::iterator iter,
-    const std::string& user_id, const std::string& user_name) {
-  Glib::RefPtr<Gtk::TextTag> tag = buffer->create_tag();
-  tag->property_foreground() = "blue";
-  tag->property_underline() = Pango::UNDERLINE_SINGLE;
-  tag->set_data("user_id", g_strdup(user_id.c_str()), g_free);
-  return buffer->insert_with_tag(iter, user_name, tag);
-}
-
-static Gtk::TextBuffer::iterator insert_channel_link(
-    Glib::RefPtr<Gtk::TextBuffer> buffer, Gtk::TextBuffer::iterator iter,
-    const std::string& channel_id, const std::string& channel_name) {
-  Glib::RefPtr<Gtk::TextTag> tag = buffer->create_tag();
-  tag->property_foreground() = "blue";
-  tag->property_underline() = Pango::UNDERLINE_SINGLE;
-  tag->set_data("channel_id", g_strdup(channel_id.c_str()), g_free);
-  return buffer->insert_with_tag(iter, channel_name, tag);
-}
-
-static Gtk::TextBuffer::iterator insert_url_link(
-    Glib::RefPtr<Gtk::TextBuffer> buffer, Gtk::TextBuffer::iterator iter,
-    const std::string& url, const std::string& link_name) {
-  Glib::RefPtr<Gtk::TextTag> tag = buffer->create_tag();
-  tag->property_foreground() = "blue";
-  tag->property_underline() = Pango::UNDERLINE_SINGLE;
-  tag->set_data("url", g_strdup(url.c_str()), g_free);
-  return buffer->insert_with_tag(iter, link_name, tag);
+// Fenced blocks longer than this are collapsed.
+static const std::size_t max_code_block_lines = 30;
+
+// Tag names by rich_text::style_type
+static const char* const style_tag_names[] = {
+    "info_message", "link",         "bold",         "italic",
+    "strike",       "code",         "pre",          "quote",
+    "code_keyword", "code_string",  "code_comment", "code_number",
+    "diff_added",   "diff_removed", "diff_header",
+};
+
+// All buffers share the tags; nothing but the range differs between them.
+static Glib::RefPtr<Gtk::TextTagTable> shared_tag_table() {
+  static Glib::RefPtr<Gtk::TextTagTable> table;
+  if (!table) {
+    table = Gtk::TextTagTable::create();
+    auto tag = Gtk::TextTag::create("info_message");
+    tag->property_foreground() = "gray";
+    table->add(tag);
+    tag = Gtk::TextTag::create("link");
+    tag->property_foreground() = "blue";
+    tag->property_underline() = Pango::UNDERLINE_SINGLE;
+    table->add(tag);
+    tag = Gtk::TextTag::create("bold");
+    tag->property_weight() = Pango::WEIGHT_BOLD;
+    table->add(tag);
+    tag = Gtk::TextTag::create("italic");
+    tag->property_style() = Pango::STYLE_ITALIC;
+    table->add(tag);
+    tag = Gtk::TextTag::create("strike");
+    tag->property_strikethrough() = true;
+    table->add(tag);
+    tag = Gtk::TextTag::create("code");
+    tag->property_family() = "monospace";
+    tag->property_background() = "#f0f0f0";
+    table->add(tag);
+    tag = Gtk::TextTag::create("pre");
+    tag->property_family() = "monospace";
+    tag->property_paragraph_background() = "#f0f0f0";
+    table->add(tag);
+    tag = Gtk::TextTag::create("quote");
+    tag->property_foreground() = "#606060";
+    table->add(tag);
+    tag = Gtk::TextTag::create("code_keyword");
+    tag->property_foreground() = "#0033b3";
+    tag->property_weight() = Pango::WEIGHT_BOLD;
+    table->add(tag);
+    tag = Gtk::TextTag::create("code_string");
+    tag->property_foreground() = "#067d17";
+    table->add(tag);
+    tag = Gtk::TextTag::create("code_comment");
+    tag->property_foreground() = "#8c8c8c";
+    tag->property_style() = Pango::STYLE_ITALIC;
+    table->add(tag);
+    tag = Gtk::TextTag::create("code_number");
+    tag->property_foreground() = "#1750eb";
+    table->add(tag);
+    tag = Gtk::TextTag::create("diff_added");
+    tag->property_foreground() = "#22863a";
+    table->add(tag);
+    tag = Gtk::TextTag::create("diff_removed");
+    tag->property_foreground() = "#b31d28";
+    table->add(tag);
+    tag = Gtk::TextTag::create("diff_header");
+    tag->property_foreground() = "#6f42c1";
+    table->add(tag);
+  }
+  return table;
 }
 
-Gtk::TextBuffer::iterator MessageTextView::insert_hyperlink(
-    Glib::RefPtr<Gtk::TextBuffer> buffer, Gtk::TextBuffer::iterator iter,
-    const std::string& linker) {
-  std::regex url_re("^(.+)\\|(.+)$");
-  std::smatch match;
-
-  if (std::regex_match(linker, match, url_re)) {
-    const std::string& left = match[1];
-    const std::string& right = match[2];
+void MessageTextView::append_hyperlink(const std::string& linker) {
+  // <target|label>; the target can't contain '|'.
+  const std::size_t bar = linker.find('|');
+  if (bar != std::string::npos && bar != 0 && bar + 1 != linker.size()) {
+    const std::string left = linker.substr(0, bar);
+    const std::string right = linker.substr(bar + 1);
     switch (left[0]) {
       case '@':
-        iter = insert_user_link(buffer, iter, left.substr(1, left.size() - 1),
-                                "@" + right);
+        text_.append_link("@" + right, rich_text::LINK_USER,
+                          left.substr(1, left.size() - 1));
         break;
       case '#':
-        iter = insert_channel_link(
-            buffer, iter, left.substr(1, left.size() - 1), "#" + right);
+        text_.append_link("#" + right, rich_text::LINK_CHANNEL,
+                          left.substr(1, left.size() - 1));
         break;
       default:
-        iter = insert_url_link(buffer, iter, left, right);
+        text_.append_link(right, rich_text::LINK_URL, left);
         break;
     }
   } else {
@@ -78,12 +127,12 @@ Gtk::TextBuffer::iterator MessageTextView::insert_hyperlink(
         const std::string user_id = linker.substr(1, linker.size() - 1);
         const boost::optional<user> o_user = team_.users_store_->find(user_id);
         if (o_user) {
-          iter =
-              insert_user_link(buffer, iter, user_id, "@" + o_user.get().name);
+          text_.append_link("@" + o_user.get().name, rich_text::LINK_USER,
+                            user_id);
         } else {
           std::cerr << "[MessageTextView] cannot find linked user " << linker
                     << std::endl;
-          iter = insert_user_link(buffer, iter, linker, linker);
+          text_.append_link(linker, rich_text::LINK_USER, linker);
         }
       } break;
       case '#': {
@@ -91,145 +140,169 @@ Gtk::TextBuffer::iterator MessageTextView::insert_hyperlink(
         const boost::optional<channel> o_channel =
             team_.channels_store_->find(channel_id);
         if (o_channel) {
-          iter = insert_channel_link(buffer, iter, channel_id,
-                                     "#" + o_channel.get().name);
+          text_.append_link("#" + o_channel.get().name,
+                            rich_text::LINK_CHANNEL, channel_id);
         } else {
           std::cerr << "[MessageTextView] cannot find linked channel " << linker
                     << std::endl;
-          iter = insert_channel_link(buffer, iter, linker, linker);
+          text_.append_link(linker, rich_text::LINK_CHANNEL, linker);
         }
       } break;
       default:
-        iter = insert_url_link(buffer, iter, linker, linker);
+        text_.append_link(linker, rich_text::LINK_URL, linker);
         break;
     }
   }
-  return iter;
 }
 
-static std::vector<std::pair<std::string, std::string>> tokenize_emojis(
-    const std::vector<std::pair<std::string, std::string>>& tokens) {
-  const std::regex emoji_re(":([a-zA-Z0-9_]+):");
-
-  std::vector<std::pair<std::string, std::string>> ret;
-
-  for (const auto& tag_and_text : tokens) {
-    const std::string& tag = tag_and_text.first;
-    const std::string& text = tag_and_text.second;
-    std::sregex_iterator re_it(text.begin(), text.end(), emoji_re), re_end;
-    if (re_it == re_end) {
-      ret.push_back(tag_and_text);
-      continue;
-    }
-
-    std::size_t pos = 0;
-    for (; re_it != re_end; ++re_it) {
-      ret.emplace_back(
-          std::make_pair(tag, text.substr(pos, re_it->position() - pos)));
-      const std::string& emoji = (*re_it)[1].str();
-      std::string lower_emoji;
-      std::transform(emoji.begin(), emoji.end(),
-                     std::back_inserter(lower_emoji),
-                     [](char c) { return std::tolower(c); });
-      ret.emplace_back(std::make_pair("emoji_" + tag, lower_emoji));
-      pos = re_it->position() + re_it->length();
-    }
-    if (pos != text.size()) {
-      ret.emplace_back(std::make_pair(tag, text.substr(pos)));
+void MessageTextView::append_emoji(const std::string& name) {
+  const int size = settings_->emoji_size();
+  Glib::RefPtr<Gdk::Pixbuf> emoji = team_.emoji_loader_->find(name, size);
+  if (emoji) {
+    text_.append_emoji(name, emoji);
+  } else {
+    missing_emojis_.push_back(name);
+    if (on_screen_) {
+      team_.emoji_loader_->prioritize(name);
     }
+    text_.append(":" + name + ":");
   }
-
-  return ret;
 }
 
-static void replace_all(std::string& text, const std::string& sub,
-                        const std::string& replacement) {
-  for (std::string::size_type pos = text.find(sub); pos != std::string::npos;
-       pos = text.find(sub, pos + 1)) {
-    text.replace(pos, sub.size(), replacement);
+void MessageTextView::highlight_code_block(std::size_t start, std::size_t end,
+                                           std::size_t hidden_lines) {
+  for (const code_highlighter::token& token :
+       team_.code_highlighter_->highlight(
+           text_.text.substr(start, end - start))) {
+    text_.add_span(start + token.start, start + token.end, token.style);
   }
-}
-
-static void replace_entity_references(
-    std::vector<std::pair<std::string, std::string>>& tokens) {
-  for (auto& tag_and_text : tokens) {
-    std::string& text = tag_and_text.second;
-    // https://api.slack.com/docs/formatting#how_to_escape_characters
-    replace_all(text, "&amp;", "&");
-    replace_all(text, "&lt;", "<");
-    replace_all(text, "&gt;", ">");
+  if (hidden_lines != 0) {
+    text_.append("\n");
+    text_.append_link("Show " + std::to_string(hidden_lines) + " more lines",
+                      rich_text::LINK_EXPAND, "");
   }
 }
 
-Gtk::TextBuffer::iterator MessageTextView::insert_markdown_text(
-    Glib::RefPtr<Gtk::TextBuffer> buffer, Gtk::TextBuffer::iterator iter,
-    const std::string& text, bool is_message) {
-  // TODO: format markdown-like text
-  std::vector<std::pair<std::string, std::string>> tokens(
-      1, std::make_pair(is_message ? "" : "info_message", text));
-  tokens = tokenize_emojis(tokens);
-  replace_entity_references(tokens);
-
-  for (const auto& tag_and_text : tokens) {
-    const std::string& tag = tag_and_text.first;
-    const std::string& text = tag_and_text.second;
-    if (text.empty()) {
-      continue;
-    }
-    if (tag.empty()) {
-      iter = buffer->insert(iter, text);
-    } else if (tag.compare(0, 6, "emoji_") == 0) {
-      Glib::RefPtr<Gdk::Pixbuf> emoji = team_.emoji_loader_->find(text);
-      if (emoji) {
-        const auto size = settings_->get_uint("emoji-size");
-        iter = buffer->insert_pixbuf(
-            iter, emoji->scale_simple(size, size, Gdk::INTERP_BILINEAR));
-      } else {
-        std::cerr << "[MessageTextView] cannot find emoji " << text
-                  << std::endl;
-        const std::string fallback_tag = tag.substr(6);
-        if (fallback_tag.empty()) {
-          iter = buffer->insert(iter, ":" + text + ":");
-        } else {
-          iter = buffer->insert_with_tag(iter, ":" + text + ":", tag.substr(6));
-        }
-      }
-    } else {
-      iter = buffer->insert_with_tag(iter, text, tag);
-    }
-  }
-  return iter;
-}
-
 void MessageTextView::set_text(const std::string& text, bool is_message) {
   raw_text_ = text;
+  code_blocks_expanded_ = false;
   is_message_ = is_message;
   redraw_message();
 }
 
 std::string MessageTextView::get_text() const {
-  return get_buffer()->get_text();
+  return text_.plain_text();
 }
 
-bool MessageTextView::on_motion_notify_event(GdkEventMotion* event) {
-  int buffer_x, buffer_y;
+// Converts a byte offset into text to the character offset into a text
+// buffer holding it. Both count an emoji as one character.
+static int to_char_offset(const std::string& text, std::size_t index) {
+  return g_utf8_pointer_to_offset(text.c_str(), text.c_str() + index);
+}
 
-  window_to_buffer_coords(Gtk::TEXT_WINDOW_WIDGET, event->x, event->y, buffer_x,
-                          buffer_y);
+Glib::RefPtr<Gtk::TextBuffer> MessageTextView::create_buffer() {
+  Glib::RefPtr<Gtk::TextBuffer> buffer =
+      Gtk::TextBuffer::create(shared_tag_table());
 
-  Gtk::TextBuffer::iterator iter;
-  get_iter_at_location(iter, buffer_x, buffer_y);
-  bool hovering = false;
-  for (Glib::RefPtr<Gtk::TextTag> tag : iter.get_tags()) {
-    if (tag->get_data("user_id") != nullptr ||
-        tag->get_data("channel_id") != nullptr ||
-        tag->get_data("url") != nullptr) {
-      hovering = true;
+  const char* text = text_.text.c_str();
+  Gtk::TextBuffer::iterator iter = buffer->begin();
+  std::size_t pos = 0;
+  for (const rich_text::emoji& emoji : text_.emojis) {
+    iter = buffer->insert(iter, text + pos, text + emoji.index);
+    iter = buffer->insert_pixbuf(iter, emoji.pixbuf);
+    // Skip the replacement character
+    pos = emoji.index + 3;
+  }
+  buffer->insert(iter, text + pos, text + text_.text.size());
+
+  for (const rich_text::span& span : text_.spans) {
+    buffer->apply_tag_by_name(
+        style_tag_names[span.style],
+        buffer->get_iter_at_offset(to_char_offset(text_.text, span.start)),
+        buffer->get_iter_at_offset(to_char_offset(text_.text, span.end)));
+  }
+
+  buffer_links_.clear();
+  for (const rich_text::link& link : text_.links) {
+    buffer_link l;
+    l.start = to_char_offset(text_.text, link.start);
+    l.end = to_char_offset(text_.text, link.end);
+    l.link = &link;
+    buffer_links_.push_back(l);
+  }
+  return buffer;
+}
+
+void MessageTextView::on_selection_started(std::size_t start,
+                                           std::size_t end) {
+  text_view_ = Gtk::manage(new Gtk::TextView(create_buffer()));
+  text_view_->set_editable(false);
+  text_view_->set_cursor_visible(false);
+  text_view_->set_wrap_mode(Gtk::WRAP_WORD_CHAR);
+  text_view_->signal_motion_notify_event().connect(
+      sigc::mem_fun(*this, &MessageTextView::on_text_view_motion_notify_event),
+      false);
+  text_view_->signal_event_after().connect(
+      sigc::mem_fun(*this, &MessageTextView::on_text_view_event_after));
+
+  remove(body_);
+  pack_start(*text_view_);
+  text_view_->show();
+
+  Glib::RefPtr<Gtk::TextBuffer> buffer = text_view_->get_buffer();
+  buffer->select_range(
+      buffer->get_iter_at_offset(to_char_offset(text_.text, start)),
+      buffer->get_iter_at_offset(to_char_offset(text_.text, end)));
+  text_view_->grab_focus();
+}
+
+void MessageTextView::on_link_clicked(const rich_text::link& link) {
+  switch (link.type) {
+    case rich_text::LINK_USER:
+      signal_user_link_clicked_.emit(link.target);
       break;
-    }
+    case rich_text::LINK_CHANNEL:
+      signal_channel_link_clicked_.emit(link.target);
+      break;
+    case rich_text::LINK_EXPAND:
+      code_blocks_expanded_ = true;
+      redraw_message();
+      break;
+    case rich_text::LINK_URL: {
+      GError* error = nullptr;
+      if (!gtk_show_uri(get_screen()->gobj(), link.target.c_str(),
+                        gtk_get_current_event_time(), &error)) {
+        g_warning("Unable to open link %s: %s", link.target.c_str(),
+                  error->message);
+        g_error_free(error);
+      }
+    } break;
   }
-  Glib::RefPtr<Gdk::Window> window = get_window(Gtk::TEXT_WINDOW_TEXT);
-  Glib::RefPtr<const Gdk::Cursor> cursor = window->get_cursor();
+}
+
+const rich_text::link* MessageTextView::find_link_in_text_view(
+    double x, double y) const {
+  int buffer_x, buffer_y;
+  text_view_->window_to_buffer_coords(Gtk::TEXT_WINDOW_WIDGET, x, y, buffer_x,
+                                      buffer_y);
+  Gtk::TextBuffer::iterator iter;
+  text_view_->get_iter_at_location(iter, buffer_x, buffer_y);
+  const int offset = iter.get_offset();
+
+  auto it = std::upper_bound(
+      buffer_links_.begin(), buffer_links_.end(), offset,
+      [](int offset, const buffer_link& l) { return offset < l.start; });
+  if (it == buffer_links_.begin()) {
+    return nullptr;
+  }
+  --it;
+  return offset < it->end ? it->link : nullptr;
+}
+
+bool MessageTextView::on_text_view_motion_notify_event(GdkEventMotion* event) {
+  const bool hovering = find_link_in_text_view(event->x, event->y) != nullptr;
+  Glib::RefPtr<Gdk::Window> window =
+      text_view_->get_window(Gtk::TEXT_WINDOW_TEXT);
   if (hovering) {
     if (!pointer_cursor_) {
       pointer_cursor_ = Gdk::Cursor::create(window->get_display(), "pointer");
@@ -237,7 +310,7 @@ bool MessageTextView::on_motion_notify_event(GdkEventMotion* event) {
     window->set_cursor(pointer_cursor_);
   } else {
     if (!default_cursor_) {
-      default_cursor_ = Gdk::Cursor::create(window->get_display(), "default");
+      default_cursor_ = Gdk::Cursor::create(window->get_display(), "text");
     }
     window->set_cursor(default_cursor_);
   }
@@ -245,7 +318,7 @@ bool MessageTextView::on_motion_notify_event(GdkEventMotion* event) {
   return false;
 }
 
-void MessageTextView::on_event_after(GdkEvent* event) {
+void MessageTextView::on_text_view_event_after(GdkEvent* event) {
   if (event->type != GDK_BUTTON_RELEASE) {
     return;
   }
@@ -257,35 +330,14 @@ void MessageTextView::on_event_after(GdkEvent* event) {
 
   /* we shouldn't follow a link if the user has selected something */
   Gtk::TextBuffer::iterator start, end;
-  if (get_buffer()->get_selection_bounds(start, end)) {
+  if (text_view_->get_buffer()->get_selection_bounds(start, end)) {
     return;
   }
 
-  int buffer_x, buffer_y;
-  window_to_buffer_coords(Gtk::TEXT_WINDOW_WIDGET, button_event->x,
-                          button_event->y, buffer_x, buffer_y);
-  Gtk::TextBuffer::iterator iter;
-  get_iter_at_location(iter, buffer_x, buffer_y);
-  for (Glib::RefPtr<Gtk::TextTag> tag : iter.get_tags()) {
-    void* data;
-    if ((data = tag->get_data("user_id")) != nullptr) {
-      signal_user_link_clicked_.emit(
-          std::string(static_cast<const char*>(data)));
-      break;
-    } else if ((data = tag->get_data("channel_id")) != nullptr) {
-      signal_channel_link_clicked_.emit(
-          std::string(static_cast<const char*>(data)));
-      break;
-    } else if ((data = tag->get_data("url")) != nullptr) {
-      GError* error = nullptr;
-      const gchar* url = static_cast<decltype(url)>(data);
-      if (!gtk_show_uri(get_screen()->gobj(), url, gtk_get_current_event_time(),
-                        &error)) {
-        g_warning("Unable to open link %s: %s", url, error->message);
-        g_error_free(error);
-      }
-      break;
-    }
+  const rich_text::link* link =
+      find_link_in_text_view(button_event->x, button_event->y);
+  if (link != nullptr) {
+    on_link_clicked(*link);
   }
 }
 
@@ -298,25 +350,54 @@ MessageTextView::signal_channel_link_clicked() {
   return signal_channel_link_clicked_;
 }
 
-void MessageTextView::redraw_message() {
-  Glib::RefPtr<Gtk::TextBuffer> buffer = Gtk::TextBuffer::create();
-  create_tags(buffer);
-  Gtk::TextBuffer::iterator iter = buffer->get_iter_at_offset(0);
-
-  std::regex markup_re("<([^<>]*)>");
-  std::sregex_iterator re_it(raw_text_.begin(), raw_text_.end(), markup_re),
-      re_end;
+void MessageTextView::set_on_screen() {
+  if (on_screen_) {
+    return;
+  }
+  on_screen_ = true;
+  for (const std::string& name : missing_emojis_) {
+    team_.emoji_loader_->prioritize(name);
+  }
+}
 
-  std::size_t pos = 0;
+void MessageTextView::rescale_emojis() {
+  const int size = settings_->emoji_size();
+  for (rich_text::emoji& emoji : text_.emojis) {
+    Glib::RefPtr<Gdk::Pixbuf> pixbuf =
+        team_.emoji_loader_->find(emoji.name, size);
+    if (pixbuf) {
+      emoji.pixbuf = pixbuf;
+    }
+  }
+  // Only the attributes change; the text is not formatted again.
+  body_.set_rich_text(text_);
+  if (text_view_ != nullptr) {
+    text_view_->set_buffer(create_buffer());
+  }
+}
 
-  for (; re_it != re_end; ++re_it) {
-    iter = insert_markdown_text(buffer, iter,
-                                raw_text_.substr(pos, re_it->position() - pos),
-                                is_message_);
-    iter = insert_hyperlink(buffer, iter, (*re_it)[1].str());
-    pos = re_it->position() + re_it->length();
+void MessageTextView::redraw_message() {
+  missing_emojis_.clear();
+  text_.clear();
+
+  mrkdwn_formatter formatter(
+      text_,
+      std::bind(&MessageTextView::append_hyperlink, this,
+                std::placeholders::_1),
+      std::bind(&MessageTextView::append_emoji, this, std::placeholders::_1),
+      std::bind(&MessageTextView::highlight_code_block, this,
+                std::placeholders::_1, std::placeholders::_2,
+                std::placeholders::_3));
+  if (!code_blocks_expanded_) {
+    formatter.set_max_code_block_lines(max_code_block_lines);
+  }
+  formatter.format(raw_text_);
+  if (!is_message_) {
+    text_.add_span(0, text_.text.size(), rich_text::STYLE_INFO_MESSAGE);
   }
-  iter = insert_markdown_text(buffer, iter, raw_text_.substr(pos), is_message_);
 
-  set_buffer(buffer);
+  body_.set_rich_text(text_);
+  if (text_view_ != nullptr) {
+    text_view_->set_buffer(create_buffer());
+  }
 }
@@ -0,0 +1,316 @@
+#include "mrkdwn_formatter.h"
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+static const char markers[] = "*_~";
+static const rich_text::style_type marker_styles[] = {
+    rich_text::STYLE_BOLD, rich_text::STYLE_ITALIC, rich_text::STYLE_STRIKE};
+// Characters that may start markup. Everything else is copied in runs.
+static const char special_characters[] = "\n<&:*_~`";
+static const char quote_prefix[] = "\xe2\x94\x83 ";  // U+2503 and a space
+static const char bullet[] = "\xe2\x80\xa2 ";        // U+2022 and a space
+// Lines of a collapsed fenced block that are shown
+static const std::size_t collapsed_code_block_lines = 15;
+
+static bool starts_with(const std::string& text, std::size_t pos,
+                        const char* prefix) {
+  return text.compare(pos, std::strlen(prefix), prefix) == 0;
+}
+
+// Markers must be next to one of these (or whitespace) on their outer side.
+static bool is_boundary(char c) {
+  return std::isspace(static_cast<unsigned char>(c)) ||
+         std::strchr("()[]{}\"'.,;:!?-", c) != nullptr;
+}
+
+mrkdwn_formatter::mrkdwn_formatter(rich_text& out,
+                                   const link_handler_type& link_handler,
+                                   const emoji_handler_type& emoji_handler,
+                                   const code_block_handler_type&
+                                       code_block_handler)
+    : out_(out),
+      link_handler_(link_handler),
+      emoji_handler_(emoji_handler),
+      code_block_handler_(code_block_handler),
+      max_code_block_lines_(0),
+      text_(nullptr),
+      pos_(0),
+      quote_start_(std::string::npos),
+      quote_rest_(false) {
+  std::fill(inline_starts_, inline_starts_ + INLINE_STYLE_COUNT,
+            std::string::npos);
+  std::fill(closings_, closings_ + INLINE_STYLE_COUNT, std::string::npos);
+  std::fill(closings_searched_, closings_searched_ + INLINE_STYLE_COUNT, 0);
+}
+
+void mrkdwn_formatter::set_max_code_block_lines(std::size_t lines) {
+  max_code_block_lines_ = lines;
+}
+
+void mrkdwn_formatter::format(const std::string& text) {
+  text_ = &text;
+  pos_ = 0;
+  std::fill(closings_, closings_ + INLINE_STYLE_COUNT, std::string::npos);
+  std::fill(closings_searched_, closings_searched_ + INLINE_STYLE_COUNT, 0);
+  start_line();
+  while (pos_ < text.size()) {
+    if (format_special()) {
+      continue;
+    }
+    // Copy the run of ordinary characters at once.
+    std::size_t end = text.find_first_of(special_characters, pos_ + 1);
+    if (end == std::string::npos) {
+      end = text.size();
+    }
+    out_.append(text, pos_, end - pos_);
+    pos_ = end;
+  }
+  end_line();
+  if (quote_rest_) {
+    close_span(quote_start_, rich_text::STYLE_QUOTE);
+    quote_rest_ = false;
+  }
+  text_ = nullptr;
+}
+
+void mrkdwn_formatter::start_line() {
+  const std::string& text = *text_;
+  if (starts_with(text, pos_, "&gt;&gt;&gt;")) {
+    pos_ += 12;
+    quote_rest_ = true;
+    quote_start_ = out_.text.size();
+  } else if (!quote_rest_ && starts_with(text, pos_, "&gt;")) {
+    pos_ += 4;
+    quote_start_ = out_.text.size();
+  }
+  if (quote_start_ != std::string::npos) {
+    if (pos_ < text.size() && text[pos_] == ' ') {
+      ++pos_;
+    }
+    out_.append(quote_prefix);
+  }
+
+  // Lists
+  const std::size_t indent = text.find_first_not_of(' ', pos_);
+  if (indent != std::string::npos && indent + 2 < text.size() &&
+      (text[indent] == '-' || text[indent] == '*') && text[indent + 1] == ' ' &&
+      text[indent + 2] != ' ') {
+    out_.append(text, pos_, indent - pos_);
+    out_.append(bullet);
+    pos_ = indent + 2;
+  }
+}
+
+void mrkdwn_formatter::end_line() {
+  // Markers are paired within a line; anything still open is malformed
+  // input. Style it to the end of the line rather than losing text.
+  for (int style = 0; style < INLINE_STYLE_COUNT; ++style) {
+    close_span(inline_starts_[style], marker_styles[style]);
+  }
+  if (!quote_rest_) {
+    close_span(quote_start_, rich_text::STYLE_QUOTE);
+  }
+}
+
+void mrkdwn_formatter::close_span(std::size_t& start,
+                                  rich_text::style_type style) {
+  if (start != std::string::npos) {
+    out_.add_span(start, out_.text.size(), style);
+    start = std::string::npos;
+  }
+}
+
+bool mrkdwn_formatter::format_special() {
+  const std::string& text = *text_;
+  switch (text[pos_]) {
+    case '\n':
+      end_line();
+      out_.append("\n");
+      ++pos_;
+      start_line();
+      return true;
+    case '<':
+      return format_link(text.size());
+    case '&':
+      return format_entity(text.size());
+    case ':':
+      return format_emoji();
+    case '`':
+      return format_fenced_code() || format_code();
+    default: {
+      const char* marker = std::strchr(markers, text[pos_]);
+      return marker != nullptr && *marker != '\0' &&
+             format_marker(marker - markers);
+    }
+  }
+}
+
+bool mrkdwn_formatter::can_open(std::size_t pos) const {
+  const std::string& text = *text_;
+  return (pos == 0 || is_boundary(text[pos - 1])) && pos + 1 < text.size() &&
+         !std::isspace(static_cast<unsigned char>(text[pos + 1]));
+}
+
+bool mrkdwn_formatter::can_close(std::size_t pos) const {
+  const std::string& text = *text_;
+  return pos > 0 && !std::isspace(static_cast<unsigned char>(text[pos - 1])) &&
+         (pos + 1 == text.size() || is_boundary(text[pos + 1]));
+}
+
+bool mrkdwn_formatter::find_closing(int style) {
+  const std::string& text = *text_;
+  const std::size_t from = pos_ + 2;
+  // A closing marker found for an earlier opening one is also the first one
+  // after this one, and there is none where the search stopped before.
+  if (closings_[style] != std::string::npos && closings_[style] >= from) {
+    return true;
+  }
+  std::size_t i = std::max(from, closings_searched_[style]);
+  for (; i < text.size() && text[i] != '\n'; ++i) {
+    if (text[i] == markers[style] && can_close(i)) {
+      closings_[style] = i;
+      closings_searched_[style] = i + 1;
+      return true;
+    }
+  }
+  closings_searched_[style] = i;
+  return false;
+}
+
+bool mrkdwn_formatter::format_marker(int style) {
+  std::size_t& start = inline_starts_[style];
+  if (start != std::string::npos) {
+    if (!can_close(pos_)) {
+      return false;
+    }
+    close_span(start, marker_styles[style]);
+  } else {
+    if (!can_open(pos_) || !find_closing(style)) {
+      return false;
+    }
+    start = out_.text.size();
+  }
+  ++pos_;
+  return true;
+}
+
+bool mrkdwn_formatter::format_code() {
+  const std::string& text = *text_;
+  const std::size_t end = text.find_first_of("`\n", pos_ + 1);
+  if (end == std::string::npos || text[end] != '`' || end == pos_ + 1) {
+    return false;
+  }
+  const std::size_t start = out_.text.size();
+  append_literal(pos_ + 1, end);
+  out_.add_span(start, out_.text.size(), rich_text::STYLE_CODE);
+  pos_ = end + 1;
+  return true;
+}
+
+bool mrkdwn_formatter::format_fenced_code() {
+  const std::string& text = *text_;
+  if (!starts_with(text, pos_, "```")) {
+    return false;
+  }
+  const std::size_t end = text.find("```", pos_ + 3);
+  if (end == std::string::npos) {
+    return false;
+  }
+
+  std::size_t begin = pos_ + 3;
+  if (begin < end && text[begin] == '\n') {
+    ++begin;
+  }
+  std::size_t last = end;
+  if (last > begin && text[last - 1] == '\n') {
+    --last;
+  }
+
+  // Only the beginning of a long block is shown, and processed, until the
+  // user expands it.
+  std::size_t hidden_lines = 0;
+  const std::size_t lines =
+      std::count(text.begin() + begin, text.begin() + last, '\n') + 1;
+  if (max_code_block_lines_ != 0 && lines > max_code_block_lines_) {
+    std::size_t cut = begin;
+    for (std::size_t i = 0; i < collapsed_code_block_lines; ++i) {
+      cut = text.find('\n', cut) + 1;
+    }
+    last = cut - 1;
+    hidden_lines = lines - collapsed_code_block_lines;
+  }
+
+  const std::size_t start = out_.text.size();
+  append_literal(begin, last);
+  out_.add_span(start, out_.text.size(), rich_text::STYLE_PRE);
+  code_block_handler_(start, out_.text.size(), hidden_lines);
+  pos_ = end + 3;
+  return true;
+}
+
+bool mrkdwn_formatter::format_emoji() {
+  const std::string& text = *text_;
+  std::size_t end = pos_ + 1;
+  while (end < text.size() &&
+         (std::isalnum(static_cast<unsigned char>(text[end])) ||
+          text[end] == '_' || text[end] == '+' || text[end] == '-')) {
+    ++end;
+  }
+  if (end == pos_ + 1 || end == text.size() || text[end] != ':') {
+    return false;
+  }
+
+  std::string name = text.substr(pos_ + 1, end - pos_ - 1);
+  std::transform(name.begin(), name.end(), name.begin(),
+                 [](char c) { return std::tolower(c); });
+  emoji_handler_(name);
+  pos_ = end + 1;
+  return true;
+}
+
+bool mrkdwn_formatter::format_link(std::size_t end) {
+  const std::string& text = *text_;
+  const std::size_t link_end = text.find_first_of("<>\n", pos_ + 1);
+  if (link_end >= end || text[link_end] != '>') {
+    return false;
+  }
+  link_handler_(text.substr(pos_ + 1, link_end - pos_ - 1));
+  pos_ = link_end + 1;
+  return true;
+}
+
+bool mrkdwn_formatter::format_entity(std::size_t end) {
+  // https://api.slack.com/docs/formatting#how_to_escape_characters
+  const std::string& text = *text_;
+  if (pos_ + 5 <= end && starts_with(text, pos_, "&amp;")) {
+    out_.append("&");
+    pos_ += 5;
+  } else if (pos_ + 4 <= end && starts_with(text, pos_, "&lt;")) {
+    out_.append("<");
+    pos_ += 4;
+  } else if (pos_ + 4 <= end && starts_with(text, pos_, "&gt;")) {
+    out_.append(">");
+    pos_ += 4;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+void mrkdwn_formatter::append_literal(std::size_t begin, std::size_t end) {
+  const std::string& text = *text_;
+  pos_ = begin;
+  while (pos_ < end) {
+    if ((text[pos_] == '&' && format_entity(end)) ||
+        (text[pos_] == '<' && format_link(end))) {
+      continue;
+    }
+    std::size_t next = text.find_first_of("&<", pos_ + 1);
+    if (next == std::string::npos || next > end) {
+      next = end;
+    }
+    out_.append(text, pos_, next - pos_);
+    pos_ = next;
+  }
+}
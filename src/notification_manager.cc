@@ -0,0 +1,119 @@
+#include "notification_manager.h"
+#include <glibmm/main.h>
+#include <algorithm>
+#include <iostream>
+
+// Every show is a D-Bus round trip, and a flood of them only buries the
+// messages, so at most one is sent per interval.
+static const unsigned int min_show_interval_ms = 1000;
+
+notification_manager::notification_manager(
+    std::shared_ptr<settings_snapshot> settings)
+    : settings_(settings),
+      channels_(),
+      queue_(),
+      last_shown_at_(0),
+      show_timeout_() {
+}
+
+notification_manager::~notification_manager() {
+  show_timeout_.disconnect();
+  for (auto& p : channels_) {
+    g_signal_handlers_disconnect_by_data(p.second.notification, &p.second);
+    g_object_unref(p.second.notification);
+  }
+}
+
+void notification_manager::notify(const std::string& channel_id,
+                                  const std::string& channel_name,
+                                  const std::string& summary) {
+  auto it = channels_.find(channel_id);
+  if (it == channels_.end()) {
+    const channel_notification created = {channel_name, nullptr, 0, 0, "",
+                                          false};
+    it = channels_.emplace(channel_id, created).first;
+    channel_notification& n = it->second;
+    n.notification = notify_notification_new("", nullptr, nullptr);
+    notify_notification_set_urgency(n.notification, NOTIFY_URGENCY_LOW);
+    g_signal_connect(n.notification, "closed", G_CALLBACK(closed_callback),
+                     &n);
+  }
+
+  channel_notification& n = it->second;
+  n.channel_name = channel_name;
+  ++n.count;
+  n.last_summary = summary;
+  if (!n.pending) {
+    n.pending = true;
+    queue_.push_back(channel_id);
+  }
+
+  const gint64 elapsed_ms = (g_get_monotonic_time() - last_shown_at_) / 1000;
+  if (elapsed_ms >= min_show_interval_ms && queue_.size() == 1) {
+    on_show_timeout();
+  } else if (!show_timeout_.connected()) {
+    show_timeout_ = Glib::signal_timeout().connect(
+        sigc::mem_fun(*this, &notification_manager::on_show_timeout),
+        min_show_interval_ms);
+  }
+}
+
+void notification_manager::dismiss(const std::string& channel_id) {
+  auto it = channels_.find(channel_id);
+  if (it == channels_.end()) {
+    return;
+  }
+  channel_notification& n = it->second;
+  g_signal_handlers_disconnect_by_data(n.notification, &n);
+  // Closing a notification that isn't shown fails harmlessly.
+  notify_notification_close(n.notification, nullptr);
+  g_object_unref(n.notification);
+  channels_.erase(it);
+  queue_.erase(std::remove(queue_.begin(), queue_.end(), channel_id),
+               queue_.end());
+}
+
+// Shows the channel that has waited the longest. Returns true while more
+// are waiting, so that the timeout goes on.
+bool notification_manager::on_show_timeout() {
+  if (queue_.empty()) {
+    return false;
+  }
+  channel_notification& n = channels_.at(queue_.front());
+  queue_.pop_front();
+  show(n);
+  return !queue_.empty();
+}
+
+void notification_manager::show(channel_notification& n) {
+  n.pending = false;
+  n.shown = n.count;
+  last_shown_at_ = g_get_monotonic_time();
+
+  const std::string title = "slack-gtk #" + n.channel_name;
+  std::string body = n.last_summary;
+  if (n.count > 1) {
+    body = std::to_string(n.count) + " new messages in #" + n.channel_name +
+           "\n" + n.last_summary;
+  }
+  // Updating the shown notification replaces it instead of adding one.
+  notify_notification_update(n.notification, title.c_str(), body.c_str(),
+                             nullptr);
+  notify_notification_set_timeout(n.notification,
+                                  settings_->notification_timeout());
+
+  GError* error = nullptr;
+  if (!notify_notification_show(n.notification, &error)) {
+    std::cerr << "[notification_manager] show: " << error->message
+              << std::endl;
+    g_error_free(error);
+  }
+}
+
+void notification_manager::closed_callback(NotifyNotification*,
+                                           gpointer user_data) {
+  // Expired or closed by the user; the next message starts a new burst.
+  channel_notification* n = static_cast<channel_notification*>(user_data);
+  n->count -= n->shown;
+  n->shown = 0;
+}
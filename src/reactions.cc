@@ -0,0 +1,92 @@
+#include "reactions.h"
+#include <algorithm>
+
+reactions::reactions() : data_() {
+}
+
+reactions::reactions(const Json::Value& json) : data_() {
+  for (const Json::Value& r : json) {
+    reaction reaction;
+    reaction.name = r["name"].asString();
+    reaction.count = r["count"].asInt();
+    for (const Json::Value& user : r["users"]) {
+      reaction.users.push_back(user.asString());
+    }
+    std::sort(reaction.users.begin(), reaction.users.end());
+    data_.push_back(reaction);
+  }
+}
+
+bool reactions::add(const std::string& name, const std::string& user_id) {
+  auto it = std::find_if(data_.begin(), data_.end(),
+                         [&name](const reaction& r) { return r.name == name; });
+  if (it == data_.end()) {
+    reaction reaction;
+    reaction.name = name;
+    reaction.count = 1;
+    reaction.users.push_back(user_id);
+    data_.push_back(reaction);
+    return true;
+  }
+
+  auto user = std::lower_bound(it->users.begin(), it->users.end(), user_id);
+  if (user != it->users.end() && *user == user_id) {
+    return false;
+  }
+  it->users.insert(user, user_id);
+  ++it->count;
+  return true;
+}
+
+bool reactions::remove(const std::string& name, const std::string& user_id) {
+  auto it = std::find_if(data_.begin(), data_.end(),
+                         [&name](const reaction& r) { return r.name == name; });
+  if (it == data_.end()) {
+    return false;
+  }
+
+  auto user = std::lower_bound(it->users.begin(), it->users.end(), user_id);
+  if (user != it->users.end() && *user == user_id) {
+    it->users.erase(user);
+  } else if (static_cast<std::size_t>(it->count) <= it->users.size()) {
+    // All users are known and the user isn't one of them.
+    return false;
+  }
+  if (--it->count <= 0) {
+    data_.erase(it);
+  }
+  return true;
+}
+
+const reactions::reaction* reactions::find(const std::string& name) const {
+  auto it = std::find_if(data_.begin(), data_.end(),
+                         [&name](const reaction& r) { return r.name == name; });
+  if (it == data_.end()) {
+    return nullptr;
+  } else {
+    return &*it;
+  }
+}
+
+const std::vector<reactions::reaction>& reactions::data() const {
+  return data_;
+}
+
+bool reactions::empty() const {
+  return data_.empty();
+}
+
+Json::Value reactions::to_json() const {
+  Json::Value json(Json::arrayValue);
+  for (const reaction& r : data_) {
+    Json::Value v;
+    v["name"] = r.name;
+    v["count"] = r.count;
+    v["users"] = Json::Value(Json::arrayValue);
+    for (const std::string& user : r.users) {
+      v["users"].append(user);
+    }
+    json.append(v);
+  }
+  return json;
+}
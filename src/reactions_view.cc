@@ -0,0 +1,100 @@
+#include "reactions_view.h"
+#include <gtkmm/box.h>
+#include "emoji_loader.h"
+#include "users_store.h"
+
+ReactionsView::ReactionsView(team& team,
+                             std::shared_ptr<settings_snapshot> settings)
+    : team_(team), settings_(settings), entries_() {
+  set_selection_mode(Gtk::SELECTION_NONE);
+  set_orientation(Gtk::ORIENTATION_HORIZONTAL);
+}
+
+ReactionsView::~ReactionsView() {
+}
+
+void ReactionsView::set_reactions(const reactions& reactions) {
+  for (const auto& p : entries_) {
+    remove_entry(p.second);
+  }
+  entries_.clear();
+  for (const reactions::reaction& reaction : reactions.data()) {
+    entries_.emplace(std::make_pair(reaction.name, create_entry(reaction)));
+  }
+}
+
+void ReactionsView::update(const std::string& name,
+                           const reactions::reaction* reaction) {
+  auto it = entries_.find(name);
+  if (reaction == nullptr) {
+    if (it != entries_.end()) {
+      remove_entry(it->second);
+      entries_.erase(it);
+    }
+  } else if (it == entries_.end()) {
+    entries_.emplace(std::make_pair(name, create_entry(*reaction)));
+  } else {
+    update_entry(it->second, *reaction);
+  }
+}
+
+void ReactionsView::rescale_emojis() {
+  const int size = settings_->emoji_size();
+  for (const auto& p : entries_) {
+    if (p.second.image != nullptr) {
+      Glib::RefPtr<Gdk::Pixbuf> emoji =
+          team_.emoji_loader_->find(p.first, size);
+      if (emoji) {
+        p.second.image->set(emoji);
+      }
+    }
+  }
+}
+
+ReactionsView::entry ReactionsView::create_entry(
+    const reactions::reaction& reaction) {
+  entry entry;
+  Gtk::Box* box = Gtk::manage(new Gtk::Box(Gtk::ORIENTATION_HORIZONTAL));
+  // The pixbuf is shared with every other place showing the emoji.
+  const int size = settings_->emoji_size();
+  Glib::RefPtr<Gdk::Pixbuf> emoji =
+      team_.emoji_loader_->find(reaction.name, size);
+  if (emoji) {
+    entry.image = Gtk::manage(new Gtk::Image(emoji));
+    box->pack_start(*entry.image, Gtk::PACK_SHRINK);
+  } else {
+    entry.image = nullptr;
+    box->pack_start(*Gtk::manage(new Gtk::Label(":" + reaction.name + ":")),
+                    Gtk::PACK_SHRINK);
+  }
+
+  entry.count_label = Gtk::manage(new Gtk::Label());
+  box->pack_start(*entry.count_label, Gtk::PACK_SHRINK);
+  entry.child = Gtk::manage(new Gtk::FlowBoxChild());
+  entry.child->add(*box);
+  update_entry(entry, reaction);
+
+  add(*entry.child);
+  entry.child->show_all();
+  return entry;
+}
+
+void ReactionsView::update_entry(const entry& entry,
+                                 const reactions::reaction& reaction) {
+  entry.count_label->set_text(std::to_string(reaction.count));
+
+  std::string tooltip;
+  for (const std::string& user_id : reaction.users) {
+    const boost::optional<user> o_user = team_.users_store_->find(user_id);
+    if (!tooltip.empty()) {
+      tooltip += ", ";
+    }
+    tooltip += o_user ? o_user.get().name : user_id;
+  }
+  entry.child->set_tooltip_text(tooltip);
+}
+
+void ReactionsView::remove_entry(const entry& entry) {
+  remove(*entry.child);
+  delete entry.child;
+}
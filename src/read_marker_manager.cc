@@ -0,0 +1,134 @@
+#include "read_marker_manager.h"
+#include <glibmm/main.h>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include "api_client.h"
+
+// Marks are sent this long after the last change, so flipping through
+// channels sends nothing for channels that were only passed by.
+static const unsigned int debounce_interval_ms = 2000;
+
+// Compares Slack timestamps such as "1466000000.000123" without going
+// through double, which can't hold all the digits.
+static bool ts_less(const std::string& a, const std::string& b) {
+  char* a_rest = nullptr;
+  char* b_rest = nullptr;
+  const unsigned long long a_sec = std::strtoull(a.c_str(), &a_rest, 10);
+  const unsigned long long b_sec = std::strtoull(b.c_str(), &b_rest, 10);
+  if (a_sec != b_sec) {
+    return a_sec < b_sec;
+  }
+  const unsigned long long a_usec =
+      *a_rest == '.' ? std::strtoull(a_rest + 1, nullptr, 10) : 0;
+  const unsigned long long b_usec =
+      *b_rest == '.' ? std::strtoull(b_rest + 1, nullptr, 10) : 0;
+  return a_usec < b_usec;
+}
+
+read_marker_manager::read_marker_manager(
+    std::shared_ptr<api_client> api_client)
+    : api_client_(api_client), channels_(), send_timeout_() {
+}
+
+read_marker_manager::~read_marker_manager() {
+  send_timeout_.disconnect();
+}
+
+void read_marker_manager::mark(const std::string& channel_id,
+                               const std::string& ts) {
+  channel_state& state = channels_[channel_id];
+  const std::string& newest = state.pending.empty() ? state.marked
+                                                    : state.pending;
+  if (!newest.empty() && !ts_less(newest, ts)) {
+    return;
+  }
+  state.pending = ts;
+  schedule_send();
+}
+
+void read_marker_manager::set_marked(const std::string& channel_id,
+                                     const std::string& ts) {
+  channel_state& state = channels_[channel_id];
+  if (state.marked.empty() || ts_less(state.marked, ts)) {
+    state.marked = ts;
+  }
+  if (!state.pending.empty() && !ts_less(state.marked, state.pending)) {
+    state.pending.clear();
+  }
+}
+
+void read_marker_manager::schedule_send() {
+  // Restart the timer so that marks are sent once things settle down.
+  send_timeout_.disconnect();
+  send_timeout_ = Glib::signal_timeout().connect(
+      sigc::mem_fun(*this, &read_marker_manager::on_send_timeout),
+      debounce_interval_ms);
+}
+
+bool read_marker_manager::on_send_timeout() {
+  for (auto& p : channels_) {
+    if (!p.second.pending.empty() && !p.second.in_flight) {
+      send(p.first);
+    }
+  }
+  return false;
+}
+
+void read_marker_manager::send(const std::string& channel_id) {
+  channel_state& state = channels_[channel_id];
+  const std::string ts = state.pending;
+  state.pending.clear();
+  state.in_flight = true;
+
+  std::map<std::string, std::string> params;
+  params["channel"] = channel_id;
+  params["ts"] = ts;
+  api_client_->queue_post("channels.mark", params,
+                          std::bind(&read_marker_manager::on_marked, this,
+                                    channel_id, ts, std::placeholders::_1));
+}
+
+void read_marker_manager::on_marked(
+    const std::string& channel_id, const std::string& ts,
+    const boost::optional<Json::Value>& result) {
+  channel_state& state = channels_[channel_id];
+  state.in_flight = false;
+  if (result && result.get()["ok"].asBool()) {
+    set_marked(channel_id, ts);
+  } else if (result) {
+    std::cerr << "[read_marker_manager] channels.mark failed: "
+              << result.get() << std::endl;
+  } else {
+    std::cerr << "[read_marker_manager] channels.mark failed" << std::endl;
+    // Network trouble; retry unless a newer mark is already pending
+    if (state.pending.empty()) {
+      state.pending = ts;
+    }
+  }
+  if (!state.pending.empty()) {
+    schedule_send();
+  }
+}
+
+void read_marker_manager::flush() {
+  send_timeout_.disconnect();
+  for (auto& p : channels_) {
+    channel_state& state = p.second;
+    if (state.pending.empty()) {
+      continue;
+    }
+    std::map<std::string, std::string> params;
+    params["channel"] = p.first;
+    params["ts"] = state.pending;
+    const boost::optional<Json::Value> result =
+        api_client_->post("channels.mark", params);
+    if (result && result.get()["ok"].asBool()) {
+      state.marked = state.pending;
+    } else {
+      std::cerr << "[read_marker_manager] channels.mark failed on flush"
+                << std::endl;
+    }
+    state.pending.clear();
+  }
+}
@@ -0,0 +1,83 @@
+#include "rich_text.h"
+#include <algorithm>
+
+// U+FFFC OBJECT REPLACEMENT CHARACTER
+static const char object_replacement_character[] = "\xef\xbf\xbc";
+
+void rich_text::clear() {
+  text.clear();
+  spans.clear();
+  links.clear();
+  emojis.clear();
+}
+
+void rich_text::append(const std::string& s) {
+  text.append(s);
+}
+
+void rich_text::append(const std::string& s, std::size_t pos,
+                       std::size_t count) {
+  text.append(s, pos, count);
+}
+
+void rich_text::append(const std::string& s, style_type style) {
+  const std::size_t start = text.size();
+  text.append(s);
+  add_span(start, text.size(), style);
+}
+
+void rich_text::add_span(std::size_t start, std::size_t end,
+                         style_type style) {
+  if (start < end) {
+    span span;
+    span.start = start;
+    span.end = end;
+    span.style = style;
+    spans.push_back(span);
+  }
+}
+
+void rich_text::append_link(const std::string& s, link_type type,
+                            const std::string& target) {
+  link link;
+  link.start = text.size();
+  link.end = link.start + s.size();
+  link.type = type;
+  link.target = target;
+  links.push_back(link);
+  append(s, STYLE_LINK);
+}
+
+void rich_text::append_emoji(const std::string& name,
+                             Glib::RefPtr<Gdk::Pixbuf> pixbuf) {
+  emoji emoji;
+  emoji.index = text.size();
+  emoji.name = name;
+  emoji.pixbuf = pixbuf;
+  emojis.push_back(emoji);
+  text.append(object_replacement_character);
+}
+
+const rich_text::link* rich_text::find_link(std::size_t index) const {
+  // Links don't overlap, so the candidate is the last one starting at or
+  // before index.
+  auto it = std::upper_bound(
+      links.begin(), links.end(), index,
+      [](std::size_t i, const link& link) { return i < link.start; });
+  if (it == links.begin()) {
+    return nullptr;
+  }
+  --it;
+  return index < it->end ? &*it : nullptr;
+}
+
+std::string rich_text::plain_text() const {
+  std::string plain;
+  std::size_t pos = 0;
+  for (const emoji& emoji : emojis) {
+    plain.append(text, pos, emoji.index - pos);
+    pos = emoji.index + sizeof(object_replacement_character) - 1;
+  }
+  plain.append(text, pos, std::string::npos);
+  return plain;
+}
@@ -116,6 +116,10 @@ void rtm_client::handle_payload(const char *payload, size_t size) {
         user_typing_signal_.emit(root);
       } else if (type == "emoji_changed") {
         emoji_changed_signal_.emit(root);
+      } else if (type == "reaction_added") {
+        reaction_added_signal_.emit(root);
+      } else if (type == "reaction_removed") {
+        reaction_removed_signal_.emit(root);
       } else {
         std::cerr << "rtm_client: unknown message type=" << type << std::endl;
         std::cerr << root << std::endl;
@@ -159,3 +163,9 @@ rtm_client::message_signal_type rtm_client::user_typing_signal() {
 rtm_client::message_signal_type rtm_client::emoji_changed_signal() {
   return emoji_changed_signal_;
 }
+rtm_client::message_signal_type rtm_client::reaction_added_signal() {
+  return reaction_added_signal_;
+}
+rtm_client::message_signal_type rtm_client::reaction_removed_signal() {
+  return reaction_removed_signal_;
+}
@@ -0,0 +1,87 @@
+#include "settings_snapshot.h"
+#include <iostream>
+
+static const char* const keys[] = {
+    "notification-timeout", "dpi", "user-icon-size", "emoji-size",
+    "image-cache-size", "link-previews", "highlight-words",
+};
+
+settings_snapshot::settings_snapshot(Glib::RefPtr<Gio::Settings> settings)
+    : settings_(settings),
+      notification_timeout_(0),
+      dpi_(0),
+      user_icon_size_(0),
+      emoji_size_(0),
+      image_cache_size_(0),
+      link_previews_(false),
+      highlight_words_(),
+      signal_changed_() {
+  for (const char* key : keys) {
+    load(key);
+  }
+  // An empty key connects to changes of every key.
+  settings_->signal_changed("").connect(
+      sigc::mem_fun(*this, &settings_snapshot::on_changed));
+}
+
+unsigned int settings_snapshot::notification_timeout() const {
+  return notification_timeout_;
+}
+
+double settings_snapshot::dpi() const {
+  return dpi_;
+}
+
+int settings_snapshot::user_icon_size() const {
+  return user_icon_size_;
+}
+
+int settings_snapshot::emoji_size() const {
+  return emoji_size_;
+}
+
+unsigned int settings_snapshot::image_cache_size() const {
+  return image_cache_size_;
+}
+
+bool settings_snapshot::link_previews() const {
+  return link_previews_;
+}
+
+const std::vector<std::string>& settings_snapshot::highlight_words() const {
+  return highlight_words_;
+}
+
+sigc::signal<void, const std::string&> settings_snapshot::signal_changed() {
+  return signal_changed_;
+}
+
+bool settings_snapshot::load(const std::string& key) {
+  if (key == "notification-timeout") {
+    notification_timeout_ = settings_->get_uint(key);
+  } else if (key == "dpi") {
+    dpi_ = settings_->get_double(key);
+  } else if (key == "user-icon-size") {
+    user_icon_size_ = settings_->get_uint(key);
+  } else if (key == "emoji-size") {
+    emoji_size_ = settings_->get_uint(key);
+  } else if (key == "image-cache-size") {
+    image_cache_size_ = settings_->get_uint(key);
+  } else if (key == "link-previews") {
+    link_previews_ = settings_->get_boolean(key);
+  } else if (key == "highlight-words") {
+    const std::vector<Glib::ustring> words = settings_->get_string_array(key);
+    highlight_words_.assign(words.begin(), words.end());
+  } else {
+    return false;
+  }
+  return true;
+}
+
+void settings_snapshot::on_changed(const Glib::ustring& key) {
+  if (load(key)) {
+    signal_changed_.emit(key);
+  } else {
+    std::cerr << "[settings_snapshot] unknown key " << key << std::endl;
+  }
+}
@@ -1,19 +1,42 @@
 #include "team.h"
+#include "api_client.h"
 #include "channels_store.h"
+#include "code_highlighter.h"
+#include "disk_cache.h"
 #include "emoji_loader.h"
+#include "file_downloader.h"
+#include "highlight_matcher.h"
 #include "icon_loader.h"
+#include "link_preview_loader.h"
+#include "read_marker_manager.h"
 #include "rtm_client.h"
 #include "users_store.h"
 
+static const std::uint64_t default_disk_cache_size = 200 * 1024 * 1024;
+// Previews are much larger than icons, and only those near the viewport are
+// kept by their views.
+static const std::size_t image_memory_cache_budget = 32 * 1024 * 1024;
+
 team::team(std::shared_ptr<api_client> api_client,
            const std::string& emoji_directory, const Json::Value& json)
     : api_client_(api_client),
       rtm_client_(std::make_shared<rtm_client>(json)),
       users_store_(std::make_shared<users_store>(json)),
       channels_store_(std::make_shared<channels_store>(json)),
-      // TODO: Use proper directory
-      icon_loader_(std::make_shared<icon_loader>("icons")),
-      emoji_loader_(std::make_shared<emoji_loader>(emoji_directory)) {
+      disk_cache_(std::make_shared<disk_cache>(disk_cache::default_directory(),
+                                               default_disk_cache_size)),
+      icon_loader_(std::make_shared<icon_loader>(disk_cache_, false)),
+      image_loader_(std::make_shared<icon_loader>(disk_cache_, true)),
+      emoji_loader_(
+          std::make_shared<emoji_loader>(emoji_directory, disk_cache_)),
+      file_downloader_(std::make_shared<file_downloader>(
+          disk_cache_, api_client->token())),
+      link_preview_loader_(std::make_shared<link_preview_loader>(disk_cache_)),
+      read_marker_manager_(std::make_shared<read_marker_manager>(api_client)),
+      code_highlighter_(std::make_shared<code_highlighter>()),
+      highlight_matcher_(
+          std::make_shared<highlight_matcher>(json["self"]["id"].asString())) {
+  image_loader_->set_memory_cache_budget(image_memory_cache_budget);
 }
 
 team::~team() {
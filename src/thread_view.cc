@@ -0,0 +1,301 @@
+#include "thread_view.h"
+#include <algorithm>
+#include <iostream>
+#include "api_client.h"
+#include "message_row.h"
+
+// Number of replies requested per conversations.replies page
+static const int replies_page_size = 50;
+// Replies beyond this number are unloaded from the end opposite to the one
+// being loaded.
+static const std::size_t max_rendered_replies = 200;
+
+// Removes the ts between oldest and latest, inclusive. ts compare as strings
+// since their integer and fractional parts have fixed widths.
+static void forget_range(std::deque<std::string>& unloaded,
+                         const std::string& oldest,
+                         const std::string& latest) {
+  unloaded.erase(std::remove_if(unloaded.begin(), unloaded.end(),
+                                [&](const std::string& ts) {
+                                  return oldest <= ts && ts <= latest;
+                                }),
+                 unloaded.end());
+}
+
+ThreadView::ThreadView(team& team, std::shared_ptr<settings_snapshot> settings,
+                       const std::string& channel_id,
+                       const std::string& thread_ts)
+    : Gtk::Box(Gtk::ORIENTATION_VERTICAL),
+      team_(team),
+      settings_(settings),
+      channel_id_(channel_id),
+      thread_ts_(thread_ts),
+      earlier_button_("Show earlier replies"),
+      replies_list_box_(),
+      more_button_("Show more replies"),
+      rows_by_ts_(),
+      shown_rows_(),
+      older_unloaded_(),
+      newer_unloaded_(),
+      requested_oldest_(),
+      requested_latest_(),
+      next_cursor_(),
+      loading_(false),
+      has_more_(true) {
+  pack_start(earlier_button_, Gtk::PACK_SHRINK);
+  pack_start(replies_list_box_);
+  pack_start(more_button_, Gtk::PACK_SHRINK);
+  replies_list_box_.set_selection_mode(Gtk::SELECTION_NONE);
+  earlier_button_.set_relief(Gtk::RELIEF_NONE);
+  earlier_button_.signal_clicked().connect(
+      sigc::mem_fun(*this, &ThreadView::load_earlier));
+  more_button_.set_relief(Gtk::RELIEF_NONE);
+  more_button_.signal_clicked().connect(
+      sigc::mem_fun(*this, &ThreadView::load_more));
+
+  show_all_children();
+  earlier_button_.hide();
+  more_button_.hide();
+}
+
+ThreadView::~ThreadView() {
+}
+
+void ThreadView::load_more() {
+  if (loading_) {
+    return;
+  }
+  std::map<std::string, std::string> params;
+  if (!newer_unloaded_.empty()) {
+    // Unloaded replies come first, with the range they span.
+    const std::size_t count =
+        std::min<std::size_t>(replies_page_size, newer_unloaded_.size());
+    params["oldest"] = newer_unloaded_.front();
+    params["latest"] = newer_unloaded_[count - 1];
+    request_replies(params, unloaded_newer);
+  } else if (has_more_) {
+    if (!next_cursor_.empty()) {
+      params["cursor"] = next_cursor_;
+    }
+    request_replies(params, next_page);
+  }
+}
+
+void ThreadView::load_earlier() {
+  if (loading_ || older_unloaded_.empty()) {
+    return;
+  }
+  const std::size_t count =
+      std::min<std::size_t>(replies_page_size, older_unloaded_.size());
+  std::map<std::string, std::string> params;
+  params["oldest"] = older_unloaded_[older_unloaded_.size() - count];
+  params["latest"] = older_unloaded_.back();
+  request_replies(params, unloaded_older);
+}
+
+void ThreadView::request_replies(std::map<std::string, std::string> params,
+                                 page_type type) {
+  loading_ = true;
+  earlier_button_.set_sensitive(false);
+  more_button_.set_sensitive(false);
+
+  params["channel"] = channel_id_;
+  params["ts"] = thread_ts_;
+  if (type == next_page) {
+    params["limit"] = std::to_string(replies_page_size);
+  } else {
+    requested_oldest_ = params["oldest"];
+    requested_latest_ = params["latest"];
+    params["inclusive"] = "true";
+    // One more for the parent
+    params["limit"] = std::to_string(replies_page_size + 1);
+  }
+  // The view goes away when the thread is collapsed or the row is unloaded,
+  // possibly before the response arrives. The slot is invalidated then.
+  sigc::slot<void, const boost::optional<Json::Value>&> slot =
+      sigc::bind(sigc::mem_fun(*this, &ThreadView::on_replies), type);
+  team_.api_client_->queue_post(
+      "conversations.replies", params,
+      [slot](const boost::optional<Json::Value>& result) { slot(result); });
+}
+
+void ThreadView::on_replies(const boost::optional<Json::Value>& result,
+                            page_type type) {
+  loading_ = false;
+  earlier_button_.set_sensitive(true);
+  more_button_.set_sensitive(true);
+  if (!result || !result.get()["ok"].asBool()) {
+    std::cerr << "[ThreadView] failed to load replies of " << thread_ts_
+              << std::endl;
+    update_buttons();
+    return;
+  }
+
+  const Json::Value& root = result.get();
+  int position = 0;
+  for (const Json::Value& message : root["messages"]) {
+    // The parent is included in every page.
+    if (message["ts"].asString() == thread_ts_) {
+      continue;
+    }
+    if (type == unloaded_older) {
+      insert_reply(message, position++);
+    } else {
+      insert_reply(message, -1);
+    }
+  }
+
+  if (type == next_page) {
+    next_cursor_ = root["response_metadata"]["next_cursor"].asString();
+    has_more_ = root["has_more"].asBool() && !next_cursor_.empty();
+    unload_oldest_replies();
+  } else if (type == unloaded_newer) {
+    // Replies deleted in the meantime are just missing.
+    forget_range(newer_unloaded_, requested_oldest_, requested_latest_);
+    unload_oldest_replies();
+  } else {
+    forget_range(older_unloaded_, requested_oldest_, requested_latest_);
+    unload_newest_replies();
+  }
+  update_buttons();
+}
+
+void ThreadView::add_reply(const Json::Value& payload) {
+  if (has_more_) {
+    // It comes with a later page.
+    return;
+  }
+  if (!newer_unloaded_.empty()) {
+    // It's fetched after the unloaded replies.
+    newer_unloaded_.push_back(payload["ts"].asString());
+    update_buttons();
+    return;
+  }
+  insert_reply(payload, -1);
+  unload_oldest_replies();
+  update_buttons();
+}
+
+void ThreadView::update_reply(const Json::Value& payload) {
+  auto it = rows_by_ts_.find(payload["ts"].asString());
+  if (it != rows_by_ts_.end()) {
+    it->second->update(payload);
+  }
+}
+
+void ThreadView::remove_reply(const std::string& ts) {
+  forget_range(older_unloaded_, ts, ts);
+  forget_range(newer_unloaded_, ts, ts);
+  auto it = rows_by_ts_.find(ts);
+  if (it != rows_by_ts_.end()) {
+    delete_row(it->second);
+  }
+  update_buttons();
+}
+
+void ThreadView::redraw_messages() {
+  for (const auto& p : rows_by_ts_) {
+    p.second->redraw_message();
+  }
+}
+
+void ThreadView::rescale_images() {
+  for (const auto& p : rows_by_ts_) {
+    p.second->rescale_images();
+  }
+}
+
+void ThreadView::update_on_screen_rows(double top, double bottom,
+                                       double margin) {
+  // Rows are allocated in the list box's coordinates.
+  int x = 0;
+  int y = 0;
+  if (!translate_coordinates(replies_list_box_, 0, 0, x, y)) {
+    return;
+  }
+  top += y;
+  bottom += y;
+
+  // The viewport may start above the thread.
+  Gtk::ListBoxRow* first = replies_list_box_.get_row_at_y(std::max(0.0, top));
+  if (first != nullptr) {
+    for (int i = first->get_index();; ++i) {
+      Gtk::ListBoxRow* row = replies_list_box_.get_row_at_index(i);
+      if (row == nullptr || row->get_allocation().get_y() > bottom) {
+        break;
+      }
+      MessageRow* reply = static_cast<MessageRow*>(row);
+      reply->set_on_screen();
+      shown_rows_.insert(reply->ts());
+    }
+  }
+
+  for (auto it = shown_rows_.begin(); it != shown_rows_.end();) {
+    MessageRow* row = rows_by_ts_.at(*it);
+    const Gtk::Allocation allocation = row->get_allocation();
+    if (allocation.get_y() + allocation.get_height() < top - margin ||
+        allocation.get_y() > bottom + margin) {
+      row->set_off_screen();
+      it = shown_rows_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void ThreadView::set_off_screen() {
+  for (const std::string& ts : shown_rows_) {
+    rows_by_ts_.at(ts)->set_off_screen();
+  }
+  shown_rows_.clear();
+}
+
+void ThreadView::insert_reply(const Json::Value& payload, int position) {
+  const std::string ts = payload["ts"].asString();
+  if (rows_by_ts_.count(ts) != 0) {
+    return;
+  }
+  auto row = Gtk::manage(
+      new MessageRow(team_, settings_, channel_id_, payload, false));
+  replies_list_box_.insert(*row, position);
+  rows_by_ts_.emplace(ts, row);
+  row->signal_channel_link_clicked().connect(
+      signal_channel_link_clicked_.make_slot());
+  // Set on screen by update_on_screen_rows once it's allocated
+  row->show();
+}
+
+void ThreadView::delete_row(MessageRow* row) {
+  rows_by_ts_.erase(row->ts());
+  shown_rows_.erase(row->ts());
+  replies_list_box_.remove(*row);
+  delete row;
+}
+
+void ThreadView::unload_oldest_replies() {
+  std::vector<Gtk::Widget*> rows = replies_list_box_.get_children();
+  for (std::size_t i = 0; i + max_rendered_replies < rows.size(); ++i) {
+    MessageRow* row = static_cast<MessageRow*>(rows[i]);
+    older_unloaded_.push_back(row->ts());
+    delete_row(row);
+  }
+}
+
+void ThreadView::unload_newest_replies() {
+  std::vector<Gtk::Widget*> rows = replies_list_box_.get_children();
+  for (std::size_t i = rows.size(); i > max_rendered_replies; --i) {
+    MessageRow* row = static_cast<MessageRow*>(rows[i - 1]);
+    newer_unloaded_.push_front(row->ts());
+    delete_row(row);
+  }
+}
+
+void ThreadView::update_buttons() {
+  earlier_button_.set_visible(!older_unloaded_.empty());
+  more_button_.set_visible(has_more_ || !newer_unloaded_.empty());
+}
+
+sigc::signal<void, const std::string&>
+ThreadView::signal_channel_link_clicked() {
+  return signal_channel_link_clicked_;
+}